@@ -0,0 +1,1140 @@
+/*
+ * bench.c
+ *
+ * Benchmarks for crrd
+ *
+ * Like test.c, this includes the library sources:
+ *
+ * gcc -O2 bench.c -o bench
+ * ./bench [-t threads] [-n max_series] [-j file.json] [benchmark ...]
+ *
+ * The benchmarks are:
+ *
+ *   add      rrd_add_at: same period updates, rollovers, long gaps
+ *   tiers    dbrrd_add_at into 1..12 tiers
+ *   query    dbrrd_query point lookups answered by each tier
+ *   range    range scans: rrd_get over a ring, dbrrd_query over time
+ *   txg      a year of one second txgs into the 10y/365d/1440m layout
+ *   batch    dbrrd_add_batch, serial against the thread pool
+ *   multi    dbrrd_add_at loop against dbrrd_add_multi, by series count
+ *   reorder  jittered samples through a reorder buffer of k entries
+ *   clock    crrd_now() from each clock, and dbrrd_add with each, and
+ *            dbrrd_add_tick with a 1ms ticker
+ *   fill     catching up after idle gaps: zero() calls against fill
+ *            kinds (rrd_setfill), written or lazy (rrd_setlazy)
+ *   crrdd    samples through the daemon, from one client, to 1..10000
+ *            series
+ *
+ * With no benchmark named, all are run. Each result is reported as
+ * ns/op and samples (or ops) per second, timed with CLOCK_MONOTONIC,
+ * and with cache misses per op where perf_event_open() lets us count
+ * them (see /proc/sys/kernel/perf_event_paranoid). -j writes the
+ * results as JSON ("-" for stdout) for tracking regressions.
+ */
+
+#define _XOPEN_SOURCE 700
+#ifndef _DEFAULT_SOURCE
+#  define _DEFAULT_SOURCE
+#endif
+#define _GNU_SOURCE
+#ifndef TESTING
+#  define TESTING
+#endif
+
+#ifdef CRRD_LIB
+#  include <stdlib.h>
+#  include <string.h>
+#  include <time.h>
+#  include <pthread.h>
+#  include "crrd.h"
+#  include "crrdd.h"
+#else
+#  include "crrd.c"
+#  include "crrd_group.c"
+#  include "crrd_wheel.c"
+#  include "crrd_pool.c"
+#  include "crrd_reorder.c"
+#  include "crrd_ticker.c"
+#  include "crrd_line.c"
+#  include "crrd_statsd.c"
+#  include "crrdd.c"
+#  include "crrdc.c"
+#endif
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdarg.h>
+#ifdef __linux__
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <linux/perf_event.h>
+#endif
+
+#define SEC2HR(s) ((hrtime_t)((s) * 1000LL * 1000LL * 1000LL))
+
+#define	BENCH_MAX	256
+
+typedef struct bench_result {
+	char name[64];
+	long ops;		/* operations timed */
+	long samples;		/* samples ingested by them, 0 for queries */
+	hrtime_t ns;		/* wall time */
+	long long misses;	/* cache misses, -1 if not counted */
+} bench_result_t;
+
+static bench_result_t results[BENCH_MAX];
+static int nresults;
+static int perf_fd = -1;
+static hrtime_t bench_t0;
+
+static hrtime_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+/* Open a cache miss counter for this thread, if we are allowed */
+static void
+perf_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof (pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof (pe);
+	pe.config = PERF_COUNT_HW_CACHE_MISSES;
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	perf_fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#endif
+}
+
+/* Start timing (and counting) */
+static void
+bench_begin(void)
+{
+#ifdef __linux__
+	if (perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	bench_t0 = bench_now();
+}
+
+/* Stop, and record the result of ops operations ingesting samples */
+static bench_result_t *
+bench_end(long ops, long samples, const char *fmt, ...)
+{
+	bench_result_t *b;
+	hrtime_t ns;
+	long long misses = -1;
+	va_list ap;
+
+	ns = bench_now() - bench_t0;
+#ifdef __linux__
+	if (perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf_fd, &misses, sizeof (misses)) !=
+		    sizeof (misses)) {
+			misses = -1;
+		}
+	}
+#endif
+	if (nresults >= BENCH_MAX) {
+		fprintf(stderr, "too many results\n");
+		exit(EXIT_FAILURE);
+	}
+	b = &results[nresults++];
+	va_start(ap, fmt);
+	vsnprintf(b->name, sizeof (b->name), fmt, ap);
+	va_end(ap);
+	b->ops = ops;
+	b->samples = samples;
+	b->ns = ns;
+	b->misses = misses;
+
+	printf("%-36s %12.1f %14.0f", b->name, (double)ns / ops,
+		(samples ? samples : ops) * 1e9 / ns);
+	if (misses >= 0) {
+		printf(" %10.2f", (double)misses / ops);
+	}
+	printf("\n");
+	fflush(stdout);
+	return (b);
+}
+
+static void
+bench_json(FILE *f, int threads)
+{
+	bench_result_t *b;
+
+	fprintf(f, "{\n  \"isa\": \"%s\",\n  \"threads\": %d,\n",
+		dbrrd_group_isa(), threads);
+	fprintf(f, "  \"benchmarks\": [\n");
+	for (int i = 0; i < nresults; ++i) {
+		b = &results[i];
+		fprintf(f, "    { \"name\": \"%s\", \"ops\": %ld, "
+			"\"samples\": %ld, \"ns\": %lld, \"ns_per_op\": %.3f, "
+			"\"per_sec\": %.1f, \"cache_misses\": %lld }%s\n",
+			b->name, b->ops, b->samples, (long long)b->ns,
+			(double)b->ns / b->ops,
+			(b->samples ? b->samples : b->ops) * 1e9 / b->ns,
+			b->misses, (i == nresults - 1) ? "" : ",");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+/* Running average, as f_update in test.c */
+static void
+f_update(rrd_t *r, void *pv)
+{
+	float *old = rrd_entry(r, rrd_tail(r));
+
+	*old += (*(float *)pv - *old) / 8;
+}
+
+static void
+f_zero(rrd_t *r, void *pv)
+{
+	memcpy(rrd_entry(r, rrd_tail(r)), pv, sizeof (float));
+}
+
+/*
+ * A heavyweight entry: a histogram of r->size / 4 buckets. Samples
+ * are histograms too, and update() merges them bucket by bucket, as
+ * a sketch or histogram rrd would.
+ */
+static void
+hist_update(rrd_t *r, void *pv)
+{
+	uint32_t *d = rrd_entry(r, rrd_tail(r));
+	uint32_t *s = pv;
+	size_t n = r->size / sizeof (uint32_t);
+
+	for (size_t i = 0; i < n; ++i)
+		d[i] += s[i];
+}
+
+static void
+hist_zero(rrd_t *r, void *pv)
+{
+	memcpy(rrd_entry(r, rrd_tail(r)), pv, r->size);
+}
+
+/* txg ranges, as in test.c */
+typedef struct txg_store {
+	uint64_t l;
+	uint64_t h;
+} txg_store_t;
+
+static void
+txg_update(rrd_t *r, void *pv)
+{
+	txg_store_t *old = rrd_entry(r, rrd_tail(r));
+	txg_store_t *new = pv;
+
+	if (new->l < old->l)
+		old->l = new->l;
+	if (new->h > old->h)
+		old->h = new->h;
+}
+
+static void
+txg_zero(rrd_t *r, void *pv)
+{
+	int n;
+
+	pv = pv;
+	n = (rrd_tail(r) == 0) ? rrd_capacity(r) - 1 : rrd_tail(r) - 1;
+	memcpy(rrd_entry(r, rrd_tail(r)), rrd_entry(r, n), r->size);
+}
+
+/*
+ * Create a database of ntiers rrds of 128 slots. The finest is one
+ * second, and each coarser tier doubles it.
+ */
+static rrd_t *
+bench_db(int ntiers, size_t sz, void *update, void *zero)
+{
+	dbrrd_spec_t spec[13];
+	int i;
+
+	for (i = 0; i < ntiers; ++i) {
+		spec[i].capacity = 128;
+		spec[i].tv = SEC2HR(1LL << (ntiers - 1 - i));
+	}
+	spec[i].capacity = 0;
+	spec[i].tv = 0;
+	return (dbrrd_create("bench", spec, sz, update, zero));
+}
+
+static rrd_t *
+bench_rrd(hrtime_t res, int cap)
+{
+	rrd_t *r;
+
+	r = rrd_create("bench", res, cap, sizeof (float));
+	if (r == NULL) {
+		fprintf(stderr, "rrd_create failed\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_setfunctions(r, f_update, f_zero);
+	return (r);
+}
+
+/*
+ * rrd_add_at on one rrd of 60 one second slots:
+ *   same_period  every sample lands in the current period (update)
+ *   rollover     every sample starts the next period (forward, store)
+ *   gap1000      every sample skips 1000 periods (1000 zero fills)
+ */
+static void
+bench_add(void)
+{
+	long n = 10000000;
+	rrd_t *r;
+	float v = 5.0;
+
+	r = bench_rrd(SEC2HR(1), 60);
+	bench_begin();
+	for (long i = 0; i < n; ++i) {
+		rrd_add_at(r, &v, i);
+	}
+	bench_end(n, n, "rrd_add_at/same_period");
+	rrd_destroy(r);
+
+	r = bench_rrd(SEC2HR(1), 60);
+	bench_begin();
+	for (long i = 0; i < n; ++i) {
+		rrd_add_at(r, &v, SEC2HR(i));
+	}
+	bench_end(n, n, "rrd_add_at/rollover");
+	rrd_destroy(r);
+
+	n = 20000;
+	r = bench_rrd(SEC2HR(1), 60);
+	bench_begin();
+	for (long i = 0; i < n; ++i) {
+		rrd_add_at(r, &v, SEC2HR(i * 1000));
+	}
+	bench_end(n, n, "rrd_add_at/gap1000");
+	rrd_destroy(r);
+}
+
+/* dbrrd_add_at, half a second apart, into 1..12 tiers */
+static void
+bench_tiers(void)
+{
+	long n = 2000000;
+	float v = 5.0;
+	rrd_t *h;
+
+	for (int k = 1; k <= 12; ++k) {
+		h = bench_db(k, sizeof (float), f_update, f_zero);
+		bench_begin();
+		for (long i = 0; i < n; ++i) {
+			dbrrd_add_at(h, &v, SEC2HR(i) / 2);
+		}
+		bench_end(n, n, "dbrrd_add_at/tiers=%d", k);
+		dbrrd_destroy(h);
+	}
+}
+
+/*
+ * Point lookups in a full 12 tier database, for times that only
+ * tier k (and coarser) covers. The query times walk over tier k's
+ * part of the history.
+ */
+static void
+bench_query(void)
+{
+	long n = 2000000;
+	hrtime_t lo, hi, step, tv, res;
+	rrd_t *h, *r;
+	float v = 5.0;
+	void *p;
+	long found;
+	int k;
+
+	h = bench_db(12, sizeof (float), f_update, f_zero);
+	for (long i = 0; i < 128L << 12; ++i) {
+		dbrrd_add_at(h, &v, SEC2HR(i));
+	}
+	hi = h->last;
+	for (r = h, k = 0; r != NULL; r = r->next, ++k) {
+		lo = r->start - r->resolution * (rrd_len(r) - 1);
+		step = (hi - lo) / 1024 + 1;
+		found = 0;
+		tv = lo;
+		bench_begin();
+		for (long i = 0; i < n; ++i) {
+			found += dbrrd_query(h, tv, &p, &res);
+			tv += step;
+			if (tv > hi) {
+				tv = lo;
+			}
+		}
+		bench_end(n, 0, "dbrrd_query/tier=%d", k);
+		if (found != n) {
+			fprintf(stderr, "query tier %d: %ld of %ld\n",
+				k, found, n);
+		}
+		hi = lo - 1;
+	}
+	dbrrd_destroy(h);
+}
+
+/*
+ * Range scans. rrd_get over every slot of a full 3600 slot ring, and
+ * dbrrd_query stepping a second at a time over its last hour.
+ */
+static void
+bench_range(void)
+{
+	long rounds = 2000;
+	hrtime_t res;
+	rrd_t *h;
+	float v = 5.0;
+	float sum = 0;
+	void *p;
+	dbrrd_spec_t spec[] = {
+		{ 24, SEC2HR(3600) },
+		{ 3600, SEC2HR(1) },
+		{ 0, 0 },
+	};
+
+	h = dbrrd_create("range", spec, sizeof (float), f_update, f_zero);
+	for (long i = 0; i < 86400; ++i) {
+		dbrrd_add_at(h, &v, SEC2HR(i));
+	}
+	bench_begin();
+	for (long k = 0; k < rounds; ++k) {
+		for (int i = 0; i < rrd_len(h); ++i) {
+			sum += *(float *)rrd_get(h, i);
+		}
+	}
+	bench_end(rounds * rrd_len(h), 0, "range/rrd_get");
+	bench_begin();
+	for (long k = 0; k < rounds; ++k) {
+		for (long s = 86400 - 3600; s < 86400; ++s) {
+			if (dbrrd_query(h, SEC2HR(s), &p, &res)) {
+				sum += *(float *)p;
+			}
+		}
+	}
+	bench_end(rounds * 3600, 0, "range/dbrrd_query");
+	if (sum == 0) {
+		fprintf(stderr, "range: no data?\n");
+	}
+	dbrrd_destroy(h);
+}
+
+/*
+ * A year of one txg a second into the txg layout of test.c (10 years,
+ * 365 days, 1440 minutes). This is the measurement that used to be a
+ * comment in txg1.
+ */
+static void
+bench_txg(void)
+{
+	long n = 31536000;
+	txg_store_t s;
+	rrd_t *h;
+	dbrrd_spec_t spec[] = {
+		{   10, SEC2HR(31536000) },
+		{  365, SEC2HR(86400) },
+		{ 1440, SEC2HR(60) },
+		{ 0, 0 },
+	};
+
+	h = dbrrd_create("txg", spec, sizeof (txg_store_t),
+		txg_update, txg_zero);
+	bench_begin();
+	for (long i = 0; i < n; ++i) {
+		s.l = s.h = i + 1;
+		dbrrd_add_at(h, &s, SEC2HR(i));
+	}
+	bench_end(n, n, "txg/year");
+	dbrrd_destroy(h);
+}
+
+/*
+ * Serial against parallel batch ingest (dbrrd_add_batch and
+ * dbrrd_add_batch_parallel), for 1..12 tiers and histograms of
+ * 1, 64 and 1024 buckets. Each sample is half a second after the
+ * last, so there are both same-period updates and rollovers.
+ */
+static void
+bench_batch(crrd_pool_t *pool)
+{
+	static int tiers[] = { 1, 2, 4, 8, 12 };
+	static int buckets[] = { 1, 64, 1024 };
+	int n = 20000;
+	hrtime_t *t;
+	uint32_t *v;
+	rrd_t *h;
+
+	t = malloc(n * sizeof (hrtime_t));
+	v = malloc((size_t)n * 1024 * sizeof (uint32_t));
+	if ((t == NULL) || (v == NULL)) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < n; ++i) {
+		t[i] = SEC2HR(i) / 2;
+	}
+	for (int b = 0; b < 3; ++b) {
+		for (size_t i = 0; i < (size_t)n * buckets[b]; ++i) {
+			v[i] = i & 7;
+		}
+		for (int k = 0; k < 5; ++k) {
+			h = bench_db(tiers[k], buckets[b] * sizeof (uint32_t),
+				hist_update, hist_zero);
+			bench_begin();
+			dbrrd_add_batch(h, v, t, n);
+			bench_end(n, n, "batch/serial/tiers=%d/buckets=%d",
+				tiers[k], buckets[b]);
+			dbrrd_destroy(h);
+
+			h = bench_db(tiers[k], buckets[b] * sizeof (uint32_t),
+				hist_update, hist_zero);
+			bench_begin();
+			dbrrd_add_batch_parallel(pool, h, v, t, n);
+			bench_end(n, n, "batch/parallel/tiers=%d/buckets=%d",
+				tiers[k], buckets[b]);
+			dbrrd_destroy(h);
+		}
+	}
+	free(t);
+	free(v);
+}
+
+/*
+ * Many independent databases, one sample each per scrape, as
+ * dbrrd_add_at() in a loop against dbrrd_add_multi(). The databases
+ * are visited in a shuffled order, as they would be spread over the
+ * heap in a long running process; with that, the loop takes a miss
+ * on each header and then on each slot.
+ *
+ * Each database is one tier of 60 one second floats, and scrapes are
+ * half a second apart: every other scrape rolls the period over.
+ */
+static void
+bench_multi(long max)
+{
+	rrd_t **h;
+	float *v;
+	rrd_t *tmp;
+	dbrrd_spec_t spec[] = { { 60, SEC2HR(1) }, { 0, 0 } };
+	long rounds, s, n, i, j;
+
+	h = malloc(max * sizeof (rrd_t *));
+	v = malloc(max * sizeof (float));
+	if ((h == NULL) || (v == NULL)) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < max; ++i) {
+		v[i] = i & 255;
+	}
+	for (n = 1000; n <= max; n *= 10) {
+		for (i = 0; i < n; ++i) {
+			h[i] = dbrrd_create("multi", spec, sizeof (float),
+				f_update, f_zero);
+			if (h[i] == NULL) {
+				fprintf(stderr, "out of memory at %ld\n", i);
+				exit(EXIT_FAILURE);
+			}
+		}
+		srandom(1);
+		for (i = n - 1; i > 0; --i) {
+			j = random() % (i + 1);
+			tmp = h[i];
+			h[i] = h[j];
+			h[j] = tmp;
+		}
+		/* About 20 million samples per method, at least 4 rounds */
+		rounds = 20000000 / n;
+		if (rounds < 4) {
+			rounds = 4;
+		}
+		s = 0;
+		bench_begin();
+		for (long r = 0; r < rounds; ++r, ++s) {
+			for (i = 0; i < n; ++i) {
+				dbrrd_add_at(h[i], &v[i], SEC2HR(s) / 2);
+			}
+		}
+		bench_end(n * rounds, n * rounds, "multi/loop/series=%ld", n);
+		bench_begin();
+		for (long r = 0; r < rounds; ++r, ++s) {
+			dbrrd_add_multi(h, n, v, SEC2HR(s) / 2);
+		}
+		bench_end(n * rounds, n * rounds, "multi/prefetch/series=%ld",
+			n);
+		for (i = 0; i < n; ++i) {
+			dbrrd_destroy(h[i]);
+		}
+	}
+	free(h);
+	free(v);
+}
+
+/*
+ * The cost of a reorder buffer: a 4 tier database fed samples a
+ * quarter second apart, each up to jitter out of place, directly (in
+ * order, as a baseline) and through buffers of k entries holding each
+ * sample for the jitter.
+ */
+static void
+bench_reorder(void)
+{
+	long n = 4000000;
+	hrtime_t *t;
+	float v = 5.0;
+	crrd_reorder_t *q;
+	rrd_t *h;
+	long i;
+
+	t = malloc(n * sizeof (hrtime_t));
+	if (t == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	srandom(1);
+	for (i = 0; i < n; ++i) {
+		t[i] = SEC2HR(i) / 4 + random() % SEC2HR(2);
+	}
+	h = bench_db(4, sizeof (float), f_update, f_zero);
+	bench_begin();
+	for (i = 0; i < n; ++i) {
+		dbrrd_add_at(h, &v, SEC2HR(i) / 4);
+	}
+	bench_end(n, n, "reorder/direct");
+	dbrrd_destroy(h);
+	for (int k = 16; k <= 1024; k *= 4) {
+		h = bench_db(4, sizeof (float), f_update, f_zero);
+		q = crrd_reorder_create(h, k, SEC2HR(2));
+		if ((h == NULL) || (q == NULL)) {
+			fprintf(stderr, "crrd_reorder_create failed\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_begin();
+		for (i = 0; i < n; ++i) {
+			crrd_reorder_add(q, &v, t[i]);
+		}
+		crrd_reorder_flush(q);
+		bench_end(n, n, "reorder/k=%d", k);
+		crrd_reorder_destroy(q);
+		dbrrd_destroy(h);
+	}
+	free(t);
+}
+
+/*
+ * What reading the time costs with each clock crrd_setclock() offers,
+ * alone and as part of dbrrd_add into a 4 tier database.
+ */
+static void
+bench_clock(void)
+{
+	static const int kinds[] = {
+		CRRD_CLOCK_REALTIME, CRRD_CLOCK_MONOTONIC,
+		CRRD_CLOCK_REALTIME_COARSE, CRRD_CLOCK_TSC, CRRD_CLOCK_CACHED
+	};
+	static const char *names[] = {
+		"realtime", "monotonic", "realtime_coarse", "tsc", "cached"
+	};
+	long n = 10000000;
+	volatile hrtime_t sink;
+	float v = 5.0;
+	rrd_t *h;
+
+	crrd_setnow(bench_now());
+	for (int k = 0; k < 5; ++k) {
+		if (!crrd_setclock(kinds[k])) {
+			continue;
+		}
+		bench_begin();
+		for (long i = 0; i < n; ++i) {
+			sink = crrd_now();
+		}
+		bench_end(n, 0, "clock/crrd_now/%s", names[k]);
+		h = bench_db(4, sizeof (float), f_update, f_zero);
+		bench_begin();
+		for (long i = 0; i < n; ++i) {
+			dbrrd_add(h, &v);
+		}
+		bench_end(n, n, "clock/dbrrd_add/%s", names[k]);
+		dbrrd_destroy(h);
+	}
+	(void) sink;
+	(void) crrd_setclock(CRRD_CLOCK_REALTIME);
+
+	{
+		hrtime_t res[4];
+		crrd_ticker_t *k;
+
+		h = bench_db(4, sizeof (float), f_update, f_zero);
+		for (int i = 0; i < 4; ++i) {
+			res[i] = SEC2HR(1LL << i);
+		}
+		k = crrd_ticker_create(SEC2HR(1) / 1000, res, 4);
+		if (k == NULL) {
+			fprintf(stderr, "crrd_ticker_create failed\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_begin();
+		for (long i = 0; i < n; ++i) {
+			dbrrd_add_tick(k, h, &v);
+		}
+		bench_end(n, n, "clock/dbrrd_add_tick");
+		crrd_ticker_destroy(k);
+		dbrrd_destroy(h);
+	}
+}
+
+/*
+ * Catch-up after idle: txg ranges and running averages in a 1440
+ * slot minute rrd, each sample after a gap of 1 to 2048 periods, with
+ * zero() called per period against the fill kind doing it in runs.
+ */
+static void
+bench_fill(void)
+{
+	long n = 200000;
+	txg_store_t s;
+	float v = 1;
+	rrd_t *r;
+	hrtime_t t;
+
+	for (int gap = 1; gap <= 2048; gap *= 8) {
+		for (int kind = 0; kind < 3; ++kind) {
+			r = rrd_create("fill", SEC2HR(60), 1440,
+			    sizeof (txg_store_t));
+			rrd_setfunctions(r, txg_update, txg_zero);
+			if (kind) {
+				rrd_setfill(r, RRD_FILL_PREV, NULL);
+				rrd_setlazy(r, kind == 2);
+			}
+			t = 0;
+			bench_begin();
+			for (long i = 0; i < n; ++i) {
+				s.l = s.h = i + 1;
+				rrd_add_at(r, &s, t);
+				t += SEC2HR(60) * gap;
+			}
+			bench_end(n, n, "fill/txg/%s/gap%d", (kind == 2) ?
+			    "lazy" : kind ? "prev" : "zero()", gap);
+			rrd_destroy(r);
+
+			r = bench_rrd(SEC2HR(60), 1440);
+			if (kind) {
+				rrd_setfill(r, RRD_FILL_VALUE, NULL);
+				rrd_setlazy(r, kind == 2);
+			}
+			t = 0;
+			bench_begin();
+			for (long i = 0; i < n; ++i) {
+				rrd_add_at(r, &v, t);
+				t += SEC2HR(60) * gap;
+			}
+			bench_end(n, n, "fill/float/%s/gap%d", (kind == 2) ?
+			    "lazy" : kind ? "value" : "zero()", gap);
+			rrd_destroy(r);
+		}
+	}
+}
+
+/*
+ * Samples through crrdd: a daemon on a thread, one client sending
+ * round robin over nseries series of three tiers, timed to the last
+ * sample taken (crrdc_sync). The client sends full batches over the
+ * socket, then (shm) puts samples in a shared ring.
+ */
+static void *
+bench_crrdd_thread(void *arg)
+{
+	crrdd_run(arg);
+	return (NULL);
+}
+
+static void
+bench_crrdd(void)
+{
+	dbrrd_spec_t spec[] = {
+		{ 24, SEC2HR(3600) },
+		{ 60, SEC2HR(60) },
+		{ 60, SEC2HR(1) },
+		{ 0, 0 },
+	};
+	long n = 5000000;
+	char path[64], name[32];
+	pthread_t thread;
+	crrdd_t *d;
+	crrdc_t *c;
+	uint64_t taken;
+	int id, id0;
+
+	snprintf(path, sizeof (path), "/tmp/crrdd_bench.%d.sock",
+	    (int)getpid());
+	d = crrdd_create(path);
+	if ((d == NULL) ||
+	    (pthread_create(&thread, NULL, bench_crrdd_thread, d) != 0)) {
+		fprintf(stderr, "crrdd: no daemon\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int shm = 0; shm <= 1; ++shm) {
+		c = crrdc_open(path);
+		if ((c == NULL) || (shm && (crrdc_shm(c, 65536) != 0))) {
+			fprintf(stderr, "crrdd: cannot connect\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int nseries = 1; nseries <= 10000; nseries *= 100) {
+			id0 = -1;
+			for (int i = 0; i < nseries; ++i) {
+				snprintf(name, sizeof (name), "s%d.%d.%d",
+				    shm, nseries, i);
+				id = crrdc_create(c, name, CRRDD_AGG_SUM, spec);
+				if (id < 0) {
+					fprintf(stderr,
+					    "crrdd: create failed\n");
+					exit(EXIT_FAILURE);
+				}
+				if (id0 < 0) {
+					id0 = id;
+				}
+			}
+			bench_begin();
+			for (long i = 0; i < n; ++i) {
+				crrdc_add(c, id0 + i % nseries,
+				    SEC2HR(i / nseries) + i % nseries, 1.0);
+			}
+			crrdc_sync(c, &taken);
+			bench_end(n, n, "crrdd/%s/series%d",
+			    shm ? "shm" : "socket", nseries);
+		}
+		crrdc_close(c);
+	}
+	crrdd_stop(d);
+	pthread_join(thread, NULL);
+	crrdd_destroy(d);
+}
+
+/*
+ * Text ingest: Graphite lines for 100 series of three tiers (bench_db),
+ * a second apart per series, parsed only, parsed into the dbrrds, and,
+ * for comparison, the same samples added to them directly.
+ */
+#define	LINE_SERIES	100
+
+typedef struct line_series {
+	char name[32];
+	size_t len;
+	rrd_t *h;
+} line_series_t;
+
+static line_series_t line_series[LINE_SERIES];
+static int line_hash[2 * 128];		/* index + 1, 0 for empty */
+
+static unsigned
+line_fnv(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return (h & (2 * 128 - 1));
+}
+
+static rrd_t *
+line_find(void *arg, const char *name, size_t len)
+{
+	line_series_t *ls;
+	unsigned i;
+	int e;
+
+	arg = arg;
+	for (i = line_fnv(name, len); (e = line_hash[i]) != 0;
+	    i = (i + 1) & (2 * 128 - 1)) {
+		ls = &line_series[e - 1];
+		if ((ls->len == len) && (memcmp(ls->name, name, len) == 0)) {
+			return (ls->h);
+		}
+	}
+	return (NULL);
+}
+
+static void
+line_count(void *arg, const char *name, size_t len, double v, hrtime_t t)
+{
+	++*(long *)arg;
+}
+
+static void
+d_update(rrd_t *r, void *pv)
+{
+	*(double *)rrd_entry(r, rrd_tail(r)) += *(double *)pv;
+}
+
+static void
+d_zero(rrd_t *r, void *pv)
+{
+	*(double *)rrd_entry(r, rrd_tail(r)) = 0;
+}
+
+static void
+bench_line(void)
+{
+	long n = 2000000, got = 0;
+	size_t len = 0, used;
+	crrd_line_stats_t st;
+	bench_result_t *b;
+	double *v;
+	char *buf;
+	unsigned i;
+
+	buf = malloc(n * 64);
+	v = malloc(n * sizeof (double));
+	for (int s = 0; s < LINE_SERIES; ++s) {
+		line_series[s].len = snprintf(line_series[s].name,
+		    sizeof (line_series[s].name), "servers.host%02d.cpu.user",
+		    s);
+		for (i = line_fnv(line_series[s].name, line_series[s].len);
+		    line_hash[i] != 0; i = (i + 1) & (2 * 128 - 1))
+			;
+		line_hash[i] = s + 1;
+	}
+	for (long k = 0; k < n; ++k) {
+		v[k] = (k * 7919 % 100000) / 100.0;
+		len += sprintf(buf + len, "%s %.2f %ld\n",
+		    line_series[k % LINE_SERIES].name, v[k],
+		    1700000000L + k / LINE_SERIES);
+	}
+
+	bench_begin();
+	used = crrd_line_parse(buf, len, 0, line_count, &got, NULL);
+	b = bench_end(n, n, "line/parse");
+	printf("%-36s %12.1f MB/s\n", "", used * 1e3 / b->ns);
+
+	for (int s = 0; s < LINE_SERIES; ++s) {
+		line_series[s].h = bench_db(3, sizeof (double), d_update,
+		    d_zero);
+	}
+	memset(&st, 0, sizeof (st));
+	bench_begin();
+	used = crrd_line_add(buf, len, 0, line_find, NULL, &st);
+	b = bench_end(n, n, "line/add");
+	printf("%-36s %12.1f MB/s\n", "", used * 1e3 / b->ns);
+	if ((got != n) || (st.lines != n) || (st.bad != 0) ||
+	    (st.unknown != 0)) {
+		fprintf(stderr, "line: parse failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int s = 0; s < LINE_SERIES; ++s) {
+		dbrrd_destroy(line_series[s].h);
+		line_series[s].h = bench_db(3, sizeof (double), d_update,
+		    d_zero);
+	}
+
+	bench_begin();
+	for (long k = 0; k < n; ++k) {
+		dbrrd_add_at(line_series[k % LINE_SERIES].h, &v[k],
+		    SEC2HR(1700000000L + k / LINE_SERIES));
+	}
+	bench_end(n, n, "line/binary");
+	for (int s = 0; s < LINE_SERIES; ++s) {
+		dbrrd_destroy(line_series[s].h);
+	}
+	free(buf);
+	free(v);
+}
+
+/*
+ * StatsD lines into 300 metrics (a counter, a timer and a gauge for
+ * each of 100 names) of three tiers (bench_db's layout), 20 lines a
+ * datagram, flushed every 10000 lines as if a period had ended. Timed
+ * from the datagrams, as they would come from recvmmsg().
+ */
+static void
+bench_statsd(void)
+{
+	dbrrd_spec_t spec[] = {
+		{ 128, SEC2HR(4) },
+		{ 128, SEC2HR(2) },
+		{ 128, SEC2HR(1) },
+		{ 0, 0 },
+	};
+	long n = 2000000;
+	crrd_statsd_stats_t st;
+	crrd_statsd_t *s;
+	char *buf;
+	size_t *off;
+	long ndgram = n / 20;
+
+	s = crrd_statsd_create(NULL, 0, spec);
+	buf = malloc(n * 48);
+	off = malloc((ndgram + 1) * sizeof (size_t));
+	if ((s == NULL) || (buf == NULL) || (off == NULL)) {
+		fprintf(stderr, "statsd: no listener\n");
+		exit(EXIT_FAILURE);
+	}
+	off[0] = 0;
+	for (long d = 0, k = 0; d < ndgram; ++d) {
+		off[d + 1] = off[d];
+		for (int l = 0; l < 20; ++l, ++k) {
+			switch (k % 3) {
+			case 0:
+				off[d + 1] += sprintf(buf + off[d + 1],
+				    "app%02ld.requests:1|c\n", k / 3 % 100);
+				break;
+			case 1:
+				off[d + 1] += sprintf(buf + off[d + 1],
+				    "app%02ld.latency:%ld.%ld|ms\n",
+				    k / 3 % 100, k % 97, k % 10);
+				break;
+			case 2:
+				off[d + 1] += sprintf(buf + off[d + 1],
+				    "app%02ld.memory:%ld|g\n", k / 3 % 100,
+				    k % 100000);
+				break;
+			}
+		}
+	}
+	bench_begin();
+	for (long d = 0; d < ndgram; ++d) {
+		crrd_statsd_parse(s, buf + off[d], off[d + 1] - off[d]);
+		if ((d + 1) % (10000 / 20) == 0) {
+			crrd_statsd_flush(s, SEC2HR(1700000000L + d));
+		}
+	}
+	bench_end(n, n, "statsd/parse+flush");
+	crrd_statsd_stats(s, &st);
+	if ((st.metrics != n) || (st.bad != 0)) {
+		fprintf(stderr, "statsd: lines not taken\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_statsd_destroy(s);
+	free(buf);
+	free(off);
+}
+
+/* Run benchmark name if it was asked for (or nothing was) */
+static int
+bench_want(char *name, int ac, char **av)
+{
+	if (optind >= ac) {
+		return (1);
+	}
+	for (int i = optind; i < ac; ++i) {
+		if (strcmp(av[i], name) == 0) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+int
+main(int ac, char **av)
+{
+	crrd_pool_t *pool;
+	char *json = NULL;
+	FILE *f;
+	int threads;
+	long max_series = 100000;
+	int c;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(ac, av, "t:n:j:")) != -1) {
+		switch (c) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			max_series = atol(optarg);
+			break;
+		case 'j':
+			json = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: bench [-t threads] "
+				"[-n max_series] [-j file.json] "
+				"[add] [tiers] [query] [range] [txg] [batch] "
+				"[multi] [reorder] [clock] [fill] [crrdd] "
+				"[line] [statsd]\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	perf_open();
+	printf("crrd - C RRD Database benchmarks\n");
+	printf("%-36s %12s %14s", "benchmark", "ns/op", "samples/s");
+	if (perf_fd >= 0) {
+		printf(" %10s", "misses/op");
+	}
+	printf("\n");
+	if (bench_want("add", ac, av)) {
+		bench_add();
+	}
+	if (bench_want("tiers", ac, av)) {
+		bench_tiers();
+	}
+	if (bench_want("query", ac, av)) {
+		bench_query();
+	}
+	if (bench_want("range", ac, av)) {
+		bench_range();
+	}
+	if (bench_want("txg", ac, av)) {
+		bench_txg();
+	}
+	if (bench_want("batch", ac, av)) {
+		pool = crrd_pool_create(threads);
+		if (pool == NULL) {
+			fprintf(stderr, "crrd_pool_create failed\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_batch(pool);
+		crrd_pool_destroy(pool);
+	}
+	if (bench_want("multi", ac, av)) {
+		bench_multi(max_series);
+	}
+	if (bench_want("reorder", ac, av)) {
+		bench_reorder();
+	}
+	if (bench_want("clock", ac, av)) {
+		bench_clock();
+	}
+	if (bench_want("fill", ac, av)) {
+		bench_fill();
+	}
+	if (bench_want("crrdd", ac, av)) {
+		bench_crrdd();
+	}
+	if (bench_want("line", ac, av)) {
+		bench_line();
+	}
+	if (bench_want("statsd", ac, av)) {
+		bench_statsd();
+	}
+	if (json != NULL) {
+		if (strcmp(json, "-") == 0) {
+			bench_json(stdout, threads);
+		} else if ((f = fopen(json, "w")) != NULL) {
+			bench_json(f, threads);
+			fclose(f);
+		} else {
+			perror(json);
+			exit(EXIT_FAILURE);
+		}
+	}
+	return (EXIT_SUCCESS);
+}
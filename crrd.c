@@ -39,6 +39,7 @@
 #  include <stdlib.h>
 #  include <stdio.h>
 #  include <time.h>
+#  include <unistd.h>
 #  include "crrd.h"
 #else
 #  include <sys/zfs_context.h>
@@ -102,6 +103,322 @@ void forward(rrd_t *r)
 	r->start = find_period(r->start + r->resolution + 1, r->resolution); 
 }
 
+/*
+ * Counters. Each CPU gets its own cache line of counters, so counting
+ * never bounces a line between CPUs, and costs a plain increment. In
+ * user space "CPU" is really "thread": a thread takes the next slot
+ * the first time it counts. Threads beyond the number of slots share,
+ * and may now and then lose a count -- these are statistics.
+ */
+#define	CRRD_CACHELINE	64
+
+typedef struct rrd_stats_slot {
+	rrd_stats_t s;
+} __attribute__((aligned(CRRD_CACHELINE))) rrd_stats_slot_t;
+
+#ifdef TESTING
+static __thread int stats_cpu = -1;
+static int stats_next;
+#endif
+
+static rrd_stats_t *
+stats_slot(rrd_t *r)
+{
+	int cpu;
+
+#ifdef TESTING
+	if (stats_cpu < 0) {
+		stats_cpu = __atomic_fetch_add(&stats_next, 1,
+		    __ATOMIC_RELAXED);
+	}
+	cpu = stats_cpu;
+#else
+	cpu = CPU_SEQID_UNSTABLE;
+#endif
+	return (&r->stats[cpu % r->nstats].s);
+}
+
+#define	RRD_STAT(r, f, n) \
+	do { \
+		if ((r)->stats != NULL) \
+			stats_slot(r)->f += (n); \
+	} while (0)
+
+#define	RRD_STAT_MAX(r, f, n) \
+	do { \
+		if ((r)->stats != NULL) { \
+			rrd_stats_t *sp_ = stats_slot(r); \
+			if (sp_->f < (uint64_t)(n)) \
+				sp_->f = (n); \
+		} \
+	} while (0)
+
+#ifdef CRRD_LATENCY
+/*
+ * Latency histograms (compile with -DCRRD_LATENCY). Bucket i counts
+ * calls that took [2^i, 2^(i+1)) ticks. In user space on x86 a tick
+ * is a TSC cycle (rdtsc is far cheaper than the calls we time), and
+ * ticks are turned into nanoseconds when the histogram is read. In
+ * the kernel a tick is a nanosecond of gethrtime().
+ */
+#if defined(TESTING) && (defined(__x86_64__) || defined(__i386__))
+#  include <x86intrin.h>
+#  define LAT_TSC
+#endif
+
+static crrd_latency_t lat_hist[CRRD_LAT_N];
+
+#ifdef LAT_TSC
+static uint64_t lat_tsc0;
+static hrtime_t lat_ns0;
+
+static hrtime_t
+lat_mono(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+#endif
+
+static uint64_t
+lat_now(void)
+{
+#ifdef LAT_TSC
+	if (lat_tsc0 == 0) {
+		lat_ns0 = lat_mono();
+		lat_tsc0 = __rdtsc();
+	}
+	return (__rdtsc());
+#elif defined(TESTING)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#else
+	return (gethrtime());
+#endif
+}
+
+static void
+lat_record(int which, uint64_t t0)
+{
+	crrd_latency_t *l = &lat_hist[which];
+	uint64_t d = lat_now() - t0;
+	uint64_t m;
+	int b;
+
+	b = (d == 0) ? 0 : 63 - __builtin_clzll(d);
+	__atomic_add_fetch(&l->bucket[b], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&l->count, 1, __ATOMIC_RELAXED);
+	/* Raise the max, unless another recorder beats us to higher */
+	m = __atomic_load_n(&l->max, __ATOMIC_RELAXED);
+	while ((d > m) && !__atomic_compare_exchange_n(&l->max, &m, d, 1,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+#define	LAT_BEGIN()	uint64_t lat_t0_ = lat_now()
+#define	LAT_END(w)	lat_record(w, lat_t0_)
+#else
+#define	LAT_BEGIN()
+#define	LAT_END(w)
+#endif
+
+/*
+ * The clock, for rrd_add() and dbrrd_add() and anything else that wants
+ * "now" on crrd's time line. crrd_setclock() picks the source:
+ *
+ *   CRRD_CLOCK_REALTIME         clock_gettime(CLOCK_REALTIME) (default)
+ *   CRRD_CLOCK_MONOTONIC        clock_gettime(CLOCK_MONOTONIC)
+ *   CRRD_CLOCK_REALTIME_COARSE  CLOCK_REALTIME_COARSE: a tick (about
+ *                               4ms) stale, but very cheap to read
+ *   CRRD_CLOCK_TSC              rdtsc, scaled to realtime nanoseconds
+ *                               by a calibration at crrd_setclock()
+ *   CRRD_CLOCK_CACHED           whatever crrd_setnow() last stored
+ *
+ * CACHED lets a caller read the time once for a batch of samples. The
+ * cached time is per thread, so batches on different threads keep
+ * their own; a thread that never called crrd_setnow() -- the wheel,
+ * ticker and statsd threads among them -- reads CLOCK_REALTIME. TSC
+ * needs an invariant TSC (x86-64) and slowly drifts from realtime;
+ * calling crrd_setclock() again recalibrates, publishing the new
+ * scale under a sequence lock so a reader never sees half of it. In
+ * the kernel the clock is gethrtime(), or CACHED -- there one value,
+ * for a single batcher, and gethrtime() until it is first set.
+ */
+#if defined(TESTING) && defined(__x86_64__)
+#  include <x86intrin.h>
+#  include <cpuid.h>
+#  define NOW_TSC
+#endif
+
+static int now_kind = CRRD_CLOCK_REALTIME;
+#ifdef TESTING
+static __thread hrtime_t now_cached;
+static __thread int now_have;		/* crrd_setnow() was called */
+#else
+static hrtime_t now_cached;
+static int now_have;
+#endif
+
+#ifdef TESTING
+static hrtime_t
+now_ts(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+#endif
+
+#ifdef NOW_TSC
+/*
+ * ns = now_ns0 + (tsc - now_tsc0) * now_mult / 2^32, under now_seq:
+ * odd while crrd_setclock() rewrites the three, and a reader retries
+ * if it changed under it.
+ */
+static uint64_t now_seq;
+static uint64_t now_tsc0;
+static hrtime_t now_ns0;
+static uint64_t now_mult;
+
+static hrtime_t
+now_tsc(void)
+{
+	uint64_t s, tsc0, mult;
+	hrtime_t ns0;
+
+	do {
+		s = __atomic_load_n(&now_seq, __ATOMIC_ACQUIRE);
+		tsc0 = __atomic_load_n(&now_tsc0, __ATOMIC_RELAXED);
+		ns0 = __atomic_load_n(&now_ns0, __ATOMIC_RELAXED);
+		mult = __atomic_load_n(&now_mult, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((s & 1) ||
+	    (__atomic_load_n(&now_seq, __ATOMIC_RELAXED) != s));
+	return (ns0 + (hrtime_t)(((unsigned __int128)(__rdtsc() - tsc0) *
+	    mult) >> 32));
+}
+
+/* Publish a calibration; concurrent callers take turns */
+static void
+now_publish(uint64_t tsc0, hrtime_t ns0, uint64_t mult)
+{
+	uint64_t s;
+
+	do {
+		s = __atomic_load_n(&now_seq, __ATOMIC_RELAXED) & ~1ULL;
+	} while (!__atomic_compare_exchange_n(&now_seq, &s, s + 1, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&now_tsc0, tsc0, __ATOMIC_RELAXED);
+	__atomic_store_n(&now_ns0, ns0, __ATOMIC_RELAXED);
+	__atomic_store_n(&now_mult, mult, __ATOMIC_RELAXED);
+	__atomic_store_n(&now_seq, s + 2, __ATOMIC_RELEASE);
+}
+
+/* Time the TSC against CLOCK_REALTIME for 10ms. 0 if it is no good. */
+static int
+now_calibrate(void)
+{
+	struct timespec nap = { 0, 10000000 };
+	unsigned a, b, c, d;
+	uint64_t c0, c1;
+	hrtime_t t0, t1;
+
+	/* Invariant TSC: CPUID 0x80000007, EDX bit 8 */
+	if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1 << 8))) {
+		return (0);
+	}
+	t0 = now_ts(CLOCK_REALTIME);
+	c0 = __rdtsc();
+	nanosleep(&nap, NULL);
+	t1 = now_ts(CLOCK_REALTIME);
+	c1 = __rdtsc();
+	if ((c1 <= c0) || (t1 <= t0)) {
+		return (0);
+	}
+	now_publish(c1, t1, ((uint64_t)(t1 - t0) << 32) / (c1 - c0));
+	return (1);
+}
+#endif
+
+/*
+ * Use clock kind (CRRD_CLOCK_REALTIME, ...) from now on. Returns 1, or
+ * 0 if that kind is not available here (the clock is left as it was).
+ */
+int
+crrd_setclock(int kind)
+{
+	switch (kind) {
+	case CRRD_CLOCK_REALTIME:
+	case CRRD_CLOCK_CACHED:
+		break;
+#ifdef TESTING
+	case CRRD_CLOCK_MONOTONIC:
+		break;
+#ifdef CLOCK_REALTIME_COARSE
+	case CRRD_CLOCK_REALTIME_COARSE:
+		break;
+#endif
+#ifdef NOW_TSC
+	case CRRD_CLOCK_TSC:
+		if (!now_calibrate()) {
+			return (0);
+		}
+		break;
+#endif
+#endif
+	default:
+		return (0);
+	}
+	now_kind = kind;
+	return (1);
+}
+
+/* The time for CRRD_CLOCK_CACHED, on this thread */
+void
+crrd_setnow(hrtime_t t)
+{
+	now_cached = t;
+	now_have = 1;
+}
+
+/* The current time, from the clock crrd_setclock() chose */
+hrtime_t
+crrd_now(void)
+{
+	switch (now_kind) {
+	case CRRD_CLOCK_CACHED:
+		if (now_have) {
+			return (now_cached);
+		}
+		break;
+#ifdef TESTING
+	case CRRD_CLOCK_MONOTONIC:
+		return (now_ts(CLOCK_MONOTONIC));
+#ifdef CLOCK_REALTIME_COARSE
+	case CRRD_CLOCK_REALTIME_COARSE:
+		return (now_ts(CLOCK_REALTIME_COARSE));
+#endif
+#ifdef NOW_TSC
+	case CRRD_CLOCK_TSC:
+		return (now_tsc());
+#endif
+#endif
+	default:
+		break;
+	}
+#ifdef TESTING
+	return (now_ts(CLOCK_REALTIME));
+#else
+	return (gethrtime());
+#endif
+}
+
 /* Return tail of rrd */
 int
 rrd_tail(rrd_t *r)
@@ -130,26 +447,44 @@ rrd_create(char *s, hrtime_t res, unsigned cap, size_t sz)
 	r->resolution = res;
 	r->next = NULL;
 	r->start = r->last = 0;
+	r->reorder = 0;
+	r->flags = 0;
+	r->stats = NULL;
+	r->nstats = 0;
 	r->capacity = cap;
 	r->size = sz;
 	r->head = r->tail = -1;
+	r->ltail = -1;
 	r->update = default_update;
 	r->zero = default_zero;
+	r->store = NULL;
+	r->arg = NULL;
+	r->fill = RRD_FILL_CALLBACK;
+	r->fillbyte = -1;
+	r->fillp = NULL;
+	r->runs = NULL;
+	r->nruns = 0;
+	r->gaps = NULL;
 	return (r);
 }
 
-/* Return length of data in the rrd. rrd_get works from 0..rrd_len()-1 */
+/*
+ * Return length of data in the rrd. rrd_get works from 0..rrd_len()-1.
+ * A late merge (add_late) leaves the length as it is.
+ */
 unsigned
 rrd_len(rrd_t *r)
 {
-	if (r->tail < 0) {
+	int tail = (r->ltail >= 0) ? r->ltail : r->tail;
+
+	if (tail < 0) {
 		return (0);
 	}
-	if (r->head <= r->tail) {
-		return (r->tail - r->head + 1);
+	if (r->head <= tail) {
+		return (tail - r->head + 1);
 	}
-	if (r->head > r->tail) {
-		return (r->capacity - r->head + r->tail + 1);
+	if (r->head > tail) {
+		return (r->capacity - r->head + tail + 1);
 	}
 #ifdef TESTING
 	fprintf(stderr, "rrd_len: impossible\n");
@@ -179,32 +514,147 @@ rrd_debug(rrd_t *r)
 #ifdef TESTING
 	fprintf(stderr, "rrd_debug:    %p\n",  r);
 	fprintf(stderr, "  name:       %s\n",  r->name);
-	fprintf(stderr, "  resolution: %ld\n", r->resolution);
+	fprintf(stderr, "  resolution: %lld\n", (long long)r->resolution);
 	fprintf(stderr, "  head:       %d\n",  r->head);
 	fprintf(stderr, "  tail:       %d\n",  r->tail);
-	fprintf(stderr, "  start:      %ld\n", r->start);
-	fprintf(stderr, "  last:       %ld\n", r->last);
+	fprintf(stderr, "  start:      %lld\n", (long long)r->start);
+	fprintf(stderr, "  last:       %lld\n", (long long)r->last);
+	fprintf(stderr, "  reorder:    %lld\n", (long long)r->reorder);
+	fprintf(stderr, "  flags:      %x\n",  r->flags);
 	fprintf(stderr, "  entries:    %p\n",  r->entries);
 	fprintf(stderr, "  size:       %lu\n", r->size);
 	fprintf(stderr, "  len:        %d\n",  rrd_len(r));
+	fprintf(stderr, "  runs:       %d\n",  r->nruns);
 #else
 	r = r;
 #endif
 }
 
+/*
+ * Start counting (see rrd_stats_t). Returns 1 if counting, 0 if the
+ * counters could not be allocated.
+ */
+int
+rrd_stats_enable(rrd_t *r)
+{
+	int n;
+
+	if (r->stats != NULL) {
+		return (1);
+	}
+#ifdef TESTING
+	n = sysconf(_SC_NPROCESSORS_CONF);
+	if (n < 1) {
+		n = 1;
+	}
+	r->stats = aligned_alloc(CRRD_CACHELINE,
+	    n * sizeof (rrd_stats_slot_t));
+	if (r->stats == NULL) {
+		return (0);
+	}
+	memset(r->stats, 0, n * sizeof (rrd_stats_slot_t));
+#else
+	n = max_ncpus;
+	r->stats = kmem_zalloc(n * sizeof (rrd_stats_slot_t), KM_SLEEP);
+#endif
+	r->nstats = n;
+	return (1);
+}
+
+/* Snapshot the counters into *sp. All zero if counting is not on. */
+void
+rrd_stats(rrd_t *r, rrd_stats_t *sp)
+{
+	rrd_stats_t *p;
+
+	memset(sp, 0, sizeof (rrd_stats_t));
+	for (int i = 0; i < r->nstats; ++i) {
+		p = &r->stats[i].s;
+		sp->accepted += p->accepted;
+		sp->late += p->late;
+		sp->reordered += p->reordered;
+		sp->advanced += p->advanced;
+		if (sp->maxgap < p->maxgap) {
+			sp->maxgap = p->maxgap;
+		}
+		sp->updates += p->updates;
+		sp->zeros += p->zeros;
+		sp->qhit += p->qhit;
+		sp->qmiss += p->qmiss;
+	}
+}
+
 /* Destroy the rrd database */
 void
 rrd_destroy(rrd_t *r)
 {
 	if (r) {
 #ifdef TESTING
+		free(r->stats);
+		free(r->runs);
+		free(r->gaps);
 		free(r);
 #else
+		if (r->stats != NULL) {
+			kmem_free(r->stats, r->nstats *
+			    sizeof (rrd_stats_slot_t));
+		}
+		if (r->runs != NULL) {
+			kmem_free(r->runs, RUNS_ASIZE(r));
+		}
+		if (r->gaps != NULL) {
+			kmem_free(r->gaps, GAPS_ASIZE(r));
+		}
 		kmem_free(r, r->asize);
 #endif
 	}
 }
 
+/*
+ * Fill marks (rrd_setreorder): a bit per slot, set while the slot holds
+ * fill from a gap rather than a sample, so that a late sample for that
+ * period replaces the fill instead of being merged into it. Gaps set
+ * them a word at a time; storing a sample clears the one bit.
+ */
+#define	GAPS_ASIZE(r)	((((r)->capacity + 63) / 64) * sizeof (uint64_t))
+
+/* Mark slots [a, b) as holding fill */
+static void
+gap_set(rrd_t *r, int a, int b)
+{
+	for (; (a < b) && ((a & 63) != 0); ++a) {
+		r->gaps[a >> 6] |= 1ULL << (a & 63);
+	}
+	for (; b - a >= 64; a += 64) {
+		r->gaps[a >> 6] = ~0ULL;
+	}
+	for (; a < b; ++a) {
+		r->gaps[a >> 6] |= 1ULL << (a & 63);
+	}
+}
+
+/* Mark the n slots up to and including the tail as holding fill */
+static void
+gap_mark(rrd_t *r, hrtime_t n)
+{
+	int a;
+
+	if (r->gaps == NULL) {
+		return;
+	}
+	if (n >= r->capacity) {
+		gap_set(r, 0, r->capacity);
+		return;
+	}
+	a = r->tail + 1 - (int)n;
+	if (a >= 0) {
+		gap_set(r, a, r->tail + 1);
+	} else {
+		gap_set(r, a + r->capacity, r->capacity);
+		gap_set(r, 0, r->tail + 1);
+	}
+}
+
 /* Store value into rrd at tail */
 static
 void rrd_store(rrd_t *r, void *v)
@@ -213,120 +663,665 @@ void rrd_store(rrd_t *r, void *v)
 }
 
 /*
- * Add value to rrd at specified time. Data will be consolidated
- * to apply data with any timestamp into the defined periods of
- * the rrd
+ * Store a sample at tail: as is, or through the store() callback for
+ * rrds whose entries are encoded (see rrd_setstore).
  */
-void
-rrd_add_at(rrd_t *r, void *v, hrtime_t t)
+static inline void
+rrd_put(rrd_t *r, void *v)
 {
-	hrtime_t t0;
+	if (r->gaps != NULL) {
+		r->gaps[r->tail >> 6] &= ~(1ULL << (r->tail & 63));
+	}
+	if (r->store != NULL) {
+		(r->store)(r, v);
+		return;
+	}
+	rrd_store(r, v);
+}
 
-	/*
-	 * t0 is the beginning of the period for this time
-	 * t0 + resolution is one past the end
-	 */
-	t0 = find_period(t, r->resolution);
+/*
+ * Fill slots [a, b) with the entry at src: a memset if the entry is one
+ * byte repeated, otherwise one copy and then copies of what is already
+ * filled, doubling each time.
+ */
+static void
+fill_run(rrd_t *r, int a, int b, const void *src, int byte)
+{
+	char *p = rrd_entry(r, a);
+	size_t len = (b - a) * r->size;
+	size_t done;
 
-	/* Empty rrd, put in first element */
-	if (r->tail < 0) {
-		r->head = r->tail = 0;
-		rrd_store(r, v);
-		r->start = t0;
-		r->last = t;
+	if (a >= b) {
 		return;
 	}
-
-	/* Cannot go back in time */
-	if (t < r->last) {
+	if (b - a == 1) {
+		memcpy(p, src, r->size);
 		return;
 	}
-
-	/*
-	 * Are we in current period? Yes, do running average.
-	 *
-	 * All calculation for the "running average" or other
-	 * accumulation is pushed into update().
-	 *
-	 * We may sill want to smear the past which is not
-	 * accomodated yet.
-	 */
-	if (t0 == r->start) {
-		r->start = t0;
-		r->last = t;
-		(r->update)(r, v);
+	if (byte >= 0) {
+		memset(p, byte, len);
 		return;
 	}
-
-	/*
-	 * One or more periods in the future. Skip forward,
-	 * then store.
-	 */
-	while (r->start < t0) {
-		forward(r);
-		/*
-		 * "Zero" is a bit of a misnomer. For txg, we want to plant
-		 * the previous txg. For calculation, we want to plant either
-		 * the present or previous value.
-		 */
-		(r->zero)(r, v);
+	memcpy(p, src, r->size);
+	for (done = r->size; done < len; done += done) {
+		memcpy(p + done, p, (len - done < done) ? len - done : done);
 	}
-	rrd_store(r, v);
-	r->start = t0;
-	r->last = t;
 }
 
-/* Return entry pointer for index n */
-void *
-rrd_entry(rrd_t *r, int i)
+/*
+ * Gap runs (rrd_setlazy). A run is keyed by time, not by slot: the
+ * slots of periods that have left the ring are reused for new periods,
+ * which no run covers, so a run never needs trimming, and is dropped
+ * once all of it is older than the ring. The tail is never in a run.
+ */
+#define	RUNS_ASIZE(r)	(RRD_RUNS * (sizeof (rrd_run_t) + (r)->size))
+#define	RUN_MIN		16	/* shorter gaps are cheaper written out */
+
+static void *
+run_value(rrd_t *r, int j)
 {
-	return (char *)r->entries + (i * r->size);
+	return ((char *)(r->runs + RRD_RUNS) + j * r->size);
 }
 
-/* Return value at indicated index -- returns a void * to the data */
-void *
-rrd_get(rrd_t *r, int i)
+/* Start of the oldest period in the ring */
+static hrtime_t
+ring_first(rrd_t *r)
 {
-	int n;
-
-	if ((i < 0) || (i >= rrd_len(r))) {
-		return NULL;
-	}
+	return (r->start - (hrtime_t)(rrd_len(r) - 1) * r->resolution);
+}
 
-	n = r->head + i;
-	if (n >= r->capacity) {
-		n -= r->capacity;
+/* Run holding the period starting t0, or -1 */
+static int
+run_find(rrd_t *r, hrtime_t t0)
+{
+	for (int j = 0; j < r->nruns; ++j) {
+		if ((t0 >= r->runs[j].from) &&
+		    (t0 < r->runs[j].from + r->runs[j].n * r->resolution)) {
+			return (j);
+		}
 	}
-	return rrd_entry(r, n);
+	return (-1);
 }
 
-/* Add value at the current time */
-void
-rrd_add(rrd_t *r, void *v)
+static void
+run_drop(rrd_t *r, int j)
 {
-	hrtime_t t;
+	int k = r->nruns - j - 1;
 
-#ifdef TESTING
-#  define SEC2NSEC(n) (n * 1000LL * 1000LL * 1000LL)
-#  define USEC2NSEC(n) (n * 1000LL)
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	t = SEC2NSEC(now.tv_sec) + USEC2NSEC(now.tv_usec);
-#else
-	t = gethrtime();
-#endif
-	rrd_add_at(r, v, t);
+	memmove(&r->runs[j], &r->runs[j + 1], k * sizeof (rrd_run_t));
+	memmove(run_value(r, j), run_value(r, j + 1), k * r->size);
+	--r->nruns;
 }
 
-/* Set callbacks */
-void
-rrd_setfunctions(rrd_t *r, void *fupdate, void *fzero)
+/* Write run j into the slots it stands for, and drop it */
+static void
+run_materialize(rrd_t *r, int j)
 {
-	r->update = fupdate;
-	r->zero = fzero;
-}
+	rrd_run_t *x = &r->runs[j];
+	hrtime_t first = ring_first(r);
+	hrtime_t skip = 0;
+	int a, k;
 
-/*
+	/* Slots keep their periods while in the ring: no division here */
+	if (x->from < first) {
+		skip = (first - x->from) / r->resolution;
+	}
+	if (skip < x->n) {
+		a = x->slot;
+		if (skip > 0) {
+			a = (int)((a + skip) % r->capacity);
+		}
+		k = (int)(x->n - skip);
+		if (a + k <= r->capacity) {
+			fill_run(r, a, a + k, run_value(r, j), -1);
+		} else {
+			fill_run(r, a, r->capacity, run_value(r, j), -1);
+			fill_run(r, 0, a + k - r->capacity, run_value(r, j),
+			    -1);
+		}
+	}
+	run_drop(r, j);
+}
+
+/*
+ * Record n periods from time from as a run of the entry at src. The
+ * rrd has already moved forward past them; ot is the slot of the old
+ * tail, the period just before from.
+ */
+static void
+run_add(rrd_t *r, hrtime_t from, hrtime_t n, const void *src, int ot)
+{
+	hrtime_t first = ring_first(r);
+	rrd_run_t *x;
+
+	/* Idle rolls: run, old tail and run again make one longer run */
+	if (r->nruns > 0) {
+		x = &r->runs[r->nruns - 1];
+		if ((from - r->resolution >= first) &&
+		    (x->from + x->n * r->resolution == from - r->resolution) &&
+		    (memcmp(run_value(r, r->nruns - 1), src, r->size) == 0) &&
+		    (memcmp(rrd_entry(r, ot), src, r->size) == 0)) {
+			x->n += 1 + n;
+			return;
+		}
+	}
+	for (int j = r->nruns - 1; j >= 0; --j) {
+		if (r->runs[j].from + r->runs[j].n * r->resolution <= first) {
+			run_drop(r, j);
+		}
+	}
+	if (r->nruns == RRD_RUNS) {
+		run_materialize(r, 0);
+	}
+	x = &r->runs[r->nruns];
+	x->from = from;
+	x->n = n;
+	x->slot = (ot + 1 < r->capacity) ? ot + 1 : 0;
+	memcpy(run_value(r, r->nruns), src, r->size);
+	++r->nruns;
+}
+
+/*
+ * Move the tail n periods forward, as n forward() and zero() calls
+ * would, for the fill kinds: only the last capacity slots of the gap
+ * can be seen, and they all get the same entry, so they are filled in
+ * at most two runs (the ring may wrap). v is the sample that ended the
+ * gap, or NULL from rrd_roll(), which has none and repeats the tail.
+ * The new tail is filled only if last is set: a sample is about to be
+ * stored over it otherwise.
+ */
+static void
+fill_ahead(rrd_t *r, hrtime_t n, void *v, int last)
+{
+	const void *src;
+	int byte = -1;
+	int len = rrd_len(r);
+	int k, a;
+
+	switch (r->fill) {
+	case RRD_FILL_CONST:
+		src = r->fillp;
+		byte = r->fillbyte;
+		break;
+	case RRD_FILL_VALUE:
+		if (v != NULL) {
+			src = v;
+			break;
+		}
+		/* FALLTHROUGH */
+	default:
+		src = NULL;	/* the tail, which already holds itself */
+		break;
+	}
+	if (src == NULL) {
+		src = rrd_entry(r, r->tail);
+	}
+	/* The common short gap */
+	if (n == 1) {
+		forward(r);
+		if (!last) {
+			return;
+		}
+		if (byte >= 0) {
+			memset(rrd_entry(r, r->tail), byte, r->size);
+		} else {
+			memcpy(rrd_entry(r, r->tail), src, r->size);
+		}
+		return;
+	}
+	/* Lazy: one run for the gap, and only the new tail (if) written */
+	if ((r->runs != NULL) && (n > RUN_MIN)) {
+		a = r->tail;
+		if (n < r->capacity) {
+			r->tail += (int)n;
+			if (r->tail >= r->capacity) {
+				r->tail -= r->capacity;
+			}
+		} else {
+			r->tail = (int)((r->tail + n) % r->capacity);
+		}
+		if (len + n >= r->capacity) {
+			r->head = r->tail + 1;
+			if (r->head >= r->capacity) {
+				r->head = 0;
+			}
+		}
+		r->start += n * r->resolution;
+		run_add(r, r->start - (n - 1) * r->resolution, n - 1, src, a);
+		if (last) {
+			memcpy(rrd_entry(r, r->tail), run_value(r, r->nruns - 1),
+			    r->size);
+		}
+		return;
+	}
+	k = (n < r->capacity) ? (int)n : r->capacity;
+	if ((src == rrd_entry(r, r->tail)) && (k == r->capacity)) {
+		--k;
+	} else if (!last && (k == n)) {
+		--k;
+	}
+	a = r->tail + 1;
+	if (a >= r->capacity) {
+		a = 0;
+	}
+	if (a + k <= r->capacity) {
+		fill_run(r, a, a + k, src, byte);
+	} else {
+		fill_run(r, a, r->capacity, src, byte);
+		/* src may be in the first run; it is the same entry */
+		fill_run(r, 0, a + k - r->capacity, rrd_entry(r, a), byte);
+	}
+	if (n < r->capacity) {
+		r->tail += (int)n;
+		if (r->tail >= r->capacity) {
+			r->tail -= r->capacity;
+		}
+	} else {
+		r->tail = (int)((r->tail + n) % r->capacity);
+	}
+	if (len + n >= r->capacity) {
+		r->head = r->tail + 1;
+		if (r->head >= r->capacity) {
+			r->head = 0;
+		}
+	}
+	r->start += n * r->resolution;
+}
+
+/*
+ * Merge a late sample into the slot of period t0, which may be any
+ * slot still in the ring, by pointing the tail at it for the length
+ * of the update() call. A slot still holding fill from a gap has had
+ * no sample yet: the late one replaces the fill, as the first sample
+ * of a period does. The real tail is kept in r->ltail meanwhile, so
+ * rrd_len() (and a store() hook asking what is live) is not fooled.
+ * Returns 0 if the period has already left the ring.
+ */
+static int
+add_late(rrd_t *r, void *v, hrtime_t t0)
+{
+	hrtime_t k;
+	int tail, j;
+
+	k = (r->start - t0) / r->resolution;
+	if (k >= rrd_len(r)) {
+		return (0);
+	}
+	/* The current period, as add_at() would have done on time */
+	if (k == 0) {
+		if (r->flags & RRD_TAILFILL) {
+			r->flags &= ~RRD_TAILFILL;
+			rrd_put(r, v);
+			return (1);
+		}
+		(r->update)(r, v);
+		RRD_STAT(r, updates, 1);
+		return (1);
+	}
+	/* A period of a gap run gets its own slot back first */
+	if ((r->nruns > 0) && ((j = run_find(r, t0)) >= 0)) {
+		run_materialize(r, j);
+	}
+	tail = r->tail;
+	r->ltail = tail;
+	r->tail -= k;
+	if (r->tail < 0) {
+		r->tail += r->capacity;
+	}
+	if (r->gaps[r->tail >> 6] & (1ULL << (r->tail & 63))) {
+		rrd_put(r, v);
+	} else {
+		(r->update)(r, v);
+		RRD_STAT(r, updates, 1);
+	}
+	r->tail = tail;
+	r->ltail = -1;
+	return (1);
+}
+
+/*
+ * Add value to rrd at specified time. Data will be consolidated
+ * to apply data with any timestamp into the defined periods of
+ * the rrd
+ *
+ * t0 is the beginning of the period for this time
+ * t0 + resolution is one past the end
+ */
+static inline void
+add_period(rrd_t *r, void *v, hrtime_t t, hrtime_t t0)
+{
+	hrtime_t n;
+
+	/* Empty rrd, put in first element */
+	if (r->tail < 0) {
+		r->head = r->tail = 0;
+		rrd_put(r, v);
+		r->start = t0;
+		r->last = t;
+		RRD_STAT(r, accepted, 1);
+		return;
+	}
+
+	/*
+	 * Cannot go back in time -- unless the sample is within the
+	 * reorder window, and its period is still in the ring.
+	 */
+	if (t < r->last) {
+		if ((r->reorder > 0) && (r->last - t <= r->reorder) &&
+		    add_late(r, v, t0)) {
+			RRD_STAT(r, accepted, 1);
+			RRD_STAT(r, reordered, 1);
+			return;
+		}
+		RRD_STAT(r, late, 1);
+		return;
+	}
+	RRD_STAT(r, accepted, 1);
+
+	/*
+	 * Are we in current period? Yes, do running average.
+	 *
+	 * All calculation for the "running average" or other
+	 * accumulation is pushed into update().
+	 *
+	 * We may sill want to smear the past which is not
+	 * accomodated yet.
+	 */
+	if (t0 == r->start) {
+		r->start = t0;
+		r->last = t;
+		/*
+		 * A tail planted by rrd_roll() holds fill, not data. The
+		 * first real sample replaces it, just as it would have if
+		 * the roll had been left to us.
+		 */
+		if (r->flags & RRD_TAILFILL) {
+			r->flags &= ~RRD_TAILFILL;
+			rrd_put(r, v);
+			return;
+		}
+		(r->update)(r, v);
+		RRD_STAT(r, updates, 1);
+		return;
+	}
+
+	/*
+	 * One or more periods in the future. Skip forward,
+	 * then store.
+	 */
+	n = (t0 - r->start) / r->resolution;
+	RRD_STAT(r, advanced, n);
+	RRD_STAT(r, zeros, n);
+	RRD_STAT_MAX(r, maxgap, n);
+	if (r->fill != RRD_FILL_CALLBACK) {
+		fill_ahead(r, n, v, 0);
+	}
+	while (r->start < t0) {
+		forward(r);
+		/*
+		 * "Zero" is a bit of a misnomer. For txg, we want to plant
+		 * the previous txg. For calculation, we want to plant either
+		 * the present or previous value.
+		 */
+		(r->zero)(r, v);
+	}
+	gap_mark(r, n);
+	rrd_put(r, v);
+	r->start = t0;
+	r->last = t;
+	r->flags &= ~RRD_TAILFILL;
+}
+
+static void
+add_at(rrd_t *r, void *v, hrtime_t t)
+{
+	add_period(r, v, t, find_period(t, r->resolution));
+}
+
+void
+rrd_add_at(rrd_t *r, void *v, hrtime_t t)
+{
+	LAT_BEGIN();
+	add_at(r, v, t);
+	LAT_END(CRRD_LAT_ADD);
+}
+
+/*
+ * Roll the rrd forward, without a sample, so that the tail is the
+ * period containing time t. Skipped periods (and the new tail) are
+ * filled by zero(), given the previous tail entry as the value. This
+ * is what rrd_add_at() would do on the next sample, done ahead of
+ * time so that idle rrds stay current.
+ *
+ * The rrd is then known through the start of the new period, so
+ * r->last moves up to it; samples older than that are late.
+ */
+void
+rrd_roll(rrd_t *r, hrtime_t t)
+{
+	hrtime_t t0, n;
+	void *prev;
+
+	/* Nothing to roll in an empty rrd */
+	if (r->tail < 0) {
+		return;
+	}
+	t0 = find_period(t, r->resolution);
+	if (t0 <= r->start) {
+		return;
+	}
+	n = (t0 - r->start) / r->resolution;
+	RRD_STAT(r, advanced, n);
+	RRD_STAT(r, zeros, n);
+	RRD_STAT_MAX(r, maxgap, n);
+	if (r->fill != RRD_FILL_CALLBACK) {
+		fill_ahead(r, n, NULL, 1);
+	}
+	while (r->start < t0) {
+		prev = rrd_entry(r, r->tail);
+		forward(r);
+		(r->zero)(r, prev);
+	}
+	gap_mark(r, n);
+	r->start = t0;
+	if (r->last < t0) {
+		r->last = t0;
+	}
+	r->flags |= RRD_TAILFILL;
+}
+
+/*
+ * Accept samples up to window older than the newest one seen (0, the
+ * default, accepts none). A late sample whose period is still in the
+ * ring is merged into that period's slot with update(), as if it had
+ * arrived on time; the first one into a period that a gap filled in
+ * replaces the fill, as the first sample of a period does. Older
+ * samples are dropped, and counted as late. Returns 0, or -1 if there
+ * is no memory for the fill marks.
+ */
+int
+rrd_setreorder(rrd_t *r, hrtime_t window)
+{
+	if ((window > 0) && (r->gaps == NULL)) {
+		/* Gaps before now are not known: their slots merge */
+#ifdef TESTING
+		r->gaps = calloc(1, GAPS_ASIZE(r));
+		if (r->gaps == NULL) {
+			return (-1);
+		}
+#else
+		r->gaps = kmem_zalloc(GAPS_ASIZE(r), KM_SLEEP);
+#endif
+	}
+	r->reorder = (window > 0) ? window : 0;
+	return (0);
+}
+
+/* Return entry pointer for index n */
+void *
+rrd_entry(rrd_t *r, int i)
+{
+	return (char *)r->entries + (i * r->size);
+}
+
+/* Return value at indicated index -- returns a void * to the data */
+void *
+rrd_get(rrd_t *r, int i)
+{
+	int n;
+
+	if ((i < 0) || (i >= rrd_len(r))) {
+		return NULL;
+	}
+
+	if ((r->nruns > 0) && ((n = run_find(r, r->start -
+	    (hrtime_t)(rrd_len(r) - 1 - i) * r->resolution)) >= 0)) {
+		return (run_value(r, n));
+	}
+	n = r->head + i;
+	if (n >= r->capacity) {
+		n -= r->capacity;
+	}
+	return rrd_entry(r, n);
+}
+
+/* Add value at the current time */
+void
+rrd_add(rrd_t *r, void *v)
+{
+	rrd_add_at(r, v, crrd_now());
+}
+
+/*
+ * For rrds whose entries are not simply the samples (an encoding),
+ * store(r, v) is called to put sample v at the tail wherever the rrd
+ * would otherwise copy it there, and arg is left in r->arg for the
+ * callbacks. NULL store copies, as usual.
+ */
+void
+rrd_setstore(rrd_t *r, void *fstore, void *arg)
+{
+	r->store = fstore;
+	r->arg = arg;
+}
+
+/*
+ * Declare what zero() does, so that a gap of many periods is filled in
+ * a memset() or a few memcpy()s rather than one zero() call a period:
+ *
+ *   RRD_FILL_CALLBACK  call zero() for each period (the default)
+ *   RRD_FILL_CONST     the entry at pattern (r->size bytes, kept by
+ *                      pointer: it must outlive the rrd)
+ *   RRD_FILL_PREV      the entry before the gap (txg_zero)
+ *   RRD_FILL_VALUE     the sample that ended the gap (f_zero); from
+ *                      rrd_roll(), which has no sample, as PREV
+ *
+ * zero() is then not called. Fill kinds work on the entries as they
+ * are, and so cannot be used with a store() hook, and a lazy rrd must
+ * keep one. Returns 0, or -1 if the kind cannot be used.
+ */
+int
+rrd_setfill(rrd_t *r, int kind, const void *pattern)
+{
+	const unsigned char *p = pattern;
+
+	if ((kind < RRD_FILL_CALLBACK) || (kind > RRD_FILL_VALUE) ||
+	    ((kind == RRD_FILL_CONST) && (pattern == NULL)) ||
+	    ((kind != RRD_FILL_CALLBACK) && (r->store != NULL)) ||
+	    ((kind == RRD_FILL_CALLBACK) && (r->runs != NULL))) {
+		return (-1);
+	}
+	r->fill = kind;
+	r->fillp = pattern;
+	r->fillbyte = -1;
+	if (kind == RRD_FILL_CONST) {
+		r->fillbyte = p[0];
+		for (size_t i = 1; i < r->size; ++i) {
+			if (p[i] != p[0]) {
+				r->fillbyte = -1;
+				break;
+			}
+		}
+	}
+	return (0);
+}
+
+/*
+ * Lazy gaps. With a fill kind set, a gap of more than one period is
+ * recorded as a run -- "these periods all hold this entry" -- instead
+ * of being written into the ring, so a long idle stretch costs one
+ * record, not a slot (and a cache line dirtied) per period. rrd_get()
+ * and so every query resolve runs on read. A late sample merged into
+ * a period of a run (rrd_setreorder) writes the run out first; so
+ * does running out of runs, oldest first. Turning lazy off writes out
+ * every run. Returns 0, or -1 if there is no fill kind or no memory.
+ */
+int
+rrd_setlazy(rrd_t *r, int on)
+{
+	if (!on) {
+		if (r->runs != NULL) {
+			while (r->nruns > 0) {
+				run_materialize(r, 0);
+			}
+#ifdef TESTING
+			free(r->runs);
+#else
+			kmem_free(r->runs, RUNS_ASIZE(r));
+#endif
+			r->runs = NULL;
+		}
+		return (0);
+	}
+	if (r->fill == RRD_FILL_CALLBACK) {
+		return (-1);
+	}
+	if (r->runs == NULL) {
+#ifdef TESTING
+		r->runs = malloc(RUNS_ASIZE(r));
+		if (r->runs == NULL) {
+			return (-1);
+		}
+#else
+		r->runs = kmem_alloc(RUNS_ASIZE(r), KM_SLEEP);
+#endif
+		r->nruns = 0;
+	}
+	return (0);
+}
+
+/* Set callbacks */
+void
+rrd_setfunctions(rrd_t *r, void *fupdate, void *fzero)
+{
+	r->update = fupdate;
+	r->zero = fzero;
+}
+
+/*
+ * Index (for rrd_get) of the slot of this one rrd holding time tv, or
+ * -1 if tv is older than the rrd reaches back.
+ */
+static int
+rrd_slot(rrd_t *r, hrtime_t tv)
+{
+	hrtime_t t0, start;
+
+	t0 = find_period(tv, r->resolution);
+
+	/*
+	 * Time start for this rdd (may not be full). r->start
+	 * is the start of the active period.
+	 */
+	start = r->start - (r->resolution * (rrd_len(r) - 1));
+
+	if (t0 < start) {
+		return (-1);
+	}
+	return ((t0 - start) / r->resolution);
+}
+
+/*
  * The rrd_find function looks in the rrd for the time t. It returns
  * the value from the tightest period that contains the specified
  * time. Value and resolution are returned. Return is 1 if we have
@@ -335,13 +1330,15 @@ rrd_setfunctions(rrd_t *r, void *fupdate, void *fzero)
  * The rrds are linked together -- most precise first, and ordered.
  * We find the first rrd that covers our time.
  */
-int dbrrd_query(rrd_t *r, hrtime_t tv, void **vp, hrtime_t *res)
+static int
+query(rrd_t *r, hrtime_t tv, void **vp, hrtime_t *res)
 {
-	hrtime_t t0, start;
+	rrd_t *h = r;
 	int i;
 
 	/* Find for time in future fails */
 	if (tv > r->last) {
+		RRD_STAT(h, qmiss, 1);
 		return (0);
 	}
 
@@ -350,28 +1347,22 @@ int dbrrd_query(rrd_t *r, hrtime_t tv, void **vp, hrtime_t *res)
 	 * added to "in parallel", they are all empty (or not)
 	 */
 	if (rrd_len(r) == 0) {
+		RRD_STAT(h, qmiss, 1);
 		return (0);
 	}
 
 	while (r != NULL) {
 
-		t0 = find_period(tv, r->resolution);
-
-		/*
-		 * Time start for this rdd (may not be full). r->start
-		 * is the start of the active period.
-		 */
-		start = r->start - (r->resolution * (rrd_len(r) - 1));
-
 		/*
 		 * Is the query time within the coverage of this rrd?
 		 * Since the rrds are to be linked in increasing period
 		 * the first match will be the most precise one.
 		 */
-		if (t0 >= start) {
-			i = (t0 - start) / r->resolution;
+		i = rrd_slot(r, tv);
+		if (i >= 0) {
 			*vp = rrd_get(r, i);
 			*res = r->resolution;
+			RRD_STAT(r, qhit, 1);
 			return (1);
 		}
 
@@ -382,32 +1373,471 @@ int dbrrd_query(rrd_t *r, hrtime_t tv, void **vp, hrtime_t *res)
 	}
 
 	/* Too old, no record */
+	RRD_STAT(h, qmiss, 1);
 	return (0);
 }
 
+int
+dbrrd_query(rrd_t *r, hrtime_t tv, void **vp, hrtime_t *res)
+{
+	int n;
+
+	LAT_BEGIN();
+	n = query(r, tv, vp, res);
+	LAT_END(CRRD_LAT_QUERY);
+	return (n);
+}
+
+/*
+ * First index (for rrd_get) in [0, rrd_len) whose entry compares
+ * greater than key (upper) or not less than key (lower).
+ */
+static int
+rrd_bound(rrd_t *r, const void *key, int (*cmp)(const void *, const void *),
+    int upper)
+{
+	int lo = 0;
+	int hi = rrd_len(r);
+	int mid, c;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = cmp(rrd_get(r, mid), key);
+		if (upper ? (c <= 0) : (c < 0)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo);
+}
+
+/*
+ * The inverse of dbrrd_query: when did the payload hold key? For
+ * payloads that are monotonic in time (a txg range, a counter),
+ * cmp(entry, key) says whether an entry is before key (< 0), holds it
+ * (0), or is after it (> 0). Each tier is binary searched, finest
+ * first, for the run of slots holding key; *from is set to the start
+ * of the first and *to to the end of the last (one past). Returns 1
+ * if found, 0 if no tier holds key. O(log capacity) per tier. Tiers
+ * with encoded entries (a store() hook, as compact txg tiers) cannot be
+ * compared, and are skipped.
+ */
+int
+dbrrd_find_value(rrd_t *h, const void *key,
+    int (*cmp)(const void *, const void *), hrtime_t *from, hrtime_t *to)
+{
+	int lo, hi, n;
+
+	for (; h != NULL; h = h->next) {
+		n = rrd_len(h);
+		if ((n == 0) || (h->store != NULL)) {
+			continue;
+		}
+		lo = rrd_bound(h, key, cmp, 0);
+		if ((lo == n) || (cmp(rrd_get(h, lo), key) != 0)) {
+			continue;
+		}
+		hi = rrd_bound(h, key, cmp, 1);
+		/* Slot i of n starts (n - 1 - i) periods before h->start */
+		*from = h->start - (hrtime_t)(n - 1 - lo) * h->resolution;
+		*to = h->start - (hrtime_t)(n - hi) * h->resolution +
+		    h->resolution;
+		RRD_STAT(h, qhit, 1);
+		return (1);
+	}
+	return (0);
+}
+
+/* Start of the oldest slot of a non-empty rrd */
+static hrtime_t
+rrd_first(rrd_t *r)
+{
+	return (r->start - (hrtime_t)(rrd_len(r) - 1) * r->resolution);
+}
+
+/*
+ * Fold every period in [from, to] into *out with merge(out, entry).
+ * Each stretch of time comes from the finest tier holding it, and no
+ * stretch is counted twice: a coarse slot is taken whole, and the
+ * walk moves on from its end. *out is set from the first slot, so
+ * merge only ever combines.
+ *
+ * If the payload is monotonic (a txg range: the range of a span is
+ * its first slot's low and its last slot's high), set monotonic, and
+ * only the two boundary slots are touched.
+ *
+ * Returns 1 if any slot was folded, 0 if nothing lies in [from, to],
+ * or if the entries are encoded (a store() hook, as compact txg tiers:
+ * there is nothing for merge to fold).
+ */
+int
+dbrrd_query_range(rrd_t *h, hrtime_t from, hrtime_t to, void *out,
+    void (*merge)(void *, const void *), int monotonic)
+{
+	hrtime_t t, limit, s;
+	rrd_t *r, *c;
+	int i, n, found;
+
+	if ((rrd_len(h) == 0) || (from > to)) {
+		return (0);
+	}
+	for (r = h; r != NULL; r = r->next) {
+		if (r->store != NULL) {
+			return (0);
+		}
+	}
+	if (to > h->last) {
+		to = h->last;
+	}
+	found = 0;
+	t = from;
+	while (t <= to) {
+		/* The finest tier holding t, and where the finer ones begin */
+		limit = to + 1;
+		c = NULL;
+		for (r = h; r != NULL; r = r->next) {
+			i = rrd_slot(r, t);
+			if ((i >= 0) && (i < rrd_len(r))) {
+				break;
+			}
+			s = rrd_first(r);
+			if (s < limit) {
+				limit = s;
+			}
+			c = r;
+		}
+		if (r == NULL) {
+			/* Older than anything kept: start where the data does */
+			t = rrd_first(c);
+			continue;
+		}
+		n = rrd_len(r);
+		s = rrd_first(r) + (hrtime_t)i * r->resolution;
+		do {
+			if (!found) {
+				memcpy(out, rrd_get(r, i), r->size);
+				found = 1;
+			} else {
+				merge(out, rrd_get(r, i));
+			}
+			t = s + r->resolution;
+			if (monotonic) {
+				/* Skip to the slot holding the end */
+				if (t <= to) {
+					t = to;
+				}
+				break;
+			}
+			s = t;
+			++i;
+		} while ((i < n) && (s <= to) && (s < limit));
+	}
+	if (found) {
+		RRD_STAT(h, qhit, 1);
+	} else {
+		RRD_STAT(h, qmiss, 1);
+	}
+	return (found);
+}
+
+/*
+ * How far ahead the multi-series loops prefetch. Headers are fetched
+ * CRRD_AHEAD series ahead; by the time we are half way there, the
+ * header is in and the slot it points at can be fetched too.
+ */
+#define	CRRD_AHEAD	8
+#define	CRRD_PREFETCH(p)	__builtin_prefetch(p)
+#define	CRRD_PREFETCH_W(p)	__builtin_prefetch(p, 1)
+
+/* Prefetch the slot of database h that a query for tv will read */
+static void
+query_prefetch(rrd_t *h, hrtime_t tv)
+{
+	int i;
+
+	if ((tv > h->last) || (h->tail < 0)) {
+		return;
+	}
+	i = rrd_slot(h, tv);
+	if (i >= 0) {
+		i += h->head;
+		if (i >= h->capacity) {
+			i -= h->capacity;
+		}
+		CRRD_PREFETCH(rrd_entry(h, i));
+	} else if (h->next != NULL) {
+		CRRD_PREFETCH(h->next);
+	}
+}
+
+/*
+ * dbrrd_query() for n databases h[0..n-1] at the same time tv. The
+ * values go into vp[0..n-1] and resolutions into res[0..n-1]; a
+ * database with no data for tv gets NULL and 0. Returns the number
+ * found.
+ *
+ * The databases are usually all over memory, and a query loop is
+ * two cache misses per database (the rrd header, then the slot).
+ * Here both are prefetched a few databases ahead, so the misses
+ * overlap instead of being taken one after the other.
+ */
+int
+dbrrd_query_multi(rrd_t **h, int n, hrtime_t tv, void **vp, hrtime_t *res)
+{
+	int found = 0;
+
+	for (int i = 0; (i < CRRD_AHEAD) && (i < n); ++i) {
+		CRRD_PREFETCH(h[i]);
+	}
+	for (int i = 0; i < n; ++i) {
+		if (i + CRRD_AHEAD < n) {
+			CRRD_PREFETCH(h[i + CRRD_AHEAD]);
+		}
+		if (i + CRRD_AHEAD / 2 < n) {
+			query_prefetch(h[i + CRRD_AHEAD / 2], tv);
+		}
+		if (dbrrd_query(h[i], tv, &vp[i], &res[i])) {
+			++found;
+		} else {
+			vp[i] = NULL;
+			res[i] = 0;
+		}
+	}
+	return (found);
+}
+
+/*
+ * dbrrd_query_range() for n databases h[0..n-1] over the same
+ * [from, to]. Database i is folded into the buffer out[i] points at,
+ * and found[i] set to whether it had anything in the range (out[] is
+ * left as it is). Returns the number found. The rrd headers are
+ * prefetched a few databases ahead, as in dbrrd_query_multi().
+ */
+int
+dbrrd_query_range_multi(rrd_t **h, int n, hrtime_t from, hrtime_t to,
+    void **out, int *found_v, void (*merge)(void *, const void *),
+    int monotonic)
+{
+	int found = 0;
+
+	for (int i = 0; (i < CRRD_AHEAD) && (i < n); ++i) {
+		CRRD_PREFETCH(h[i]);
+	}
+	for (int i = 0; i < n; ++i) {
+		if (i + CRRD_AHEAD < n) {
+			CRRD_PREFETCH(h[i + CRRD_AHEAD]);
+		}
+		if (i + CRRD_AHEAD / 2 < n) {
+			query_prefetch(h[i + CRRD_AHEAD / 2], from);
+		}
+		found_v[i] = dbrrd_query_range(h[i], from, to, out[i], merge,
+		    monotonic);
+		found += found_v[i];
+	}
+	return (found);
+}
+
 void
 dbrrd_add_at(rrd_t *r, void *vp, hrtime_t t)
 {
+	LAT_BEGIN();
 	while (r != NULL) {
-	    rrd_add_at(r, vp, t);
+	    add_at(r, vp, t);
 	    r = r->next;
 	}
+	LAT_END(CRRD_LAT_DBADD);
 }
 
+/*
+ * dbrrd_add_at(), for a time t whose period starts are already known:
+ * for resolution res[i] the period holding t starts at start[i]. A
+ * tier with one of those resolutions needs no division to place the
+ * sample, and a sample in the same period as the last is then one
+ * compare. Other tiers work it out as usual.
+ */
 void
-dbrrd_add(rrd_t *r, void *v)
+dbrrd_add_known(rrd_t *r, void *vp, hrtime_t t, const hrtime_t *res,
+    const hrtime_t *start, int n)
 {
-	hrtime_t t;
+	hrtime_t t0;
+	int i;
 
-#ifdef TESTING
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	t = SEC2NSEC(now.tv_sec) + USEC2NSEC(now.tv_usec);
-#else
-	t = gethrtime();
-#endif
+	LAT_BEGIN();
+	for (; r != NULL; r = r->next) {
+		for (i = 0; (i < n) && (res[i] != r->resolution); ++i)
+			;
+		t0 = (i < n) ? start[i] : find_period(t, r->resolution);
+		add_period(r, vp, t, t0);
+	}
+	LAT_END(CRRD_LAT_DBADD);
+}
+
+/* Prefetch the slot an add at time t will write in database h */
+static void
+add_prefetch(rrd_t *h, hrtime_t t)
+{
+	int i;
+
+	if (h->tail < 0) {
+		return;
+	}
+	i = h->tail;
+	if (t - h->start >= h->resolution) {
+		/* A new period, the slot after the tail */
+		if (++i >= h->capacity) {
+			i = 0;
+		}
+	}
+	CRRD_PREFETCH_W(rrd_entry(h, i));
+	if (h->next != NULL) {
+		CRRD_PREFETCH(h->next);
+	}
+}
+
+/*
+ * dbrrd_add_at() of one sample into each of n databases h[0..n-1], all
+ * at time t (one scrape of many series). The values are packed one
+ * after the other at v, each h[i]->size bytes.
+ *
+ * As with dbrrd_query_multi(), the rrd headers and the slots the adds
+ * will write are prefetched a few databases ahead.
+ */
+void
+dbrrd_add_multi(rrd_t **h, int n, void *v, hrtime_t t)
+{
+	char *p = v;
+
+	for (int i = 0; (i < CRRD_AHEAD) && (i < n); ++i) {
+		CRRD_PREFETCH_W(h[i]);
+	}
+	for (int i = 0; i < n; ++i) {
+		if (i + CRRD_AHEAD < n) {
+			CRRD_PREFETCH_W(h[i + CRRD_AHEAD]);
+		}
+		if (i + CRRD_AHEAD / 2 < n) {
+			add_prefetch(h[i + CRRD_AHEAD / 2], t);
+		}
+		dbrrd_add_at(h[i], p, t);
+		p += h[i]->size;
+	}
+}
+
+/*
+ * Add n samples: the values are packed one after the other (each
+ * r->size bytes) at v, with times t[0..n-1].
+ */
+void
+rrd_add_batch(rrd_t *r, void *v, const hrtime_t *t, int n)
+{
+	char *p = v;
+
+	for (int i = 0; i < n; ++i) {
+		rrd_add_at(r, p, t[i]);
+		p += r->size;
+	}
+}
 
-	dbrrd_add_at(r, v, t);
+/*
+ * Add n samples to the database. This goes an rrd at a time, rather
+ * than a sample at a time as dbrrd_add_at() would, keeping one rrd
+ * hot in cache. The result is the same.
+ */
+void
+dbrrd_add_batch(rrd_t *r, void *v, const hrtime_t *t, int n)
+{
+	while (r != NULL) {
+	    rrd_add_batch(r, v, t, n);
+	    r = r->next;
+	}
+}
+
+/* Roll every rrd of the database forward to time t (see rrd_roll) */
+void
+dbrrd_roll(rrd_t *r, hrtime_t t)
+{
+	while (r != NULL) {
+	    rrd_roll(r, t);
+	    r = r->next;
+	}
+}
+
+/*
+ * Set the reorder window of every rrd of the database (see
+ * rrd_setreorder). A coarse tier keeps its late periods longer, so
+ * a sample can be too late for the fine tiers and still land in the
+ * coarse ones.
+ */
+int
+dbrrd_setreorder(rrd_t *h, hrtime_t window)
+{
+	for (; h != NULL; h = h->next) {
+		if (rrd_setreorder(h, window) != 0) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* Set the fill kind of every rrd of the database (see rrd_setfill) */
+int
+dbrrd_setfill(rrd_t *h, int kind, const void *pattern)
+{
+	for (; h != NULL; h = h->next) {
+		if (rrd_setfill(h, kind, pattern) != 0) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* Set every rrd of the database lazy, or not (see rrd_setlazy) */
+int
+dbrrd_setlazy(rrd_t *h, int on)
+{
+	for (; h != NULL; h = h->next) {
+		if (rrd_setlazy(h, on) != 0) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* Start counting on every rrd of the database. Returns 1 on success. */
+int
+dbrrd_stats_enable(rrd_t *h)
+{
+	for (; h != NULL; h = h->next) {
+		if (!rrd_stats_enable(h)) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
+/*
+ * Snapshot the counters of the database, one rrd_stats_t per rrd
+ * (finest first) into sp[0..n-1]. qhit is then the queries answered
+ * by each tier, and sp[0].qmiss the queries nothing answered. Returns
+ * the number of rrds, which may be more than n.
+ */
+int
+dbrrd_stats(rrd_t *h, rrd_stats_t *sp, int n)
+{
+	int i;
+
+	for (i = 0; h != NULL; h = h->next, ++i) {
+		if (i < n) {
+			rrd_stats(h, &sp[i]);
+		}
+	}
+	return (i);
+}
+
+void
+dbrrd_add(rrd_t *r, void *v)
+{
+	dbrrd_add_at(r, v, crrd_now());
 }
 
 void
@@ -422,12 +1852,42 @@ dbrrd_destroy(rrd_t *h)
 	}
 }
 
+/*
+ * Check a spec for dbrrd_create: at least one tier, {0, 0} terminated,
+ * every tier with a positive resolution, and strictly descending by
+ * resolution (dbrrd_query looks finest first, and stops at the first
+ * tier covering the time, so a misordered spec answers wrongly).
+ * Returns 1 if good.
+ */
+int
+dbrrd_spec_check(dbrrd_spec_t *p)
+{
+	if (p->capacity <= 0) {
+		return (0);
+	}
+	for (; p->capacity > 0; ++p) {
+		if (p->tv <= 0) {
+			return (0);
+		}
+		if ((p[1].capacity > 0) && (p[1].tv >= p->tv)) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
 rrd_t *
 dbrrd_create(char *name, dbrrd_spec_t *p, size_t sz, void *update, void *zero)
 {
 	rrd_t *h;
 	rrd_t *r;
 
+	if (!dbrrd_spec_check(p)) {
+#ifdef TESTING
+		fprintf(stderr, "dbrrd_create: bad spec\n");
+#endif
+		return NULL;
+	}
 	h = NULL;
 	while (p->capacity > 0) {
 		r = rrd_create(name, p->tv, p->capacity, sz);
@@ -447,3 +1907,97 @@ dbrrd_create(char *name, dbrrd_spec_t *p, size_t sz, void *update, void *zero)
 	}
 	return h;
 }
+
+#ifdef CRRD_LATENCY
+/*
+ * Snapshot latency histogram which (CRRD_LAT_ADD, ...) into *lp, with
+ * the buckets in nanoseconds: bucket i counts [2^i, 2^(i+1)) ns.
+ */
+void
+crrd_latency(int which, crrd_latency_t *lp)
+{
+	crrd_latency_t *l = &lat_hist[which];
+
+	memset(lp, 0, sizeof (crrd_latency_t));
+#ifdef LAT_TSC
+	{
+		struct timespec nap = { 0, 0 };
+		double scale;
+		uint64_t ticks;
+		hrtime_t ns;
+		int b;
+
+		/* Calibrate the TSC over at least a millisecond */
+		(void) lat_now();
+		for (;;) {
+			ns = lat_mono() - lat_ns0;
+			ticks = __rdtsc() - lat_tsc0;
+			if (ns >= 1000000) {
+				break;
+			}
+			nap.tv_nsec = 1000000 - ns;
+			nanosleep(&nap, NULL);
+		}
+		scale = (double)ns / ticks;
+		for (int i = 0; i < 64; ++i) {
+			if (l->bucket[i] == 0) {
+				continue;
+			}
+			ticks = (uint64_t)((double)(1ULL << i) * scale);
+			b = (ticks == 0) ? 0 : 63 - __builtin_clzll(ticks);
+			lp->bucket[b] += l->bucket[i];
+		}
+		lp->count = l->count;
+		lp->max = (uint64_t)(__atomic_load_n(&l->max,
+		    __ATOMIC_RELAXED) * scale);
+	}
+#else
+	*lp = *l;
+#endif
+}
+
+#ifdef TESTING
+/*
+ * Upper bound, in ns, of the bucket holding the p'th fraction of the
+ * calls (p = 0.5 for the median)
+ */
+static uint64_t
+lat_pct(crrd_latency_t *l, double p)
+{
+	uint64_t want = (uint64_t)(l->count * p);
+	uint64_t n = 0;
+
+	for (int i = 0; i < 64; ++i) {
+		n += l->bucket[i];
+		if ((n > want) || (n == l->count)) {
+			return (2ULL << i);
+		}
+	}
+	return (l->max);
+}
+
+/* Print the latency histograms */
+void
+crrd_latency_dump(FILE *f)
+{
+	static const char *names[CRRD_LAT_N] = {
+		"rrd_add_at", "dbrrd_add_at", "dbrrd_query"
+	};
+	crrd_latency_t l;
+
+	for (int w = 0; w < CRRD_LAT_N; ++w) {
+		crrd_latency(w, &l);
+		fprintf(f, "%s: %lu calls, p50 < %lu ns, p99 < %lu ns, "
+		    "p99.9 < %lu ns, max %lu ns\n", names[w], l.count,
+		    lat_pct(&l, 0.5), lat_pct(&l, 0.99), lat_pct(&l, 0.999),
+		    l.max);
+		for (int i = 0; i < 64; ++i) {
+			if (l.bucket[i] != 0) {
+				fprintf(f, "  %12llu - %12llu ns %12lu\n",
+				    1ULL << i, (2ULL << i) - 1, l.bucket[i]);
+			}
+		}
+	}
+}
+#endif
+#endif
@@ -2,13 +2,21 @@
  * crrd.h
  */
 
+#ifndef _CRRD_H
+#define	_CRRD_H
+
 #ifdef TESTING
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/time.h>
 typedef long long longlong_t;
 typedef longlong_t hrtime_t;
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct rrd {
 	char *name;	      /* name */
 	size_t asize;         /* allocation size */
@@ -17,11 +25,24 @@ typedef struct rrd {
 	size_t size;	      /* size of an entry */
 	int head;	      /* head (beginning) */
 	int tail;	      /* tail (end) */
+	int ltail;	      /* real tail while a late sample merges, or -1 */
 	hrtime_t start;	      /* begin time of current bucket */
 	hrtime_t last;	      /* last update time */
+	hrtime_t reorder;     /* how late a sample may be, 0 for not at all */
+	int flags;	      /* RRD_ flags */
+	struct rrd_stats_slot *stats; /* counters, NULL if not enabled */
+	int nstats;	      /* number of stats slots (CPUs) */
 	struct rrd *next;     /* allow for list of rrd */
 	void (*zero)(struct rrd *, void *);
 	void (*update)(struct rrd *, void *);
+	void (*store)(struct rrd *, void *); /* NULL to copy samples */
+	void *arg;	      /* for the callbacks */
+	int fill;	      /* RRD_FILL_ kind of zero() */
+	int fillbyte;	      /* byte the fill pattern repeats, or -1 */
+	const void *fillp;    /* fill pattern, for RRD_FILL_CONST */
+	struct rrd_run *runs; /* gap runs, NULL if not lazy (rrd_setlazy) */
+	int nruns;	      /* runs in use */
+	uint64_t *gaps;	      /* a bit per slot holding fill (rrd_setreorder) */
 	/*
 	 * Ring buffer entries. Sized one uint64_t larger than is
 	 * actually needed (capacity * size) bytesa. As soon as
@@ -33,11 +54,60 @@ typedef struct rrd {
 	longlong_t entries[1];
 } rrd_t;
 
+/* flags */
+#define	RRD_TAILFILL	0x1   /* tail was filled by rrd_roll, not a sample */
+
+/* Fill kinds, for rrd_setfill(): what zero() does to skipped periods */
+#define	RRD_FILL_CALLBACK	0   /* call zero() for each */
+#define	RRD_FILL_CONST		1   /* a constant entry */
+#define	RRD_FILL_PREV		2   /* the entry before the gap */
+#define	RRD_FILL_VALUE		3   /* the sample that ended the gap */
+
+/*
+ * A run of skipped periods that all hold the same fill entry, kept as
+ * one record rather than written slot by slot (rrd_setlazy). Each rrd
+ * has up to RRD_RUNS; their fill entries follow the array.
+ */
+#define	RRD_RUNS	8
+
+typedef struct rrd_run {
+	hrtime_t from;	      /* start of the first period */
+	hrtime_t n;	      /* periods */
+	int slot;	      /* slot of the first period (were it in the ring) */
+} rrd_run_t;
+
+/*
+ * Counters, enabled per rrd by rrd_stats_enable(). Taken by
+ * rrd_stats(), which adds up the per-CPU slots.
+ */
+typedef struct rrd_stats {
+	uint64_t accepted;    /* samples taken */
+	uint64_t late;	      /* samples dropped as older than last */
+	uint64_t reordered;   /* late samples merged within the window */
+	uint64_t advanced;    /* periods moved forward */
+	uint64_t maxgap;      /* most periods moved forward at once */
+	uint64_t updates;     /* update() calls */
+	uint64_t zeros;	      /* zero() calls */
+	uint64_t qhit;	      /* queries answered by this rrd */
+	uint64_t qmiss;	      /* queries with no data (first rrd only) */
+} rrd_stats_t;
+
 typedef struct dbrrd_spec {
 	int capacity;
 	hrtime_t tv;
 } dbrrd_spec_t;
 
+/* Clocks, for crrd_setclock() */
+#define	CRRD_CLOCK_REALTIME		0
+#define	CRRD_CLOCK_MONOTONIC		1
+#define	CRRD_CLOCK_REALTIME_COARSE	2
+#define	CRRD_CLOCK_TSC			3
+#define	CRRD_CLOCK_CACHED		4
+
+int crrd_setclock(int kind);
+void crrd_setnow(hrtime_t t);
+hrtime_t crrd_now(void);
+
 rrd_t *rrd_create(char *s, hrtime_t res, unsigned cap, size_t sz);
 unsigned rrd_len(rrd_t *r);
 hrtime_t rrd_resolution(rrd_t *r);
@@ -49,11 +119,279 @@ void *rrd_entry(rrd_t *r, int i);
 void *rrd_get(rrd_t *r, int i);
 void rrd_add(rrd_t *r, void *v);
 void rrd_setfunctions(rrd_t *r, void *fupdate, void *fzero);
+void rrd_setstore(rrd_t *r, void *fstore, void *arg);
+int rrd_setfill(rrd_t *r, int kind, const void *pattern);
+int rrd_setlazy(rrd_t *r, int on);
 int rrd_tail(rrd_t *r);
+void rrd_roll(rrd_t *r, hrtime_t t);
+int rrd_stats_enable(rrd_t *r);
+void rrd_stats(rrd_t *r, rrd_stats_t *sp);
+void rrd_add_batch(rrd_t *r, void *v, const hrtime_t *t, int n);
+int rrd_setreorder(rrd_t *r, hrtime_t window);
 
 int dbrrd_query(rrd_t *r, hrtime_t tv, void **vp, hrtime_t *res);
+int dbrrd_find_value(rrd_t *h, const void *key,
+	int (*cmp)(const void *, const void *), hrtime_t *from, hrtime_t *to);
+int dbrrd_query_range(rrd_t *h, hrtime_t from, hrtime_t to, void *out,
+	void (*merge)(void *, const void *), int monotonic);
+int dbrrd_query_multi(rrd_t **h, int n, hrtime_t tv, void **vp,
+	hrtime_t *res);
+int dbrrd_query_range_multi(rrd_t **h, int n, hrtime_t from, hrtime_t to,
+	void **out, int *found, void (*merge)(void *, const void *),
+	int monotonic);
 void dbrrd_add_at(rrd_t *r, void *vp, hrtime_t t);
 void dbrrd_add(rrd_t *r, void *v);
+void dbrrd_add_known(rrd_t *r, void *vp, hrtime_t t, const hrtime_t *res,
+	const hrtime_t *start, int n);
+void dbrrd_add_batch(rrd_t *r, void *v, const hrtime_t *t, int n);
+void dbrrd_add_multi(rrd_t **h, int n, void *v, hrtime_t t);
+void dbrrd_roll(rrd_t *r, hrtime_t t);
+int dbrrd_setreorder(rrd_t *h, hrtime_t window);
+int dbrrd_setfill(rrd_t *h, int kind, const void *pattern);
+int dbrrd_setlazy(rrd_t *h, int on);
+int dbrrd_stats_enable(rrd_t *h);
+int dbrrd_stats(rrd_t *h, rrd_stats_t *sp, int n);
 void dbrrd_destroy(rrd_t *h);
+int dbrrd_spec_check(dbrrd_spec_t *p);
 rrd_t *dbrrd_create(char *name, dbrrd_spec_t *p, size_t sz,
 	void *update, void *zero);
+
+/*
+ * Self-hosted metrics (crrd_metrics.c). crrd's own counters, summed
+ * per period into a database of their own.
+ */
+#define	CRRD_METRICS_TIERS	8	/* deeper tiers count in the last */
+
+typedef struct crrd_metrics_entry {
+	uint64_t accepted;    /* samples taken */
+	uint64_t late;	      /* samples dropped as late */
+	uint64_t advanced;    /* periods moved forward */
+	uint64_t queries[CRRD_METRICS_TIERS]; /* queries answered, by tier */
+	uint64_t qmiss;	      /* queries with no data */
+	uint64_t samples;     /* crrd_metrics_sample calls in the period */
+} crrd_metrics_entry_t;
+
+typedef struct crrd_metrics {
+	rrd_t *db;	      /* our history */
+	rrd_t **watch;	      /* databases watched */
+	int nwatch;
+	int maxwatch;
+	crrd_metrics_entry_t prev; /* totals at the last sample */
+} crrd_metrics_t;
+
+crrd_metrics_t *crrd_metrics_create(dbrrd_spec_t *spec);
+int crrd_metrics_watch(crrd_metrics_t *m, rrd_t *h);
+void crrd_metrics_unwatch(crrd_metrics_t *m, rrd_t *h);
+void crrd_metrics_sample_at(crrd_metrics_t *m, hrtime_t t);
+void crrd_metrics_sample(crrd_metrics_t *m);
+int crrd_metrics_query(crrd_metrics_t *m, hrtime_t tv,
+	crrd_metrics_entry_t **ep, hrtime_t *res);
+void crrd_metrics_destroy(crrd_metrics_t *m);
+
+/*
+ * Compact txg tiers (crrd_txg.c): per-block 64-bit bases and 32-bit
+ * offsets, half the memory of low/high uint64_t pairs.
+ */
+#define	CRRD_TXG_BLOCK	64    /* slots sharing a base */
+
+rrd_t *crrd_txg_create(char *name, dbrrd_spec_t *spec);
+void crrd_txg_add_at(rrd_t *h, uint64_t txg, hrtime_t t);
+int crrd_txg_query(rrd_t *h, hrtime_t tv, uint64_t *lo, uint64_t *hi,
+	hrtime_t *res);
+size_t crrd_txg_size(rrd_t *h);
+void crrd_txg_destroy(rrd_t *h);
+
+/*
+ * Bounded reorder buffer (crrd_reorder.c). Holds samples for a delay
+ * and releases them to a database in time order.
+ */
+typedef struct crrd_reorder crrd_reorder_t;
+
+crrd_reorder_t *crrd_reorder_create(rrd_t *h, int k, hrtime_t delay);
+void crrd_reorder_add(crrd_reorder_t *q, void *v, hrtime_t t);
+int crrd_reorder_len(crrd_reorder_t *q);
+void crrd_reorder_flush(crrd_reorder_t *q);
+void crrd_reorder_destroy(crrd_reorder_t *q);
+
+#ifdef CRRD_LATENCY
+/*
+ * Latency histograms, compiled in with -DCRRD_LATENCY. Bucket i
+ * counts calls that took [2^i, 2^(i+1)) nanoseconds.
+ */
+#define	CRRD_LAT_ADD	0     /* rrd_add_at */
+#define	CRRD_LAT_DBADD	1     /* dbrrd_add_at */
+#define	CRRD_LAT_QUERY	2     /* dbrrd_query */
+#define	CRRD_LAT_N	3
+
+typedef struct crrd_latency {
+	uint64_t bucket[64];
+	uint64_t count;
+	uint64_t max;	      /* longest call */
+} crrd_latency_t;
+
+void crrd_latency(int which, crrd_latency_t *lp);
+#ifdef TESTING
+void crrd_latency_dump(FILE *f);
+#endif
+#endif
+
+#ifdef TESTING
+/*
+ * Series groups (crrd_group.c) -- user space only, as these use
+ * floats. A group is n float series sharing one tier layout.
+ */
+#define	GROUP_SUM	0
+#define	GROUP_MIN	1
+#define	GROUP_MAX	2
+#define	GROUP_MEAN	3
+
+typedef struct dbrrd_group {
+	rrd_t *db;	      /* the tiers, each entry is one row */
+	int n;		      /* number of series in a row */
+	int agg;	      /* GROUP_SUM, GROUP_MIN, ... */
+	float *row;	      /* staging row handed to dbrrd_add_at */
+} dbrrd_group_t;
+
+dbrrd_group_t *dbrrd_group_create(char *name, dbrrd_spec_t *p, int n,
+	int agg);
+void dbrrd_group_add_row(dbrrd_group_t *g, hrtime_t t, const float *values,
+	int n);
+int dbrrd_group_query(dbrrd_group_t *g, hrtime_t tv, float **vp,
+	hrtime_t *res);
+const char *dbrrd_group_isa(void);
+void dbrrd_group_destroy(dbrrd_group_t *g);
+
+/*
+ * Timer wheel (crrd_wheel.c) -- user space only. Rolls idle rrds over
+ * at their period boundaries.
+ */
+typedef struct crrd_wheel crrd_wheel_t;
+
+crrd_wheel_t *crrd_wheel_create(hrtime_t tick, hrtime_t now);
+int crrd_wheel_add(crrd_wheel_t *w, rrd_t *h);
+void crrd_wheel_remove(crrd_wheel_t *w, rrd_t *h);
+void crrd_wheel_advance(crrd_wheel_t *w, hrtime_t now);
+int crrd_wheel_start(crrd_wheel_t *w);
+void crrd_wheel_stop(crrd_wheel_t *w);
+void crrd_wheel_lock(crrd_wheel_t *w, rrd_t *h);
+void crrd_wheel_unlock(crrd_wheel_t *w, rrd_t *h);
+void crrd_wheel_destroy(crrd_wheel_t *w);
+
+/*
+ * Time ticker (crrd_ticker.c) -- user space only. A thread publishes
+ * the time, and the period start for each of a set of resolutions,
+ * on a read-only shared page once per tick.
+ */
+#define	CRRD_TICK_MAX	16    /* resolutions a ticker can publish */
+
+typedef struct crrd_tick_page {
+	volatile uint64_t seq;	      /* odd while being written */
+	volatile hrtime_t now;
+	int nres;
+	hrtime_t res[CRRD_TICK_MAX];
+	volatile hrtime_t start[CRRD_TICK_MAX];
+} crrd_tick_page_t;
+
+typedef struct crrd_ticker crrd_ticker_t;
+
+crrd_ticker_t *crrd_ticker_create(hrtime_t tick, const hrtime_t *res,
+	int nres);
+const crrd_tick_page_t *crrd_ticker_page(crrd_ticker_t *k);
+hrtime_t crrd_ticker_now(crrd_ticker_t *k);
+void dbrrd_add_tick(crrd_ticker_t *k, rrd_t *h, void *v);
+void crrd_ticker_destroy(crrd_ticker_t *k);
+
+/*
+ * Work-stealing thread pool (crrd_pool.c) -- user space only, and the
+ * parallel operations that use it.
+ */
+typedef struct crrd_pool crrd_pool_t;
+typedef void (*crrd_task_fn)(void *);
+
+/* Tasks waited for together; zero it before the first submit */
+typedef struct crrd_pool_batch {
+	int pending;		      /* submitted and not yet finished */
+} crrd_pool_batch_t;
+
+crrd_pool_t *crrd_pool_create(int n);
+int crrd_pool_size(crrd_pool_t *p);
+void crrd_pool_submit(crrd_pool_t *p, crrd_pool_batch_t *b,
+	crrd_task_fn fn, void *arg);
+void crrd_pool_wait(crrd_pool_t *p, crrd_pool_batch_t *b);
+void crrd_pool_destroy(crrd_pool_t *p);
+
+void dbrrd_add_batch_parallel(crrd_pool_t *p, rrd_t *h, void *v,
+	const hrtime_t *t, int n);
+int dbrrd_query_bulk(crrd_pool_t *p, rrd_t **h, int n, hrtime_t tv,
+	void **vp, hrtime_t *res);
+int dbrrd_query_range_bulk(crrd_pool_t *p, rrd_t **h, int n,
+	hrtime_t from, hrtime_t to, void **out, int *found,
+	void (*merge)(void *, const void *), int monotonic);
+
+/*
+ * Text ingest (crrd_line.c) -- user space only. Graphite plaintext
+ * lines, "name value [timestamp]", parsed into dbrrds of doubles.
+ */
+typedef struct crrd_line_stats {
+	uint64_t lines;		      /* samples parsed */
+	uint64_t bad;		      /* malformed lines skipped */
+	uint64_t unknown;	      /* samples lookup had no rrd for */
+} crrd_line_stats_t;
+
+typedef void (*crrd_line_fn)(void *, const char *, size_t, double,
+	hrtime_t);
+typedef rrd_t *(*crrd_line_lookup_fn)(void *, const char *, size_t);
+
+size_t crrd_line_parse(const char *buf, size_t len, hrtime_t now,
+	crrd_line_fn fn, void *arg, crrd_line_stats_t *st);
+size_t crrd_line_add(const char *buf, size_t len, hrtime_t now,
+	crrd_line_lookup_fn lookup, void *arg, crrd_line_stats_t *st);
+int crrd_line_double(const char **pp, const char *end, double *vp);
+
+/*
+ * StatsD listener (crrd_statsd.c) -- user space only. Counters, timers
+ * and gauges from UDP datagrams, aggregated per period of the finest
+ * tier in memory and flushed into a dbrrd per metric.
+ */
+#define	CRRD_STATSD_PORT	8125
+#define	CRRD_STATSD_NAMELEN	128
+#define	CRRD_STATSD_MAXMETRIC	65536 /* new names past this are bad */
+
+#define	CRRD_STATSD_COUNTER	0     /* c: a double, the period's sum */
+#define	CRRD_STATSD_TIMER	1     /* ms, h: a crrd_statsd_timer_t */
+#define	CRRD_STATSD_GAUGE	2     /* g: a double, the last value */
+
+typedef struct crrd_statsd_timer {
+	double count;		      /* samples, scaled up by sample rate */
+	double sum;		      /* of the samples, scaled likewise */
+	double min;
+	double max;
+} crrd_statsd_timer_t;
+
+typedef struct crrd_statsd_stats {
+	uint64_t packets;	      /* datagrams received */
+	uint64_t metrics;	      /* samples taken */
+	uint64_t bad;		      /* lines, and datagrams, not taken */
+} crrd_statsd_stats_t;
+
+typedef struct crrd_statsd crrd_statsd_t;
+
+crrd_statsd_t *crrd_statsd_create(const char *addr, int port,
+	dbrrd_spec_t *spec);
+int crrd_statsd_port(crrd_statsd_t *s);
+int crrd_statsd_run(crrd_statsd_t *s);
+void crrd_statsd_stop(crrd_statsd_t *s);
+void crrd_statsd_parse(crrd_statsd_t *s, const char *buf, size_t len);
+void crrd_statsd_flush(crrd_statsd_t *s, hrtime_t t);
+void crrd_statsd_lock(crrd_statsd_t *s);
+void crrd_statsd_unlock(crrd_statsd_t *s);
+rrd_t *crrd_statsd_series(crrd_statsd_t *s, const char *name, int *type);
+void crrd_statsd_stats(crrd_statsd_t *s, crrd_statsd_stats_t *st);
+void crrd_statsd_destroy(crrd_statsd_t *s);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CRRD_H */
@@ -0,0 +1,355 @@
+/*
+ * crrd.hpp
+ *
+ * Header-only C++17 front-end to crrd.
+ *
+ * The C library takes values as void * and aggregates through update()
+ * and zero() function pointers, so that the same code serves any value
+ * type in ZFS. That costs an indirect call per sample per tier, and
+ * the compiler can see neither the aggregation nor the resolutions.
+ * Here the value type, the aggregator and the tiers are template
+ * parameters:
+ *
+ *   using Db = crrd::Database<uint32_t, crrd::Sum<uint32_t>,
+ *       crrd::Tier<24, crrd::seconds(3600)>,
+ *       crrd::Tier<60, crrd::seconds(60)>,
+ *       crrd::Tier<60, crrd::seconds(1)>>;
+ *   Db db;
+ *   db.add_at(1, t);
+ *
+ * Tiers are listed as for dbrrd_create(): coarsest first. update()
+ * inlines, each period computation divides by a constant (a multiply,
+ * or a mask for powers of two), and every tier's ring is a std::array
+ * inside the one Database object -- no heap at all.
+ *
+ * The behaviour is that of dbrrd_add_at() and dbrrd_query(): samples
+ * older than the newest are dropped, skipped periods are filled by the
+ * aggregator's zero(), and a query is answered by the finest tier
+ * that reaches back far enough.
+ *
+ * An aggregator is a type with
+ *
+ *   static void update(T &slot, const T &v);   merge v into the period
+ *   static void zero(T &slot, const T &v);     fill a skipped period
+ *
+ * where zero() is given the sample that ended the gap, as in C.
+ */
+
+#ifndef _CRRD_HPP
+#define	_CRRD_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+
+namespace crrd {
+
+typedef long long hrtime_t;
+
+constexpr hrtime_t
+seconds(long long s)
+{
+	return (s * 1000LL * 1000LL * 1000LL);
+}
+
+/* One tier: Capacity periods of Resolution nanoseconds */
+template <int Capacity, hrtime_t Resolution>
+struct Tier {
+	static_assert(Capacity > 0, "a tier needs capacity");
+	static_assert(Resolution > 0, "a tier needs a resolution");
+	static constexpr int capacity = Capacity;
+	static constexpr hrtime_t resolution = Resolution;
+};
+
+/*
+ * A tier specification, checked at compile time. Tiers are listed
+ * coarsest first, as for dbrrd_create(), and must be
+ *
+ *   ordered    strictly descending by resolution -- dbrrd_query()
+ *              looks finest first, and stops at the first tier that
+ *              covers the time
+ *   divisible  each resolution a multiple of the next finer one, so
+ *              that every coarse period is made of whole fine ones
+ *
+ * Database and c_spec() static_assert both. entries is the total of the
+ * capacities, and bytes(sz) the memory the rings take for values of
+ * sz bytes. c_spec<dbrrd_spec_t>() is the {0, 0} terminated array to
+ * give dbrrd_create(), built at compile time:
+ *
+ *   constexpr auto spec = crrd::Spec<crrd::Tier<24, crrd::seconds(3600)>,
+ *       crrd::Tier<60, crrd::seconds(60)>>::c_spec<dbrrd_spec_t>();
+ */
+template <typename... Tiers>
+struct Spec {
+	static constexpr std::size_t ntiers = sizeof... (Tiers);
+
+private:
+	static constexpr std::array<hrtime_t, ntiers> res_ {
+		Tiers::resolution...
+	};
+
+	static constexpr bool
+	check_ordered()
+	{
+		for (std::size_t i = 1; i < ntiers; ++i) {
+			if (res_[i - 1] <= res_[i]) {
+				return (false);
+			}
+		}
+		return (true);
+	}
+
+	static constexpr bool
+	check_divisible()
+	{
+		for (std::size_t i = 1; i < ntiers; ++i) {
+			if (res_[i - 1] % res_[i] != 0) {
+				return (false);
+			}
+		}
+		return (true);
+	}
+
+public:
+	static constexpr bool ordered = check_ordered();
+	static constexpr bool divisible = check_divisible();
+	static constexpr std::size_t entries = (0 + ... + Tiers::capacity);
+
+	static constexpr std::size_t
+	bytes(std::size_t sz)
+	{
+		return (entries * sz);
+	}
+
+	template <typename S>
+	static constexpr std::array<S, ntiers + 1>
+	c_spec()
+	{
+		static_assert(ordered, "tiers must be coarsest first");
+		static_assert(divisible,
+		    "each resolution must be a multiple of the next finer one");
+		return (std::array<S, ntiers + 1> {
+		    { S { Tiers::capacity, Tiers::resolution }..., S { 0, 0 } }
+		});
+	}
+};
+
+/* Sum of the samples; a period with none is zero */
+template <typename T>
+struct Sum {
+	static void update(T &slot, const T &v) { slot += v; }
+	static void zero(T &slot, const T &) { slot = T(); }
+};
+
+/* Smallest sample; a period with none holds the next sample */
+template <typename T>
+struct Min {
+	static void update(T &slot, const T &v) { if (v < slot) slot = v; }
+	static void zero(T &slot, const T &v) { slot = v; }
+};
+
+/* Largest sample */
+template <typename T>
+struct Max {
+	static void update(T &slot, const T &v) { if (slot < v) slot = v; }
+	static void zero(T &slot, const T &v) { slot = v; }
+};
+
+/* First sample of the period (txg: the earliest txg of the period) */
+template <typename T>
+struct First {
+	static void update(T &, const T &) { }
+	static void zero(T &slot, const T &v) { slot = v; }
+};
+
+/* Last sample of the period */
+template <typename T>
+struct Last {
+	static void update(T &slot, const T &v) { slot = v; }
+	static void zero(T &slot, const T &v) { slot = v; }
+};
+
+/* One rrd: a ring of periods, as rrd_t */
+template <typename T, typename Agg, typename Tr>
+class Ring {
+public:
+	static constexpr int capacity = Tr::capacity;
+	static constexpr hrtime_t resolution = Tr::resolution;
+
+	static constexpr hrtime_t
+	period(hrtime_t t)
+	{
+		return (t - t % resolution);
+	}
+
+	int
+	len() const
+	{
+		if (tail_ < 0) {
+			return (0);
+		}
+		if (head_ <= tail_) {
+			return (tail_ - head_ + 1);
+		}
+		return (capacity - head_ + tail_ + 1);
+	}
+
+	/* As rrd_get: i from 0 (oldest) to len() - 1 */
+	const T *
+	get(int i) const
+	{
+		if ((i < 0) || (i >= len())) {
+			return (nullptr);
+		}
+		int n = head_ + i;
+		if (n >= capacity) {
+			n -= capacity;
+		}
+		return (&e_[n]);
+	}
+
+	hrtime_t start() const { return (start_); }
+	hrtime_t last() const { return (last_); }
+
+	/* As rrd_add_at */
+	void
+	add_at(const T &v, hrtime_t t)
+	{
+		hrtime_t t0 = period(t);
+
+		if (tail_ < 0) {
+			head_ = tail_ = 0;
+			e_[0] = v;
+			start_ = t0;
+			last_ = t;
+			return;
+		}
+		if (t < last_) {
+			return;
+		}
+		if (t0 == start_) {
+			last_ = t;
+			Agg::update(e_[tail_], v);
+			return;
+		}
+		while (start_ < t0) {
+			forward();
+			Agg::zero(e_[tail_], v);
+		}
+		e_[tail_] = v;
+		start_ = t0;
+		last_ = t;
+	}
+
+	/* Index (for get) of the period holding tv, -1 if too old */
+	int
+	slot(hrtime_t tv) const
+	{
+		hrtime_t first = start_ - resolution * (len() - 1);
+		hrtime_t t0 = period(tv);
+
+		if (t0 < first) {
+			return (-1);
+		}
+		return ((int)((t0 - first) / resolution));
+	}
+
+private:
+	void
+	forward()
+	{
+		if (++tail_ >= capacity) {
+			tail_ = 0;
+		}
+		if (tail_ == head_) {
+			if (++head_ >= capacity) {
+				head_ = 0;
+			}
+		}
+		start_ += resolution;
+	}
+
+	std::array<T, capacity> e_ {};
+	int head_ = -1;
+	int tail_ = -1;
+	hrtime_t start_ = 0;
+	hrtime_t last_ = 0;
+};
+
+/*
+ * A database of tiers, coarsest first (as for dbrrd_create). Every
+ * sample goes into every tier; queries look finest first.
+ */
+template <typename T, typename Agg, typename... Tiers>
+class Database {
+	static_assert(sizeof... (Tiers) > 0, "a database needs a tier");
+	static_assert(Spec<Tiers...>::ordered,
+	    "tiers must be strictly descending by resolution");
+	static_assert(Spec<Tiers...>::divisible,
+	    "each resolution must be a multiple of the next finer one");
+
+public:
+	typedef Spec<Tiers...> spec;
+	static constexpr std::size_t ntiers = sizeof... (Tiers);
+	/* Memory taken by the values of all the rings */
+	static constexpr std::size_t bytes = spec::bytes(sizeof (T));
+
+	/* As dbrrd_add_at */
+	void
+	add_at(const T &v, hrtime_t t)
+	{
+		std::apply([&](auto &... r) { (r.add_at(v, t), ...); }, tiers_);
+	}
+
+	/*
+	 * As dbrrd_query: *vp is the value of the finest tier holding tv,
+	 * and *res that tier's resolution. Returns false if nothing has
+	 * tv (it is in the future, or older than every tier).
+	 */
+	bool
+	query(hrtime_t tv, const T **vp, hrtime_t *res) const
+	{
+		const auto &finest = std::get<ntiers - 1>(tiers_);
+
+		if ((tv > finest.last()) || (finest.len() == 0)) {
+			return (false);
+		}
+		return (query_from<ntiers - 1>(tv, vp, res));
+	}
+
+	/* Tier i, counted as in the template: 0 is the coarsest */
+	template <std::size_t I>
+	const auto &
+	tier() const
+	{
+		return (std::get<I>(tiers_));
+	}
+
+private:
+	template <std::size_t I>
+	bool
+	query_from(hrtime_t tv, const T **vp, hrtime_t *res) const
+	{
+		const auto &r = std::get<I>(tiers_);
+		int i = r.slot(tv);
+
+		if (i >= 0) {
+			*vp = r.get(i);
+			*res = r.resolution;
+			return (true);
+		}
+		if constexpr (I > 0) {
+			return (query_from<I - 1>(tv, vp, res));
+		} else {
+			return (false);
+		}
+	}
+
+	std::tuple<Ring<T, Agg, Tiers>...> tiers_;
+};
+
+} /* namespace crrd */
+
+#endif /* _CRRD_HPP */
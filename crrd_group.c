@@ -0,0 +1,407 @@
+/*
+ * crrd_group.c
+ *
+ * Series groups: n float series that share one tier layout, so that
+ * a whole row of samples (say, one scrape of 50 000 counters) goes
+ * into the rrds with a single dbrrd_add_at().
+ *
+ * Each rrd entry is one row: n floats followed by a uint32_t count
+ * of the samples merged into the row (used by GROUP_MEAN). The
+ * aggregation across the row is done by small kernels. AVX2 and SSE
+ * versions are compiled with target attributes, and the best one the
+ * CPU supports is picked at runtime (CPUID, via __builtin_cpu_supports).
+ * Other machines use the scalar kernels.
+ *
+ * This is user space only (TESTING) -- ZFS cannot use floats.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "crrd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define GROUP_X86
+#  include <immintrin.h>
+#endif
+
+typedef struct group_kernels {
+	const char *name;
+	void (*sum)(float *, const float *, int);
+	void (*min)(float *, const float *, int);
+	void (*max)(float *, const float *, int);
+	/* d = d * a + s * b */
+	void (*blend)(float *, const float *, int, float, float);
+} group_kernels_t;
+
+static void
+scalar_sum(float *d, const float *s, int n)
+{
+	for (int i = 0; i < n; ++i)
+		d[i] += s[i];
+}
+
+static void
+scalar_min(float *d, const float *s, int n)
+{
+	for (int i = 0; i < n; ++i)
+		if (s[i] < d[i])
+			d[i] = s[i];
+}
+
+static void
+scalar_max(float *d, const float *s, int n)
+{
+	for (int i = 0; i < n; ++i)
+		if (s[i] > d[i])
+			d[i] = s[i];
+}
+
+static void
+scalar_blend(float *d, const float *s, int n, float a, float b)
+{
+	for (int i = 0; i < n; ++i)
+		d[i] = d[i] * a + s[i] * b;
+}
+
+static const group_kernels_t scalar_kernels = {
+	"scalar", scalar_sum, scalar_min, scalar_max, scalar_blend
+};
+
+#ifdef GROUP_X86
+/*
+ * The vector loops do the bulk, and hand the remainder (n not a
+ * multiple of the vector width) to the scalar kernels.
+ */
+__attribute__((target("sse")))
+static void
+sse_sum(float *d, const float *s, int n)
+{
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_ps(d + i,
+		    _mm_add_ps(_mm_loadu_ps(d + i), _mm_loadu_ps(s + i)));
+	scalar_sum(d + i, s + i, n - i);
+}
+
+__attribute__((target("sse")))
+static void
+sse_min(float *d, const float *s, int n)
+{
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_ps(d + i,
+		    _mm_min_ps(_mm_loadu_ps(d + i), _mm_loadu_ps(s + i)));
+	scalar_min(d + i, s + i, n - i);
+}
+
+__attribute__((target("sse")))
+static void
+sse_max(float *d, const float *s, int n)
+{
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_ps(d + i,
+		    _mm_max_ps(_mm_loadu_ps(d + i), _mm_loadu_ps(s + i)));
+	scalar_max(d + i, s + i, n - i);
+}
+
+__attribute__((target("sse")))
+static void
+sse_blend(float *d, const float *s, int n, float a, float b)
+{
+	__m128 va = _mm_set1_ps(a);
+	__m128 vb = _mm_set1_ps(b);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_ps(d + i,
+		    _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(d + i), va),
+		    _mm_mul_ps(_mm_loadu_ps(s + i), vb)));
+	scalar_blend(d + i, s + i, n - i, a, b);
+}
+
+static const group_kernels_t sse_kernels = {
+	"sse", sse_sum, sse_min, sse_max, sse_blend
+};
+
+__attribute__((target("avx2")))
+static void
+avx2_sum(float *d, const float *s, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(d + i, _mm256_add_ps(_mm256_loadu_ps(d + i),
+		    _mm256_loadu_ps(s + i)));
+	scalar_sum(d + i, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_min(float *d, const float *s, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(d + i, _mm256_min_ps(_mm256_loadu_ps(d + i),
+		    _mm256_loadu_ps(s + i)));
+	scalar_min(d + i, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_max(float *d, const float *s, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(d + i, _mm256_max_ps(_mm256_loadu_ps(d + i),
+		    _mm256_loadu_ps(s + i)));
+	scalar_max(d + i, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_blend(float *d, const float *s, int n, float a, float b)
+{
+	__m256 va = _mm256_set1_ps(a);
+	__m256 vb = _mm256_set1_ps(b);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(d + i,
+		    _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(d + i), va),
+		    _mm256_mul_ps(_mm256_loadu_ps(s + i), vb)));
+	scalar_blend(d + i, s + i, n - i, a, b);
+}
+
+static const group_kernels_t avx2_kernels = {
+	"avx2", avx2_sum, avx2_min, avx2_max, avx2_blend
+};
+#endif
+
+static const group_kernels_t *group_k;
+static pthread_once_t group_once = PTHREAD_ONCE_INIT;
+
+static void
+group_pick(void)
+{
+	group_k = &scalar_kernels;
+#ifdef GROUP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		group_k = &avx2_kernels;
+	} else if (__builtin_cpu_supports("sse")) {
+		group_k = &sse_kernels;
+	}
+#endif
+}
+
+/* Pick the kernels once, on first use (from whichever thread) */
+static const group_kernels_t *
+group_kernels(void)
+{
+	(void) pthread_once(&group_once, group_pick);
+	return (group_k);
+}
+
+/* Name of the kernels in use ("avx2", "sse" or "scalar") */
+const char *
+dbrrd_group_isa(void)
+{
+	return (group_kernels()->name);
+}
+
+/* Number of series in a row of this rrd */
+static int
+group_n(rrd_t *r)
+{
+	return ((int)(r->size / sizeof (float)) - 1);
+}
+
+/* The sample count lives just past the n floats of the row */
+static uint32_t
+group_count(float *row, int n)
+{
+	uint32_t c;
+
+	memcpy(&c, row + n, sizeof (c));
+	return (c);
+}
+
+static void
+group_setcount(float *row, int n, uint32_t c)
+{
+	memcpy(row + n, &c, sizeof (c));
+}
+
+static float *
+group_tail(rrd_t *r)
+{
+	return ((float *)rrd_entry(r, rrd_tail(r)));
+}
+
+static void
+group_update_sum(rrd_t *r, void *pv)
+{
+	int n = group_n(r);
+	float *t = group_tail(r);
+
+	group_kernels()->sum(t, pv, n);
+	group_setcount(t, n, group_count(t, n) + 1);
+}
+
+static void
+group_update_min(rrd_t *r, void *pv)
+{
+	int n = group_n(r);
+	float *t = group_tail(r);
+
+	group_kernels()->min(t, pv, n);
+	group_setcount(t, n, group_count(t, n) + 1);
+}
+
+static void
+group_update_max(rrd_t *r, void *pv)
+{
+	int n = group_n(r);
+	float *t = group_tail(r);
+
+	group_kernels()->max(t, pv, n);
+	group_setcount(t, n, group_count(t, n) + 1);
+}
+
+/*
+ * Exact running mean: with c samples already in the row,
+ * mean' = mean * c / (c + 1) + v / (c + 1)
+ */
+static void
+group_update_mean(rrd_t *r, void *pv)
+{
+	int n = group_n(r);
+	float *t = group_tail(r);
+	uint32_t c = group_count(t, n);
+
+	group_kernels()->blend(t, pv, n, (float)c / (c + 1), 1.0f / (c + 1));
+	group_setcount(t, n, c + 1);
+}
+
+/* A period with no samples sums to zero */
+static void
+group_zero_sum(rrd_t *r, void *pv)
+{
+	float *t = group_tail(r);
+
+	pv = pv;
+	memset(t, 0, r->size);
+}
+
+/* For min, max and mean, plant the incoming row (as f_zero does) */
+static void
+group_zero_row(rrd_t *r, void *pv)
+{
+	float *t = group_tail(r);
+	int n = group_n(r);
+
+	memcpy(t, pv, r->size);
+	group_setcount(t, n, 0);
+}
+
+/*
+ * Create a group of n series with the tiers of p (as for dbrrd_create,
+ * sorted descending by timeval), aggregating with agg.
+ */
+dbrrd_group_t *
+dbrrd_group_create(char *name, dbrrd_spec_t *p, int n, int agg)
+{
+	dbrrd_group_t *g;
+	void *update;
+	void *zero;
+
+	switch (agg) {
+	case GROUP_SUM:
+		update = group_update_sum;
+		zero = group_zero_sum;
+		break;
+	case GROUP_MIN:
+		update = group_update_min;
+		zero = group_zero_row;
+		break;
+	case GROUP_MAX:
+		update = group_update_max;
+		zero = group_zero_row;
+		break;
+	case GROUP_MEAN:
+		update = group_update_mean;
+		zero = group_zero_row;
+		break;
+	default:
+		return (NULL);
+	}
+	if (n <= 0) {
+		return (NULL);
+	}
+	(void) group_kernels();
+
+	g = malloc(sizeof (dbrrd_group_t));
+	if (g == NULL) {
+		return (NULL);
+	}
+	g->n = n;
+	g->agg = agg;
+	g->row = malloc((n + 1) * sizeof (float));
+	g->db = dbrrd_create(name, p, (n + 1) * sizeof (float), update, zero);
+	if ((g->row == NULL) || (g->db == NULL)) {
+		dbrrd_group_destroy(g);
+		return (NULL);
+	}
+	return (g);
+}
+
+/*
+ * Add one row of n values (one per series) at time t. n must match
+ * the group; a short or long row is ignored.
+ */
+void
+dbrrd_group_add_row(dbrrd_group_t *g, hrtime_t t, const float *values, int n)
+{
+	if (n != g->n) {
+		return;
+	}
+	memcpy(g->row, values, n * sizeof (float));
+	group_setcount(g->row, n, 1);
+	dbrrd_add_at(g->db, g->row, t);
+}
+
+/*
+ * Query the group at time tv. *vp is set to the row of n values from
+ * the tightest tier covering tv. Returns 1 if found, 0 if not.
+ */
+int
+dbrrd_group_query(dbrrd_group_t *g, hrtime_t tv, float **vp, hrtime_t *res)
+{
+	void *p;
+
+	if (dbrrd_query(g->db, tv, &p, res) == 0) {
+		return (0);
+	}
+	*vp = p;
+	return (1);
+}
+
+void
+dbrrd_group_destroy(dbrrd_group_t *g)
+{
+	if (g) {
+		dbrrd_destroy(g->db);
+		free(g->row);
+		free(g);
+	}
+}
@@ -0,0 +1,316 @@
+/*
+ * crrd_line.c
+ *
+ * Text ingest: the Graphite plaintext protocol, one sample a line,
+ *
+ *   name value [timestamp]\n
+ *
+ * with fields separated by spaces or tabs, the value a decimal number
+ * (sign, fraction and exponent allowed), and the timestamp in seconds
+ * since the epoch, to the nanosecond if it has a fraction. A line
+ * without one is at now. Empty lines are skipped, and so are malformed
+ * ones (counted as bad). CR before the newline is fine.
+ *
+ * The parse is one pass over the buffer. Names, the long field, are
+ * scanned 16 bytes at a time for the separator with SSE2 (baseline on
+ * x86-64; elsewhere, and for the last bytes of the buffer, a byte at a
+ * time). Numbers are read digit by digit into a 64-bit integer and a
+ * power of ten: when the digits fit in 53 bits and the power is at
+ * most 22, the double is that integer times or divided by an exact
+ * power of ten, one rounding, so it is the correctly rounded value, as
+ * strtod() would give. Anything else (more digits, larger exponents)
+ * goes to strtod(), from a copy of the number: on the stack, or for a
+ * number of LINE_NUMMAX characters or more, the heap.
+ *
+ * A buffer is parsed up to its last newline; what follows is a partial
+ * line, and is left for the next call (crrd_line_parse returns how much
+ * was used). At the end of the input, add the newline yourself.
+ *
+ * User space only (TESTING): the values are doubles.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "crrd.h"
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#define	LINE_NANOSEC	1000000000LL
+#define	LINE_DIGITS	19		/* that always fit in a uint64_t */
+#define	LINE_NUMMAX	64		/* numbers copied on the stack */
+
+/* The powers of ten that are exact doubles */
+static const double line_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+	1e21, 1e22,
+};
+
+static int
+line_blank(char c)
+{
+	return ((c == ' ') || (c == '\t') || (c == '\r'));
+}
+
+/* The first space, tab or newline at or after p, or end */
+static const char *
+line_sep(const char *p, const char *end)
+{
+#ifdef __SSE2__
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n');
+	__m128i c;
+	int m;
+
+	for (; end - p >= 16; p += 16) {
+		c = _mm_loadu_si128((const __m128i *)p);
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+		    _mm_cmpeq_epi8(c, sp), _mm_cmpeq_epi8(c, tab)),
+		    _mm_cmpeq_epi8(c, nl)));
+		if (m != 0) {
+			return (p + __builtin_ctz(m));
+		}
+	}
+#endif
+	for (; p < end; ++p) {
+		if ((*p == ' ') || (*p == '\t') || (*p == '\n')) {
+			break;
+		}
+	}
+	return (p);
+}
+
+/*
+ * Read a number at *pp, leaving *pp after it. Returns 0 if there is no
+ * number there. Stopping at end is not an error: the caller tells.
+ */
+static int
+line_double(const char **pp, const char *end, double *vp)
+{
+	const char *p = *pp, *start = p;
+	char tmp[LINE_NUMMAX], *s = tmp;
+	uint64_t m = 0;
+	unsigned d;
+	int neg = 0, nd = 0, digits = 0, e = 0, x = 0, xneg = 0;
+	double v;
+
+	if ((p < end) && ((*p == '-') || (*p == '+'))) {
+		neg = (*p++ == '-');
+	}
+	for (; (p < end) && ((d = *p - '0') <= 9); ++p, ++digits) {
+		if (nd < LINE_DIGITS) {
+			m = m * 10 + d;
+			nd += (m != 0);
+		} else {
+			++e;
+		}
+	}
+	if ((p < end) && (*p == '.')) {
+		for (++p; (p < end) && ((d = *p - '0') <= 9); ++p, ++digits) {
+			if (nd < LINE_DIGITS) {
+				m = m * 10 + d;
+				nd += (m != 0);
+				--e;
+			} else if (d != 0) {
+				nd = LINE_DIGITS + 1;	/* inexact */
+			}
+		}
+	}
+	if (digits == 0) {
+		return (0);
+	}
+	if ((p < end) && ((*p == 'e') || (*p == 'E'))) {
+		++p;
+		if ((p < end) && ((*p == '-') || (*p == '+'))) {
+			xneg = (*p++ == '-');
+		}
+		if ((p == end) || ((unsigned)(*p - '0') > 9)) {
+			return (0);
+		}
+		for (; (p < end) && ((d = *p - '0') <= 9); ++p) {
+			if (x < 100000) {
+				x = x * 10 + d;
+			}
+		}
+		e += xneg ? -x : x;
+	}
+	*pp = p;
+	if ((nd <= LINE_DIGITS) && (m <= (1ULL << 53)) &&
+	    (e >= -22) && (e <= 22)) {
+		v = (double)m;
+		v = (e < 0) ? v / line_pow10[-e] : v * line_pow10[e];
+		*vp = neg ? -v : v;
+		return (1);
+	}
+	/* strtod() wants the number on its own, with a NUL after it */
+	if (p - start >= LINE_NUMMAX) {
+		s = malloc(p - start + 1);
+		if (s == NULL) {
+			return (0);
+		}
+	}
+	memcpy(s, start, p - start);
+	s[p - start] = '\0';
+	*vp = strtod(s, NULL);
+	if (s != tmp) {
+		free(s);
+	}
+	return (1);
+}
+
+/*
+ * A number at *pp, as a line's value is read, for other text formats.
+ * Returns 1 with *vp, and *pp after the number; 0 if there is none.
+ */
+int
+crrd_line_double(const char **pp, const char *end, double *vp)
+{
+	return (line_double(pp, end, vp));
+}
+
+/* Read seconds, with an optional fraction, as nanoseconds */
+static int
+line_time(const char **pp, const char *end, hrtime_t *tp)
+{
+	const char *p = *pp;
+	hrtime_t s = 0, ns = 0, scale = LINE_NANOSEC;
+	unsigned d;
+	int digits = 0;
+
+	for (; (p < end) && ((d = *p - '0') <= 9); ++p) {
+		if (++digits > 10) {
+			return (0);	/* past the year 2286 */
+		}
+		s = s * 10 + d;
+	}
+	if (digits == 0) {
+		return (0);
+	}
+	if ((p < end) && (*p == '.')) {
+		for (++p; (p < end) && ((d = *p - '0') <= 9); ++p) {
+			if (scale > 1) {
+				scale /= 10;
+				ns += d * scale;
+			}
+		}
+	}
+	*pp = p;
+	*tp = s * LINE_NANOSEC + ns;
+	return (1);
+}
+
+/*
+ * Parse the lines in buf, calling fn for each sample. Returns the
+ * number of bytes used: everything up to and including the last
+ * newline. If st is not NULL, counts are added to it.
+ */
+size_t
+crrd_line_parse(const char *buf, size_t len, hrtime_t now, crrd_line_fn fn,
+    void *arg, crrd_line_stats_t *st)
+{
+	const char *p = buf, *end = buf + len, *q, *name;
+	size_t nlen;
+	hrtime_t t;
+	double v;
+
+	for (;;) {
+		q = p;
+		while ((q < end) && line_blank(*q)) {
+			++q;
+		}
+		if (q == end) {
+			break;
+		}
+		if (*q == '\n') {
+			p = q + 1;
+			continue;
+		}
+		name = q;
+		q = line_sep(q, end);
+		nlen = q - name;
+		while ((q < end) && line_blank(*q)) {
+			++q;
+		}
+		if ((q == end) || (*q == '\n') || !line_double(&q, end, &v)) {
+			goto bad;
+		}
+		if ((q == end) || (!line_blank(*q) && (*q != '\n'))) {
+			goto bad;
+		}
+		while ((q < end) && line_blank(*q)) {
+			++q;
+		}
+		t = now;
+		if ((q < end) && (*q != '\n')) {
+			if (!line_time(&q, end, &t)) {
+				goto bad;
+			}
+			while ((q < end) && line_blank(*q)) {
+				++q;
+			}
+		}
+		if ((q == end) || (*q != '\n')) {
+			goto bad;
+		}
+		fn(arg, name, nlen, v, t);
+		if (st != NULL) {
+			++st->lines;
+		}
+		p = q + 1;
+		continue;
+bad:
+		/* Skip to the end of the line, if it has one yet */
+		q = memchr(p, '\n', end - p);
+		if (q == NULL) {
+			break;
+		}
+		if (st != NULL) {
+			++st->bad;
+		}
+		p = q + 1;
+	}
+	return (p - buf);
+}
+
+typedef struct line_add {
+	crrd_line_lookup_fn lookup;
+	void *arg;
+	crrd_line_stats_t *st;
+} line_add_t;
+
+static void
+line_add(void *arg, const char *name, size_t len, double v, hrtime_t t)
+{
+	line_add_t *a = arg;
+	rrd_t *h;
+
+	h = a->lookup(a->arg, name, len);
+	if (h != NULL) {
+		dbrrd_add_at(h, &v, t);
+	} else if (a->st != NULL) {
+		++a->st->unknown;
+	}
+}
+
+/*
+ * Parse the lines in buf into dbrrds of doubles, found by name with
+ * lookup (which returns NULL for a name it does not know). Returns the
+ * number of bytes used, as crrd_line_parse.
+ */
+size_t
+crrd_line_add(const char *buf, size_t len, hrtime_t now,
+    crrd_line_lookup_fn lookup, void *arg, crrd_line_stats_t *st)
+{
+	line_add_t a;
+
+	a.lookup = lookup;
+	a.arg = arg;
+	a.st = st;
+	return (crrd_line_parse(buf, len, now, line_add, &a, st));
+}
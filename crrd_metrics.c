@@ -0,0 +1,259 @@
+/*
+ * crrd_metrics.c
+ *
+ * crrd keeping its own history.
+ *
+ * A metrics object watches a set of databases (turning their counters
+ * on), and each time it is sampled adds what happened since the last
+ * sample -- samples taken, late samples dropped, periods advanced,
+ * queries answered by each tier -- to a database of its own. So the
+ * store's throughput is kept the same way as everything else: with
+ * the default layout, a day by the minute and a year by the day.
+ *
+ * Entries are sums over their period, so a rate is an entry field
+ * divided by the resolution.
+ */
+
+#ifdef TESTING
+#  include <stddef.h>
+#  include <stdint.h>
+#  include <string.h>
+#  include <stdlib.h>
+#  include <stdio.h>
+#  include "crrd.h"
+#else
+#  include <sys/zfs_context.h>
+#  include <sys/crrd.h>
+#endif
+
+#define	METRICS_SEC(s)	((hrtime_t)(s) * 1000LL * 1000LL * 1000LL)
+
+/* One day by the minute, one year by the day */
+static dbrrd_spec_t metrics_default[] = {
+	{  365, METRICS_SEC(86400) },
+	{ 1440, METRICS_SEC(60) },
+	{ 0, 0 },
+};
+
+/* Periods sum their samples */
+static void
+metrics_update(rrd_t *r, void *pv)
+{
+	crrd_metrics_entry_t *e = rrd_entry(r, rrd_tail(r));
+	crrd_metrics_entry_t *d = pv;
+
+	e->accepted += d->accepted;
+	e->late += d->late;
+	e->advanced += d->advanced;
+	for (int i = 0; i < CRRD_METRICS_TIERS; ++i) {
+		e->queries[i] += d->queries[i];
+	}
+	e->qmiss += d->qmiss;
+	e->samples += d->samples;
+}
+
+/* A period nobody sampled saw nothing */
+static void
+metrics_zero(rrd_t *r, void *pv)
+{
+	pv = pv;
+	memset(rrd_entry(r, rrd_tail(r)), 0, r->size);
+}
+
+/* Add the counters of database h into *e */
+static void
+metrics_total(rrd_t *h, crrd_metrics_entry_t *e)
+{
+	rrd_stats_t st;
+	int i;
+
+	for (i = 0; h != NULL; h = h->next, ++i) {
+		rrd_stats(h, &st);
+		/* Every tier sees every sample; count them once */
+		if (i == 0) {
+			e->accepted += st.accepted;
+			e->late += st.late;
+			e->advanced += st.advanced;
+			e->qmiss += st.qmiss;
+		}
+		e->queries[(i < CRRD_METRICS_TIERS) ?
+		    i : CRRD_METRICS_TIERS - 1] += st.qhit;
+	}
+}
+
+/* *a -= *b */
+static void
+metrics_sub(crrd_metrics_entry_t *a, crrd_metrics_entry_t *b)
+{
+	a->accepted -= b->accepted;
+	a->late -= b->late;
+	a->advanced -= b->advanced;
+	for (int i = 0; i < CRRD_METRICS_TIERS; ++i) {
+		a->queries[i] -= b->queries[i];
+	}
+	a->qmiss -= b->qmiss;
+}
+
+/*
+ * Create a metrics object, keeping its history with the tiers of spec
+ * (as for dbrrd_create), or NULL for a day by the minute and a year
+ * by the day.
+ */
+crrd_metrics_t *
+crrd_metrics_create(dbrrd_spec_t *spec)
+{
+	crrd_metrics_t *m;
+
+	if (spec == NULL) {
+		spec = metrics_default;
+	}
+#ifdef TESTING
+	m = calloc(1, sizeof (crrd_metrics_t));
+	if (m == NULL) {
+		return (NULL);
+	}
+#else
+	m = kmem_zalloc(sizeof (crrd_metrics_t), KM_SLEEP);
+#endif
+	m->db = dbrrd_create("crrd_metrics", spec,
+	    sizeof (crrd_metrics_entry_t), metrics_update, metrics_zero);
+	if (m->db == NULL) {
+		crrd_metrics_destroy(m);
+		return (NULL);
+	}
+	return (m);
+}
+
+/*
+ * Watch database h: turn its counters on, and include them from now
+ * on. Returns 1 on success. Watching h again changes nothing.
+ */
+int
+crrd_metrics_watch(crrd_metrics_t *m, rrd_t *h)
+{
+	rrd_t **w;
+	int n;
+
+	for (int i = 0; i < m->nwatch; ++i) {
+		if (m->watch[i] == h) {
+			return (1);
+		}
+	}
+	if (!dbrrd_stats_enable(h)) {
+		return (0);
+	}
+	if (m->nwatch == m->maxwatch) {
+		n = m->maxwatch ? m->maxwatch * 2 : 16;
+#ifdef TESTING
+		w = malloc(n * sizeof (rrd_t *));
+		if (w == NULL) {
+			return (0);
+		}
+#else
+		w = kmem_alloc(n * sizeof (rrd_t *), KM_SLEEP);
+#endif
+		if (m->nwatch > 0) {
+			memcpy(w, m->watch, m->nwatch * sizeof (rrd_t *));
+		}
+#ifdef TESTING
+		free(m->watch);
+#else
+		if (m->watch != NULL) {
+			kmem_free(m->watch, m->maxwatch * sizeof (rrd_t *));
+		}
+#endif
+		m->watch = w;
+		m->maxwatch = n;
+	}
+	m->watch[m->nwatch++] = h;
+	/* What it counted before now is not ours */
+	metrics_total(h, &m->prev);
+	return (1);
+}
+
+/* Stop watching h. Do this before dbrrd_destroy(h). */
+void
+crrd_metrics_unwatch(crrd_metrics_t *m, rrd_t *h)
+{
+	crrd_metrics_entry_t e;
+
+	for (int i = 0; i < m->nwatch; ++i) {
+		if (m->watch[i] == h) {
+			/* Keep the totals continuous without it */
+			memset(&e, 0, sizeof (e));
+			metrics_total(h, &e);
+			metrics_sub(&m->prev, &e);
+			m->watch[i] = m->watch[--m->nwatch];
+			return;
+		}
+	}
+}
+
+/*
+ * Record what the watched databases did since the last sample. A time
+ * before the last sample's (the clock stepped back) is taken as that
+ * time, so the counts go into the latest period rather than being
+ * dropped as late.
+ */
+void
+crrd_metrics_sample_at(crrd_metrics_t *m, hrtime_t t)
+{
+	crrd_metrics_entry_t now;
+	crrd_metrics_entry_t d;
+
+	if ((m->db->tail >= 0) && (t < m->db->last)) {
+		t = m->db->last;
+	}
+
+	memset(&now, 0, sizeof (now));
+	for (int i = 0; i < m->nwatch; ++i) {
+		metrics_total(m->watch[i], &now);
+	}
+	d = now;
+	metrics_sub(&d, &m->prev);
+	d.samples = 1;
+	m->prev = now;
+	dbrrd_add_at(m->db, &d, t);
+}
+
+/* As crrd_metrics_sample_at, now */
+void
+crrd_metrics_sample(crrd_metrics_t *m)
+{
+	crrd_metrics_sample_at(m, crrd_now());
+}
+
+/*
+ * What the watched databases did in the period holding tv, from the
+ * tightest tier that reaches back that far. Returns 1 if found, as
+ * dbrrd_query.
+ */
+int
+crrd_metrics_query(crrd_metrics_t *m, hrtime_t tv, crrd_metrics_entry_t **ep,
+    hrtime_t *res)
+{
+	void *p;
+
+	if (dbrrd_query(m->db, tv, &p, res) == 0) {
+		return (0);
+	}
+	*ep = p;
+	return (1);
+}
+
+void
+crrd_metrics_destroy(crrd_metrics_t *m)
+{
+	if (m) {
+		dbrrd_destroy(m->db);
+#ifdef TESTING
+		free(m->watch);
+		free(m);
+#else
+		if (m->watch != NULL) {
+			kmem_free(m->watch, m->maxwatch * sizeof (rrd_t *));
+		}
+		kmem_free(m, sizeof (crrd_metrics_t));
+#endif
+	}
+}
@@ -0,0 +1,523 @@
+/*
+ * crrd_pool.c
+ *
+ * A small work-stealing thread pool, and the parallel crrd operations
+ * built on it.
+ *
+ * Each worker has its own deque of tasks. A worker takes work from the
+ * bottom of its own deque, and when that is empty steals from the top
+ * of the others. Tasks submitted from outside the pool go into one
+ * more deque that only gets stolen from. crrd_pool_wait() does not just
+ * sleep, the waiting thread steals and runs tasks too -- so a pool of
+ * zero workers is simply "run it here".
+ *
+ * Tasks are submitted in batches (crrd_pool_batch_t, the caller's), and
+ * crrd_pool_wait() waits for one batch only: a task may submit a batch
+ * of its own and wait for it (nested fork/join), and two submitters do
+ * not wait for each other's work.
+ *
+ * The deques are mutex protected rather than lock-free: the tasks we
+ * hand out (a whole tier of a batch, a chunk of a bulk query) are big
+ * enough that the lock is noise.
+ *
+ * User space only (TESTING).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "crrd.h"
+
+typedef struct pool_task {
+	crrd_task_fn fn;
+	void *arg;
+	crrd_pool_batch_t *b;
+} pool_task_t;
+
+/* Tasks are in task[top..bottom-1], indices taken modulo cap */
+typedef struct pool_deque {
+	pthread_mutex_t lock;
+	pool_task_t *task;
+	unsigned cap;
+	unsigned top;
+	unsigned bottom;
+} __attribute__((aligned(64))) pool_deque_t;
+
+struct crrd_pool {
+	int n;			/* number of workers */
+	pool_deque_t *dq;	/* n + 1 deques, dq[n] is for outsiders */
+	pthread_t *thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* workers sleep here for tasks */
+	pthread_cond_t done;	/* crrd_pool_wait sleeps here */
+	int queued;		/* tasks sitting in deques */
+	crrd_pool_batch_t all;	/* every task, for crrd_pool_destroy */
+	int stop;
+};
+
+/* Which deque is ours: the worker index in pool_mine, or -1 */
+static __thread crrd_pool_t *pool_mine;
+static __thread int pool_self = -1;
+
+/* Our deque in p: our own if we work for p, else the outsiders' */
+static int
+pool_index(crrd_pool_t *p)
+{
+	return ((pool_mine == p) ? pool_self : p->n);
+}
+
+static int
+deque_push(pool_deque_t *d, pool_task_t *t)
+{
+	pool_task_t *n;
+	unsigned cap;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom - d->top == d->cap) {
+		cap = d->cap ? d->cap * 2 : 64;
+		n = malloc(cap * sizeof (pool_task_t));
+		if (n == NULL) {
+			pthread_mutex_unlock(&d->lock);
+			return (0);
+		}
+		for (unsigned i = d->top; i != d->bottom; ++i) {
+			n[i % cap] = d->task[i % d->cap];
+		}
+		free(d->task);
+		d->task = n;
+		d->cap = cap;
+	}
+	d->task[d->bottom % d->cap] = *t;
+	++d->bottom;
+	pthread_mutex_unlock(&d->lock);
+	return (1);
+}
+
+/* Own deque: last in, first out */
+static int
+deque_pop(pool_deque_t *d, pool_task_t *t)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom != d->top) {
+		--d->bottom;
+		*t = d->task[d->bottom % d->cap];
+		r = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return (r);
+}
+
+/* Someone else's deque: first in, first out */
+static int
+deque_steal(pool_deque_t *d, pool_task_t *t)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom != d->top) {
+		*t = d->task[d->top % d->cap];
+		++d->top;
+		r = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return (r);
+}
+
+/* Find a task for deque self: our own first, then steal */
+static int
+pool_find(crrd_pool_t *p, int self, pool_task_t *t)
+{
+	int i;
+
+	if (__atomic_load_n(&p->queued, __ATOMIC_ACQUIRE) == 0) {
+		return (0);
+	}
+	if ((self >= 0) && deque_pop(&p->dq[self], t)) {
+		goto found;
+	}
+	for (i = 0; i <= p->n; ++i) {
+		if ((i != self) && deque_steal(&p->dq[i], t)) {
+			goto found;
+		}
+	}
+	return (0);
+found:
+	__atomic_sub_fetch(&p->queued, 1, __ATOMIC_ACQ_REL);
+	return (1);
+}
+
+/*
+ * Run a task, and count it done. Once its batch is at 0 the waiter may
+ * return and free it, so the batch is not touched after that.
+ */
+static void
+pool_run(crrd_pool_t *p, pool_task_t *t)
+{
+	int last;
+
+	(t->fn)(t->arg);
+	last = (__atomic_sub_fetch(&p->all.pending, 1, __ATOMIC_ACQ_REL) == 0);
+	if (__atomic_sub_fetch(&t->b->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		last = 1;
+	}
+	if (last) {
+		pthread_mutex_lock(&p->lock);
+		pthread_cond_broadcast(&p->done);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+static void *
+pool_worker(void *arg)
+{
+	crrd_pool_t *p = arg;
+	pool_task_t t;
+	int self;
+
+	/* Our index is our position in the thread array, once it is full */
+	pthread_mutex_lock(&p->lock);
+	pthread_mutex_unlock(&p->lock);
+	for (self = 0; !pthread_equal(p->thread[self], pthread_self());
+	    ++self)
+		;
+	pool_mine = p;
+	pool_self = self;
+	for (;;) {
+		if (pool_find(p, self, &t)) {
+			pool_run(p, &t);
+			continue;
+		}
+		pthread_mutex_lock(&p->lock);
+		while (!p->stop &&
+		    (__atomic_load_n(&p->queued, __ATOMIC_ACQUIRE) == 0)) {
+			pthread_cond_wait(&p->work, &p->lock);
+		}
+		if (p->stop) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+	return (NULL);
+}
+
+/*
+ * Create a pool of n worker threads. n may be 0, in which case
+ * everything runs in crrd_pool_wait().
+ */
+crrd_pool_t *
+crrd_pool_create(int n)
+{
+	crrd_pool_t *p;
+	int i;
+
+	if (n < 0) {
+		return (NULL);
+	}
+	p = calloc(1, sizeof (crrd_pool_t));
+	if (p == NULL) {
+		return (NULL);
+	}
+	p->dq = aligned_alloc(64, (n + 1) * sizeof (pool_deque_t));
+	p->thread = calloc(n + 1, sizeof (pthread_t));
+	if ((p->dq == NULL) || (p->thread == NULL)) {
+		free(p->dq);
+		free(p->thread);
+		free(p);
+		return (NULL);
+	}
+	memset(p->dq, 0, (n + 1) * sizeof (pool_deque_t));
+	for (i = 0; i <= n; ++i) {
+		pthread_mutex_init(&p->dq[i].lock, NULL);
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+	/* Workers find themselves in p->thread, so hold them until full */
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < n; ++i) {
+		if (pthread_create(&p->thread[i], NULL, pool_worker, p) != 0) {
+			break;
+		}
+		p->n = i + 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return (p);
+}
+
+/* Number of worker threads */
+int
+crrd_pool_size(crrd_pool_t *p)
+{
+	return (p->n);
+}
+
+/*
+ * Queue fn(arg) as part of batch b. If the task cannot be queued it is
+ * run right here, so a submitted task always runs.
+ */
+void
+crrd_pool_submit(crrd_pool_t *p, crrd_pool_batch_t *b, crrd_task_fn fn,
+    void *arg)
+{
+	pool_task_t t;
+	int self;
+
+	t.fn = fn;
+	t.arg = arg;
+	t.b = b;
+	self = pool_index(p);
+	__atomic_add_fetch(&p->all.pending, 1, __ATOMIC_ACQ_REL);
+	__atomic_add_fetch(&b->pending, 1, __ATOMIC_ACQ_REL);
+	if (!deque_push(&p->dq[self], &t)) {
+		pool_run(p, &t);
+		return;
+	}
+	__atomic_add_fetch(&p->queued, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_lock(&p->lock);
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Wait for every task of batch b to finish, running tasks (of any
+ * batch) meanwhile. May be called from a task.
+ */
+void
+crrd_pool_wait(crrd_pool_t *p, crrd_pool_batch_t *b)
+{
+	pool_task_t t;
+
+	while (__atomic_load_n(&b->pending, __ATOMIC_ACQUIRE) > 0) {
+		if (pool_find(p, pool_index(p), &t)) {
+			pool_run(p, &t);
+			continue;
+		}
+		pthread_mutex_lock(&p->lock);
+		while ((__atomic_load_n(&b->pending, __ATOMIC_ACQUIRE) > 0) &&
+		    (__atomic_load_n(&p->queued, __ATOMIC_ACQUIRE) == 0)) {
+			pthread_cond_wait(&p->done, &p->lock);
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+void
+crrd_pool_destroy(crrd_pool_t *p)
+{
+	int i;
+
+	if (p) {
+		crrd_pool_wait(p, &p->all);
+		pthread_mutex_lock(&p->lock);
+		p->stop = 1;
+		pthread_cond_broadcast(&p->work);
+		pthread_mutex_unlock(&p->lock);
+		for (i = 0; i < p->n; ++i) {
+			pthread_join(p->thread[i], NULL);
+		}
+		for (i = 0; i <= p->n; ++i) {
+			pthread_mutex_destroy(&p->dq[i].lock);
+			free(p->dq[i].task);
+		}
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->work);
+		pthread_cond_destroy(&p->done);
+		free(p->dq);
+		free(p->thread);
+		free(p);
+	}
+}
+
+/* One tier of a batch */
+typedef struct batch_task {
+	rrd_t *r;
+	char *v;
+	const hrtime_t *t;
+	int n;
+} batch_task_t;
+
+static void
+batch_tier(void *arg)
+{
+	batch_task_t *b = arg;
+
+	rrd_add_batch(b->r, b->v, b->t, b->n);
+}
+
+/*
+ * dbrrd_add_batch, with each rrd of the database as its own task.
+ * The rrds share nothing, so they can be updated at the same time;
+ * this pays when the update() and zero() callbacks are costly
+ * (histograms, sketches) and there are several tiers.
+ */
+void
+dbrrd_add_batch_parallel(crrd_pool_t *p, rrd_t *h, void *v,
+    const hrtime_t *t, int n)
+{
+	crrd_pool_batch_t batch = { 0 };
+	batch_task_t *b;
+	rrd_t *r;
+	int ntiers;
+	int i;
+
+	ntiers = 0;
+	for (r = h; r != NULL; r = r->next) {
+		++ntiers;
+	}
+	b = malloc(ntiers * sizeof (batch_task_t));
+	if ((b == NULL) || (ntiers == 1)) {
+		free(b);
+		dbrrd_add_batch(h, v, t, n);
+		return;
+	}
+	i = 0;
+	for (r = h; r != NULL; r = r->next) {
+		b[i].r = r;
+		b[i].v = v;
+		b[i].t = t;
+		b[i].n = n;
+		crrd_pool_submit(p, &batch, batch_tier, &b[i]);
+		++i;
+	}
+	crrd_pool_wait(p, &batch);
+	free(b);
+}
+
+/* A chunk of a bulk query */
+typedef struct query_task {
+	rrd_t **h;
+	int n;
+	hrtime_t tv;
+	void **vp;
+	hrtime_t *res;
+	int *found;
+} query_task_t;
+
+static void
+query_chunk(void *arg)
+{
+	query_task_t *q = arg;
+	int n;
+
+	n = dbrrd_query_multi(q->h, q->n, q->tv, q->vp, q->res);
+	__atomic_add_fetch(q->found, n, __ATOMIC_RELAXED);
+}
+
+/* Databases per task: enough to amortize a task, and to prefetch */
+#define	QUERY_CHUNK	1024
+
+/*
+ * dbrrd_query_multi, split into chunks run on the pool. Results go
+ * into the caller's vp[0..n-1] and res[0..n-1], as there. Returns the
+ * number found.
+ */
+int
+dbrrd_query_bulk(crrd_pool_t *p, rrd_t **h, int n, hrtime_t tv,
+    void **vp, hrtime_t *res)
+{
+	crrd_pool_batch_t batch = { 0 };
+	query_task_t *q;
+	int nchunks;
+	int chunk;
+	int found = 0;
+	int i;
+
+	/* A few chunks per thread, so stealing can even out the load */
+	chunk = n / (4 * (p->n + 1)) + 1;
+	if (chunk < QUERY_CHUNK) {
+		chunk = QUERY_CHUNK;
+	}
+	nchunks = (n + chunk - 1) / chunk;
+	if (nchunks <= 1) {
+		return (dbrrd_query_multi(h, n, tv, vp, res));
+	}
+	q = malloc(nchunks * sizeof (query_task_t));
+	if (q == NULL) {
+		return (dbrrd_query_multi(h, n, tv, vp, res));
+	}
+	for (i = 0; i < nchunks; ++i) {
+		q[i].h = h + i * chunk;
+		q[i].n = (i == nchunks - 1) ? n - i * chunk : chunk;
+		q[i].tv = tv;
+		q[i].vp = vp + i * chunk;
+		q[i].res = res + i * chunk;
+		q[i].found = &found;
+		crrd_pool_submit(p, &batch, query_chunk, &q[i]);
+	}
+	crrd_pool_wait(p, &batch);
+	free(q);
+	return (found);
+}
+
+/* A chunk of a bulk range query */
+typedef struct range_task {
+	rrd_t **h;
+	int n;
+	hrtime_t from;
+	hrtime_t to;
+	void **out;
+	int *found_v;
+	void (*merge)(void *, const void *);
+	int monotonic;
+	int *found;
+} range_task_t;
+
+static void
+range_chunk(void *arg)
+{
+	range_task_t *q = arg;
+	int n;
+
+	n = dbrrd_query_range_multi(q->h, q->n, q->from, q->to, q->out,
+	    q->found_v, q->merge, q->monotonic);
+	__atomic_add_fetch(q->found, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * dbrrd_query_range_multi, split into chunks run on the pool, as
+ * dbrrd_query_bulk. Returns the number found.
+ */
+int
+dbrrd_query_range_bulk(crrd_pool_t *p, rrd_t **h, int n, hrtime_t from,
+    hrtime_t to, void **out, int *found_v,
+    void (*merge)(void *, const void *), int monotonic)
+{
+	crrd_pool_batch_t batch = { 0 };
+	range_task_t *q;
+	int nchunks;
+	int chunk;
+	int found = 0;
+	int i;
+
+	chunk = n / (4 * (p->n + 1)) + 1;
+	if (chunk < QUERY_CHUNK) {
+		chunk = QUERY_CHUNK;
+	}
+	nchunks = (n + chunk - 1) / chunk;
+	q = (nchunks > 1) ? malloc(nchunks * sizeof (range_task_t)) : NULL;
+	if (q == NULL) {
+		return (dbrrd_query_range_multi(h, n, from, to, out, found_v,
+		    merge, monotonic));
+	}
+	for (i = 0; i < nchunks; ++i) {
+		q[i].h = h + i * chunk;
+		q[i].n = (i == nchunks - 1) ? n - i * chunk : chunk;
+		q[i].from = from;
+		q[i].to = to;
+		q[i].out = out + i * chunk;
+		q[i].found_v = found_v + i * chunk;
+		q[i].merge = merge;
+		q[i].monotonic = monotonic;
+		q[i].found = &found;
+		crrd_pool_submit(p, &batch, range_chunk, &q[i]);
+	}
+	crrd_pool_wait(p, &batch);
+	free(q);
+	return (found);
+}
@@ -0,0 +1,226 @@
+/*
+ * crrd_reorder.c
+ *
+ * A bounded reorder buffer in front of a database.
+ *
+ * rrd_setreorder() merges a late sample into its period with update(),
+ * which is exact for sums and counts, but not for anything that
+ * depends on the order of the samples in a period (a running average,
+ * the first txg of a period), nor for samples that arrive after their
+ * period has rolled out of the ring. For sources whose jitter is
+ * larger than that, samples can be staged here first: the buffer holds
+ * up to k samples in a min-heap by time, and releases them to
+ * dbrrd_add_at() in time order once they are delay older than the
+ * newest sample seen. The database then sees an ordered stream.
+ *
+ * Memory is fixed at create time: k entries of the sample size. If
+ * the buffer is full the oldest sample is released early. A sample
+ * older than one already released cannot be put in order any more,
+ * and is passed straight through (where a reorder window may still
+ * take it). Samples with equal times are released in arrival order.
+ */
+
+#ifdef TESTING
+#  include <stddef.h>
+#  include <stdint.h>
+#  include <string.h>
+#  include <stdlib.h>
+#  include <stdio.h>
+#  include "crrd.h"
+#else
+#  include <sys/zfs_context.h>
+#  include <sys/crrd.h>
+#endif
+
+typedef struct reorder_ent {
+	hrtime_t t;
+	uint64_t seq;		/* arrival order, to keep equal times stable */
+	int slot;		/* where the value is */
+} reorder_ent_t;
+
+struct crrd_reorder {
+	size_t asize;		/* allocation size */
+	rrd_t *h;		/* database released to */
+	hrtime_t delay;		/* how long a sample is held */
+	int k;			/* capacity */
+	int n;			/* samples held */
+	uint64_t seq;
+	hrtime_t newest;	/* newest time seen */
+	hrtime_t out;		/* time of the last sample released */
+	int released;		/* have we released anything yet? */
+	reorder_ent_t *heap;	/* k entries */
+	int *free;		/* k free value slots, as a stack */
+	char *val;		/* k values of h->size */
+};
+
+static int
+reorder_less(reorder_ent_t *a, reorder_ent_t *b)
+{
+	if (a->t != b->t) {
+		return (a->t < b->t);
+	}
+	return (a->seq < b->seq);
+}
+
+static void
+reorder_up(crrd_reorder_t *q, int i)
+{
+	reorder_ent_t e = q->heap[i];
+	int p;
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (!reorder_less(&e, &q->heap[p])) {
+			break;
+		}
+		q->heap[i] = q->heap[p];
+		i = p;
+	}
+	q->heap[i] = e;
+}
+
+static void
+reorder_down(crrd_reorder_t *q, int i)
+{
+	reorder_ent_t e = q->heap[i];
+	int c;
+
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= q->n) {
+			break;
+		}
+		if ((c + 1 < q->n) &&
+		    reorder_less(&q->heap[c + 1], &q->heap[c])) {
+			++c;
+		}
+		if (!reorder_less(&q->heap[c], &e)) {
+			break;
+		}
+		q->heap[i] = q->heap[c];
+		i = c;
+	}
+	q->heap[i] = e;
+}
+
+/* Release the oldest sample to the database */
+static void
+reorder_pop(crrd_reorder_t *q)
+{
+	reorder_ent_t e = q->heap[0];
+
+	q->heap[0] = q->heap[--q->n];
+	if (q->n > 0) {
+		reorder_down(q, 0);
+	}
+	dbrrd_add_at(q->h, q->val + e.slot * q->h->size, e.t);
+	q->free[q->k - q->n - 1] = e.slot;
+	q->out = e.t;
+	q->released = 1;
+}
+
+/*
+ * Create a reorder buffer of k samples in front of database h (or a
+ * single rrd), holding each sample until one delay newer has been
+ * seen.
+ */
+crrd_reorder_t *
+crrd_reorder_create(rrd_t *h, int k, hrtime_t delay)
+{
+	crrd_reorder_t *q;
+	size_t asize, vsize;
+	char *p;
+
+	if ((h == NULL) || (k <= 0) || (delay < 0)) {
+		return (NULL);
+	}
+	vsize = (k * h->size + sizeof (int) - 1) & ~(sizeof (int) - 1);
+	asize = sizeof (crrd_reorder_t) + k * sizeof (reorder_ent_t) +
+	    vsize + k * sizeof (int);
+#ifdef TESTING
+	q = malloc(asize);
+	if (q == NULL) {
+		return (NULL);
+	}
+#else
+	q = kmem_alloc(asize, KM_SLEEP);
+#endif
+	memset(q, 0, sizeof (crrd_reorder_t));
+	q->asize = asize;
+	q->h = h;
+	q->delay = delay;
+	q->k = k;
+	p = (char *)(q + 1);
+	/*
+	 * The heap entries are 8 byte aligned, and so are the values that
+	 * follow them. The free stack goes last, past the values rounded
+	 * up to an int.
+	 */
+	q->heap = (reorder_ent_t *)p;
+	p += k * sizeof (reorder_ent_t);
+	q->val = p;
+	p += vsize;
+	q->free = (int *)p;
+	for (int i = 0; i < k; ++i) {
+		q->free[i] = i;
+	}
+	return (q);
+}
+
+/* Add sample v at time t, releasing whatever is now old enough */
+void
+crrd_reorder_add(crrd_reorder_t *q, void *v, hrtime_t t)
+{
+	int slot;
+
+	/* Too late to put in order */
+	if (q->released && (t < q->out)) {
+		dbrrd_add_at(q->h, v, t);
+		return;
+	}
+	if (q->n == q->k) {
+		reorder_pop(q);
+	}
+	slot = q->free[q->k - q->n - 1];
+	memcpy(q->val + slot * q->h->size, v, q->h->size);
+	q->heap[q->n].t = t;
+	q->heap[q->n].seq = q->seq++;
+	q->heap[q->n].slot = slot;
+	reorder_up(q, q->n++);
+	if (t > q->newest) {
+		q->newest = t;
+	}
+	while ((q->n > 0) && (q->heap[0].t <= q->newest - q->delay)) {
+		reorder_pop(q);
+	}
+}
+
+/* Number of samples held */
+int
+crrd_reorder_len(crrd_reorder_t *q)
+{
+	return (q->n);
+}
+
+/* Release everything held, in order */
+void
+crrd_reorder_flush(crrd_reorder_t *q)
+{
+	while (q->n > 0) {
+		reorder_pop(q);
+	}
+}
+
+/* Flush, and destroy the buffer. The database is left alone. */
+void
+crrd_reorder_destroy(crrd_reorder_t *q)
+{
+	if (q) {
+		crrd_reorder_flush(q);
+#ifdef TESTING
+		free(q);
+#else
+		kmem_free(q, q->asize);
+#endif
+	}
+}
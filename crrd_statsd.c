@@ -0,0 +1,668 @@
+/*
+ * crrd_statsd.c
+ *
+ * A StatsD listener: metrics arrive as UDP datagrams of lines
+ *
+ *   name:value|type[|@rate][|#tags]
+ *
+ * and are kept in a dbrrd per name, created with the listener's spec
+ * on first sight. The types taken are c (counter), ms and h (timer)
+ * and g (gauge; a value with a sign is a change to the last). Sets, and
+ * lines that do not parse, are counted as bad; tags are ignored.
+ *
+ * Samples are not added to the rrds one by one. Within a period of the
+ * finest tier each metric is aggregated in memory -- a sum for a
+ * counter, count, sum, min and max for a timer, the last value for a
+ * gauge -- and when the period ends the metrics that had samples are
+ * flushed, one dbrrd_add_at() each, at the period's start. Coarser
+ * tiers merge the flushed values as usual (the update()s below), and a
+ * metric that is quiet for a while costs nothing: gaps are filled as
+ * its type says (rrd_setfill) and lazily (rrd_setlazy).
+ *
+ * One thread, one epoll set, as crrdd: the socket, and an eventfd for
+ * crrd_statsd_stop(). Datagrams come in up to SD_RECV to a recvmmsg()
+ * call, into buffers set up once. The wait times out at the end of the
+ * period (or after SD_WAITMAX, for long ones), so a period is flushed
+ * on time when nothing arrives; and the clock is read again before each
+ * read, so datagrams that come in after the end of a period are not
+ * counted in it. The clock is crrd_now().
+ *
+ * Names are kept in an open addressed hash (FNV-1a) over an array of
+ * metrics, up to CRRD_STATSD_MAXMETRIC of them: a line naming one more
+ * is counted as bad, so a sender cannot grow the listener without
+ * bound. The rrds may be read from other threads, between
+ * crrd_statsd_lock() and crrd_statsd_unlock(); the listener holds the
+ * lock while it parses a batch of datagrams and while it flushes.
+ *
+ * User space only (TESTING): values are doubles.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE	/* recvmmsg */
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "crrd.h"
+
+#define	SD_RECV		64	/* datagrams per recvmmsg() */
+#define	SD_DGRAM	9216	/* largest datagram taken (jumbo frame) */
+#define	SD_WAITMAX	60000	/* longest epoll wait, ms */
+
+typedef struct sd_metric {
+	char name[CRRD_STATSD_NAMELEN];
+	int id;
+	int type;
+	int dirty;			/* has samples this period */
+	crrd_statsd_timer_t agg;	/* the period so far */
+	double gauge;			/* last gauge value, kept across */
+	rrd_t *h;
+} sd_metric_t;
+
+struct crrd_statsd {
+	int fd;				/* UDP */
+	int ep;				/* epoll */
+	int wake;			/* eventfd, for crrd_statsd_stop */
+	dbrrd_spec_t *spec;
+	hrtime_t res;			/* of the finest tier */
+	hrtime_t period;		/* start of the one being aggregated */
+	sd_metric_t **metric;		/* by index */
+	int nmetric;
+	int maxmetric;			/* room in metric[] */
+	int limit;			/* CRRD_STATSD_MAXMETRIC */
+	int *dirty;			/* indices of dirty metrics */
+	int ndirty;
+	uint32_t *hash;			/* index + 1, 0 for empty */
+	unsigned hsize;			/* a power of two */
+	pthread_mutex_t lock;
+	crrd_statsd_stats_t stats;
+	char *buf;			/* SD_RECV datagrams */
+	struct mmsghdr msg[SD_RECV];
+	struct iovec iov[SD_RECV];
+};
+
+/*
+ * How periods merge in the coarser tiers. The zero()s are what the
+ * fill kinds set for each do, and are only there for completeness.
+ */
+static void
+sd_counter_update(rrd_t *r, void *pv)
+{
+	*(double *)rrd_entry(r, rrd_tail(r)) += *(double *)pv;
+}
+
+static void
+sd_gauge_update(rrd_t *r, void *pv)
+{
+	*(double *)rrd_entry(r, rrd_tail(r)) = *(double *)pv;
+}
+
+static void
+sd_timer_update(rrd_t *r, void *pv)
+{
+	crrd_statsd_timer_t *e = rrd_entry(r, rrd_tail(r));
+	crrd_statsd_timer_t *v = pv;
+
+	if (e->count == 0) {
+		*e = *v;
+		return;
+	}
+	e->count += v->count;
+	e->sum += v->sum;
+	if (v->min < e->min) {
+		e->min = v->min;
+	}
+	if (v->max > e->max) {
+		e->max = v->max;
+	}
+}
+
+static void
+sd_zero(rrd_t *r, void *pv)
+{
+	pv = pv;
+	memset(rrd_entry(r, rrd_tail(r)), 0, r->size);
+}
+
+static void
+sd_prev_zero(rrd_t *r, void *pv)
+{
+	int n;
+
+	pv = pv;
+	n = (rrd_tail(r) == 0) ? rrd_capacity(r) - 1 : rrd_tail(r) - 1;
+	memcpy(rrd_entry(r, rrd_tail(r)), rrd_entry(r, n), r->size);
+}
+
+static const crrd_statsd_timer_t sd_zero_value;
+
+static const struct {
+	size_t size;
+	void *update;
+	void *zero;
+	int fill;
+} sd_type[] = {
+	{ sizeof (double), sd_counter_update, sd_zero, RRD_FILL_CONST },
+	{ sizeof (crrd_statsd_timer_t), sd_timer_update, sd_zero,
+	    RRD_FILL_CONST },
+	{ sizeof (double), sd_gauge_update, sd_prev_zero, RRD_FILL_PREV },
+};
+
+static uint32_t
+sd_fnv(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+/* Index of the metric called name (len bytes), or -1 */
+static int
+sd_find(crrd_statsd_t *s, const char *name, size_t len)
+{
+	unsigned i = sd_fnv(name, len) & (s->hsize - 1);
+	sd_metric_t *m;
+	uint32_t e;
+
+	if (len >= CRRD_STATSD_NAMELEN) {
+		return (-1);
+	}
+	while ((e = s->hash[i]) != 0) {
+		m = s->metric[e - 1];
+		if ((memcmp(m->name, name, len) == 0) &&
+		    (m->name[len] == '\0')) {
+			return (e - 1);
+		}
+		i = (i + 1) & (s->hsize - 1);
+	}
+	return (-1);
+}
+
+static void
+sd_hash_insert(uint32_t *hash, unsigned hsize, const char *name,
+    uint32_t id)
+{
+	unsigned i = sd_fnv(name, strlen(name)) & (hsize - 1);
+
+	while (hash[i] != 0) {
+		i = (i + 1) & (hsize - 1);
+	}
+	hash[i] = id + 1;
+}
+
+/* Make room for one more metric. Returns 0, or -1 if out of memory. */
+static int
+sd_grow(crrd_statsd_t *s)
+{
+	sd_metric_t **m;
+	uint32_t *hash;
+	unsigned hsize;
+	int *dirty;
+
+	if (s->nmetric == s->maxmetric) {
+		m = realloc(s->metric, 2 * s->maxmetric * sizeof (*m));
+		if (m == NULL) {
+			return (-1);
+		}
+		s->metric = m;
+		dirty = realloc(s->dirty, 2 * s->maxmetric * sizeof (int));
+		if (dirty == NULL) {
+			return (-1);
+		}
+		s->dirty = dirty;
+		s->maxmetric *= 2;
+	}
+	/* Keep the hash at most half full */
+	if (2 * (s->nmetric + 1) > s->hsize) {
+		hsize = 2 * s->hsize;
+		hash = calloc(hsize, sizeof (uint32_t));
+		if (hash == NULL) {
+			return (-1);
+		}
+		for (int i = 0; i < s->nmetric; ++i) {
+			sd_hash_insert(hash, hsize, s->metric[i]->name, i);
+		}
+		free(s->hash);
+		s->hash = hash;
+		s->hsize = hsize;
+	}
+	return (0);
+}
+
+/* The metric called name, created as type if it is new; or NULL */
+static sd_metric_t *
+sd_metric(crrd_statsd_t *s, const char *name, size_t len, int type)
+{
+	sd_metric_t *m;
+	int id;
+
+	id = sd_find(s, name, len);
+	if (id >= 0) {
+		m = s->metric[id];
+		return ((m->type == type) ? m : NULL);
+	}
+	if ((len == 0) || (len >= CRRD_STATSD_NAMELEN) ||
+	    (memchr(name, '\0', len) != NULL) || (s->nmetric >= s->limit) ||
+	    (sd_grow(s) != 0)) {
+		return (NULL);
+	}
+	m = calloc(1, sizeof (sd_metric_t));
+	if (m == NULL) {
+		return (NULL);
+	}
+	memcpy(m->name, name, len);
+	m->id = s->nmetric;
+	m->type = type;
+	m->h = dbrrd_create(m->name, s->spec, sd_type[type].size,
+	    sd_type[type].update, sd_type[type].zero);
+	if (m->h == NULL) {
+		free(m);
+		return (NULL);
+	}
+	(void) dbrrd_setfill(m->h, sd_type[type].fill, &sd_zero_value);
+	(void) dbrrd_setlazy(m->h, 1);
+	id = s->nmetric++;
+	s->metric[id] = m;
+	sd_hash_insert(s->hash, s->hsize, m->name, id);
+	return (m);
+}
+
+/* One line. Returns 0, or -1 if it is not taken. */
+static int
+sd_line(crrd_statsd_t *s, const char *p, const char *end)
+{
+	const char *name = p, *q;
+	sd_metric_t *m;
+	double v, rate = 1;
+	int type, rel;
+
+	q = memchr(p, ':', end - p);
+	if (q == NULL) {
+		return (-1);
+	}
+	p = q + 1;
+	rel = (p < end) && ((*p == '+') || (*p == '-'));
+	if (!crrd_line_double(&p, end, &v) || (p == end) || (*p++ != '|')) {
+		return (-1);
+	}
+	if ((end - p >= 2) && (p[0] == 'm') && (p[1] == 's')) {
+		type = CRRD_STATSD_TIMER;
+		p += 2;
+	} else if ((p < end) && (*p == 'h')) {
+		type = CRRD_STATSD_TIMER;
+		++p;
+	} else if ((p < end) && (*p == 'c')) {
+		type = CRRD_STATSD_COUNTER;
+		++p;
+	} else if ((p < end) && (*p == 'g')) {
+		type = CRRD_STATSD_GAUGE;
+		++p;
+	} else {
+		return (-1);
+	}
+	if ((p < end) && (*p != '|')) {
+		return (-1);
+	}
+	if ((end - p >= 2) && (p[1] == '@')) {
+		p += 2;
+		if (!crrd_line_double(&p, end, &rate) || (rate <= 0) ||
+		    (rate > 1) || ((p < end) && (*p != '|'))) {
+			return (-1);
+		}
+	}
+	m = sd_metric(s, name, q - name, type);
+	if (m == NULL) {
+		return (-1);
+	}
+	if (!m->dirty) {
+		memset(&m->agg, 0, sizeof (m->agg));
+	}
+	switch (type) {
+	case CRRD_STATSD_COUNTER:
+		m->agg.sum += v / rate;
+		break;
+	case CRRD_STATSD_TIMER:
+		if ((m->agg.count == 0) || (v < m->agg.min)) {
+			m->agg.min = v;
+		}
+		if ((m->agg.count == 0) || (v > m->agg.max)) {
+			m->agg.max = v;
+		}
+		m->agg.count += 1 / rate;
+		m->agg.sum += v / rate;
+		break;
+	case CRRD_STATSD_GAUGE:
+		m->gauge = rel ? m->gauge + v : v;
+		break;
+	}
+	if (!m->dirty) {
+		m->dirty = 1;
+		s->dirty[s->ndirty++] = m->id;
+	}
+	return (0);
+}
+
+static void
+sd_parse(crrd_statsd_t *s, const char *p, size_t len)
+{
+	const char *end = p + len, *nl;
+
+	for (; p < end; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL) {
+			nl = end;
+		}
+		if (nl == p) {
+			continue;
+		}
+		if (sd_line(s, p, (nl[-1] == '\r') ? nl - 1 : nl) == 0) {
+			++s->stats.metrics;
+		} else {
+			++s->stats.bad;
+		}
+	}
+}
+
+static void
+sd_flush(crrd_statsd_t *s, hrtime_t t)
+{
+	sd_metric_t *m;
+
+	for (int i = 0; i < s->ndirty; ++i) {
+		m = s->metric[s->dirty[i]];
+		switch (m->type) {
+		case CRRD_STATSD_COUNTER:
+			dbrrd_add_at(m->h, &m->agg.sum, t);
+			break;
+		case CRRD_STATSD_TIMER:
+			dbrrd_add_at(m->h, &m->agg, t);
+			break;
+		case CRRD_STATSD_GAUGE:
+			dbrrd_add_at(m->h, &m->gauge, t);
+			break;
+		}
+		m->dirty = 0;
+	}
+	s->ndirty = 0;
+}
+
+/* Take the lines of one datagram (len bytes) */
+void
+crrd_statsd_parse(crrd_statsd_t *s, const char *buf, size_t len)
+{
+	pthread_mutex_lock(&s->lock);
+	++s->stats.packets;
+	sd_parse(s, buf, len);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Add what every metric has had since the last flush to its dbrrd, at
+ * time t. crrd_statsd_run() does this at the start of each period.
+ */
+void
+crrd_statsd_flush(crrd_statsd_t *s, hrtime_t t)
+{
+	pthread_mutex_lock(&s->lock);
+	sd_flush(s, t);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Read one batch of datagrams, and take them */
+static void
+sd_read(crrd_statsd_t *s)
+{
+	int n;
+
+	do {
+		n = recvmmsg(s->fd, s->msg, SD_RECV, MSG_DONTWAIT, NULL);
+	} while ((n < 0) && (errno == EINTR));
+	if (n <= 0) {
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	for (int i = 0; i < n; ++i) {
+		++s->stats.packets;
+		if (s->msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			++s->stats.bad;
+			continue;
+		}
+		sd_parse(s, s->iov[i].iov_base, s->msg[i].msg_len);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Create a listener on UDP addr:port (IPv4; 127.0.0.1 if addr is
+ * NULL, and an ephemeral port if port is 0 -- see crrd_statsd_port),
+ * keeping each metric in a dbrrd laid out as spec.
+ */
+crrd_statsd_t *
+crrd_statsd_create(const char *addr, int port, dbrrd_spec_t *spec)
+{
+	struct sockaddr_in sa;
+	struct epoll_event ev;
+	crrd_statsd_t *s;
+	int n;
+
+	if (!dbrrd_spec_check(spec)) {
+		return (NULL);
+	}
+	memset(&sa, 0, sizeof (sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if (inet_pton(AF_INET, (addr != NULL) ? addr : "127.0.0.1",
+	    &sa.sin_addr) != 1) {
+		return (NULL);
+	}
+	s = calloc(1, sizeof (crrd_statsd_t));
+	if (s == NULL) {
+		return (NULL);
+	}
+	s->fd = s->ep = s->wake = -1;
+	pthread_mutex_init(&s->lock, NULL);
+	for (n = 0; spec[n].capacity != 0; ++n)
+		;
+	s->spec = malloc((n + 1) * sizeof (dbrrd_spec_t));
+	s->maxmetric = 64;
+	s->limit = CRRD_STATSD_MAXMETRIC;
+	s->hsize = 128;
+	s->metric = malloc(s->maxmetric * sizeof (sd_metric_t *));
+	s->dirty = malloc(s->maxmetric * sizeof (int));
+	s->hash = calloc(s->hsize, sizeof (uint32_t));
+	s->buf = malloc((size_t)SD_RECV * SD_DGRAM);
+	if ((s->spec == NULL) || (s->metric == NULL) || (s->dirty == NULL) ||
+	    (s->hash == NULL) || (s->buf == NULL)) {
+		goto fail;
+	}
+	memcpy(s->spec, spec, (n + 1) * sizeof (dbrrd_spec_t));
+	s->res = spec[n - 1].tv;
+	for (int i = 0; i < SD_RECV; ++i) {
+		s->iov[i].iov_base = s->buf + (size_t)i * SD_DGRAM;
+		s->iov[i].iov_len = SD_DGRAM;
+		s->msg[i].msg_hdr.msg_iov = &s->iov[i];
+		s->msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	s->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if ((s->fd < 0) ||
+	    (bind(s->fd, (struct sockaddr *)&sa, sizeof (sa)) != 0)) {
+		goto fail;
+	}
+	s->ep = epoll_create1(EPOLL_CLOEXEC);
+	s->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ((s->ep < 0) || (s->wake < 0)) {
+		goto fail;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &s->fd;
+	if (epoll_ctl(s->ep, EPOLL_CTL_ADD, s->fd, &ev) != 0) {
+		goto fail;
+	}
+	ev.data.ptr = &s->wake;
+	if (epoll_ctl(s->ep, EPOLL_CTL_ADD, s->wake, &ev) != 0) {
+		goto fail;
+	}
+	return (s);
+fail:
+	crrd_statsd_destroy(s);
+	return (NULL);
+}
+
+/* The port the listener is bound to */
+int
+crrd_statsd_port(crrd_statsd_t *s)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof (sa);
+
+	if (getsockname(s->fd, (struct sockaddr *)&sa, &len) != 0) {
+		return (-1);
+	}
+	return (ntohs(sa.sin_port));
+}
+
+/* Flush the period if it is over. Returns the time. */
+static hrtime_t
+sd_tick(crrd_statsd_t *s)
+{
+	hrtime_t now = crrd_now();
+
+	if (now >= s->period + s->res) {
+		crrd_statsd_flush(s, s->period);
+		s->period = now - now % s->res;
+	}
+	return (now);
+}
+
+/*
+ * Listen until crrd_statsd_stop(), flushing at the start of each
+ * period, and once more on the way out. Returns 0, or -1 if epoll
+ * fails.
+ */
+int
+crrd_statsd_run(crrd_statsd_t *s)
+{
+	struct epoll_event ev[2];
+	hrtime_t now, ms;
+	uint64_t v;
+	int n;
+
+	now = crrd_now();
+	s->period = now - now % s->res;
+	for (;;) {
+		now = sd_tick(s);
+		/* Wake up for the end of the period, at the latest */
+		ms = (s->period + s->res - now) / 1000000 + 1;
+		n = epoll_wait(s->ep, ev, 2,
+		    (ms < SD_WAITMAX) ? (int)ms : SD_WAITMAX);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (-1);
+		}
+		for (int i = 0; i < n; ++i) {
+			if (ev[i].data.ptr == &s->wake) {
+				(void) read(s->wake, &v, sizeof (v));
+				crrd_statsd_flush(s, s->period);
+				return (0);
+			}
+			/* The wait may have run past the period's end */
+			(void) sd_tick(s);
+			sd_read(s);
+		}
+	}
+}
+
+/* Make crrd_statsd_run() return. Safe from a signal handler. */
+void
+crrd_statsd_stop(crrd_statsd_t *s)
+{
+	uint64_t one = 1;
+
+	(void) write(s->wake, &one, sizeof (one));
+}
+
+void
+crrd_statsd_lock(crrd_statsd_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+}
+
+void
+crrd_statsd_unlock(crrd_statsd_t *s)
+{
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * The dbrrd of metric name, and its type (CRRD_STATSD_), or NULL if
+ * there is none. Use it with the lock held.
+ */
+rrd_t *
+crrd_statsd_series(crrd_statsd_t *s, const char *name, int *type)
+{
+	int id;
+
+	id = sd_find(s, name, strlen(name));
+	if (id < 0) {
+		return (NULL);
+	}
+	if (type != NULL) {
+		*type = s->metric[id]->type;
+	}
+	return (s->metric[id]->h);
+}
+
+void
+crrd_statsd_stats(crrd_statsd_t *s, crrd_statsd_stats_t *st)
+{
+	pthread_mutex_lock(&s->lock);
+	*st = s->stats;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Close the socket, and destroy every metric's dbrrd */
+void
+crrd_statsd_destroy(crrd_statsd_t *s)
+{
+	if (s) {
+		for (int i = 0; i < s->nmetric; ++i) {
+			dbrrd_destroy(s->metric[i]->h);
+			free(s->metric[i]);
+		}
+		if (s->fd >= 0) {
+			(void) close(s->fd);
+		}
+		if (s->ep >= 0) {
+			(void) close(s->ep);
+		}
+		if (s->wake >= 0) {
+			(void) close(s->wake);
+		}
+		free(s->spec);
+		free(s->metric);
+		free(s->dirty);
+		free(s->hash);
+		free(s->buf);
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+	}
+}
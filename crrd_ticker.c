@@ -0,0 +1,220 @@
+/*
+ * crrd_ticker.c
+ *
+ * A coarse shared clock for mass ingest.
+ *
+ * With hundreds of thousands of dbrrd_add() calls a second into one
+ * second tiers, nearly every call reads the clock, and then divides to
+ * find that it is in the same period as last time. A ticker does that
+ * once per tick instead: a background thread reads crrd_now(), works
+ * out the start of the current period for each of the resolutions it
+ * was given, and publishes them on a page. dbrrd_add_tick() then takes
+ * the time and its period starts from the page (dbrrd_add_known), so
+ * a sample costs no clock read and no division, and a sample in the
+ * same period as the last is a load and a compare.
+ *
+ * Timestamps are as coarse as the tick: every sample within one tick
+ * gets the same time. Pick a tick well under the finest resolution.
+ *
+ * The page is a POSIX shared memory object mapped twice, read-write
+ * for the thread and read-only for everyone else (crrd_ticker_page()),
+ * and is written under a sequence lock: seq is odd while the thread is
+ * writing, and a reader retries if seq changed under it. The time
+ * alone is a single aligned word, and can be read without the lock
+ * (crrd_ticker_now()).
+ *
+ * User space only (TESTING).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "crrd.h"
+
+struct crrd_ticker {
+	hrtime_t tick;
+	crrd_tick_page_t *rw;		/* the thread's view */
+	const crrd_tick_page_t *ro;	/* everyone else's */
+	size_t len;			/* length of each mapping */
+	pthread_t thread;
+	int running;
+};
+
+/* Publish the current time, and the period start for each resolution */
+static void
+ticker_publish(crrd_ticker_t *k)
+{
+	crrd_tick_page_t *pg = k->rw;
+	uint64_t s = pg->seq;
+	hrtime_t now = crrd_now();
+
+	__atomic_store_n(&pg->seq, s + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (int i = 0; i < pg->nres; ++i) {
+		pg->start[i] = now - now % pg->res[i];
+	}
+	__atomic_store_n(&pg->now, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&pg->seq, s + 2, __ATOMIC_RELEASE);
+}
+
+static void *
+ticker_thread(void *arg)
+{
+	crrd_ticker_t *k = arg;
+	struct timespec nap;
+
+	nap.tv_sec = k->tick / 1000000000LL;
+	nap.tv_nsec = k->tick % 1000000000LL;
+	while (__atomic_load_n(&k->running, __ATOMIC_ACQUIRE)) {
+		nanosleep(&nap, NULL);
+		ticker_publish(k);
+	}
+	return (NULL);
+}
+
+/* Map the page twice, read-write and read-only. Returns 1 on success. */
+static int
+ticker_map(crrd_ticker_t *k)
+{
+	static int serial;
+	char name[64];
+	void *rw, *ro;
+	int fd;
+
+	k->len = sysconf(_SC_PAGESIZE);
+	if (k->len < sizeof (crrd_tick_page_t)) {
+		k->len = sizeof (crrd_tick_page_t);
+	}
+	(void) snprintf(name, sizeof (name), "/crrd_ticker.%d.%d",
+	    (int)getpid(), __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return (0);
+	}
+	/* Nobody else needs to find it */
+	(void) shm_unlink(name);
+	if (ftruncate(fd, k->len) != 0) {
+		(void) close(fd);
+		return (0);
+	}
+	rw = mmap(NULL, k->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ro = mmap(NULL, k->len, PROT_READ, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if ((rw == MAP_FAILED) || (ro == MAP_FAILED)) {
+		if (rw != MAP_FAILED) {
+			(void) munmap(rw, k->len);
+		}
+		if (ro != MAP_FAILED) {
+			(void) munmap(ro, k->len);
+		}
+		return (0);
+	}
+	k->rw = rw;
+	k->ro = ro;
+	return (1);
+}
+
+/*
+ * Create a ticker publishing every tick the time and the period starts
+ * for the nres resolutions res[] (at most CRRD_TICK_MAX), and start
+ * its thread. The page is published once before this returns.
+ */
+crrd_ticker_t *
+crrd_ticker_create(hrtime_t tick, const hrtime_t *res, int nres)
+{
+	crrd_ticker_t *k;
+
+	if ((tick <= 0) || (nres < 0) || (nres > CRRD_TICK_MAX)) {
+		return (NULL);
+	}
+	for (int i = 0; i < nres; ++i) {
+		if (res[i] <= 0) {
+			return (NULL);
+		}
+	}
+	k = calloc(1, sizeof (crrd_ticker_t));
+	if (k == NULL) {
+		return (NULL);
+	}
+	k->tick = tick;
+	if (!ticker_map(k)) {
+		free(k);
+		return (NULL);
+	}
+	k->rw->nres = nres;
+	memcpy(k->rw->res, res, nres * sizeof (hrtime_t));
+	ticker_publish(k);
+	k->running = 1;
+	if (pthread_create(&k->thread, NULL, ticker_thread, k) != 0) {
+		k->running = 0;
+		crrd_ticker_destroy(k);
+		return (NULL);
+	}
+	return (k);
+}
+
+/* The page, read-only */
+const crrd_tick_page_t *
+crrd_ticker_page(crrd_ticker_t *k)
+{
+	return (k->ro);
+}
+
+/* The time, as of the last tick */
+hrtime_t
+crrd_ticker_now(crrd_ticker_t *k)
+{
+	return (__atomic_load_n(&k->ro->now, __ATOMIC_RELAXED));
+}
+
+/*
+ * dbrrd_add() with the time of the last tick. Tiers with a resolution
+ * the ticker publishes are placed without a division.
+ */
+void
+dbrrd_add_tick(crrd_ticker_t *k, rrd_t *h, void *v)
+{
+	const crrd_tick_page_t *pg = k->ro;
+	hrtime_t start[CRRD_TICK_MAX];
+	hrtime_t now;
+	uint64_t s;
+	int n = pg->nres;
+
+	for (;;) {
+		s = __atomic_load_n(&pg->seq, __ATOMIC_ACQUIRE);
+		if (s & 1) {
+			continue;
+		}
+		now = pg->now;
+		for (int i = 0; i < n; ++i) {
+			start[i] = pg->start[i];
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&pg->seq, __ATOMIC_RELAXED) == s) {
+			break;
+		}
+	}
+	dbrrd_add_known(h, v, now, pg->res, start, n);
+}
+
+/* Stop the thread and unmap the page */
+void
+crrd_ticker_destroy(crrd_ticker_t *k)
+{
+	if (k) {
+		if (k->running) {
+			__atomic_store_n(&k->running, 0, __ATOMIC_RELEASE);
+			pthread_join(k->thread, NULL);
+		}
+		(void) munmap(k->rw, k->len);
+		(void) munmap((void *)k->ro, k->len);
+		free(k);
+	}
+}
@@ -0,0 +1,285 @@
+/*
+ * crrd_txg.c
+ *
+ * Compact time to txg tiers.
+ *
+ * The txg layout keeps a low/high txg pair per slot: two uint64_t, 16
+ * bytes. But txgs only grow, and every slot of an rrd holds txgs from
+ * within one span of the ring, so the pairs are all close together.
+ * Here each block of CRRD_TXG_BLOCK slots keeps one 64-bit base, and
+ * each slot two 32-bit offsets from it: 8 bytes a slot, about half the
+ * memory (for the 10 year/365 day/1440 minute layout, 15K rather than
+ * 29K).
+ *
+ * A block's base is the lowest txg it holds. When a slot is written
+ * with a txg that does not fit (a block was last based a ring span
+ * ago), the block is rebased on its live slots -- O(CRRD_TXG_BLOCK),
+ * and rare. 32 bits is over four billion txgs in one ring span; if a
+ * span ever holds more, the offsets saturate on the safe side: a low
+ * txg that does not fit reads back lower than it was, and a high one
+ * as UINT64_MAX, so a range from here only ever widens.
+ *
+ * (16-bit offsets would halve it again, but a year of txgs does not
+ * fit in 16 bits, so they would only be safe for the minute tier.)
+ *
+ * The rrds use the store() hook (rrd_setstore), so dbrrd_add_at(),
+ * rrd_roll() and a reorder window work on them as usual. Entries are
+ * encoded: read them with crrd_txg_query(), not dbrrd_query();
+ * dbrrd_find_value() and dbrrd_query_range() refuse them.
+ */
+
+#ifdef TESTING
+#  include <stddef.h>
+#  include <stdint.h>
+#  include <string.h>
+#  include <stdlib.h>
+#  include <stdio.h>
+#  include "crrd.h"
+#else
+#  include <sys/zfs_context.h>
+#  include <sys/crrd.h>
+#endif
+
+#define	CTXG_NOBASE	UINT64_MAX	/* block holds nothing yet */
+#define	CTXG_HIGH	UINT32_MAX	/* offset of a high txg too far */
+
+typedef struct ctxg_slot {
+	uint32_t l;
+	uint32_t h;
+} ctxg_slot_t;
+
+/* Per rrd, in r->arg: the block bases */
+typedef struct ctxg_tier {
+	size_t asize;
+	int nblocks;
+	uint64_t base[];
+} ctxg_tier_t;
+
+/* Is slot p in the ring? */
+static int
+ctxg_live(rrd_t *r, int p)
+{
+	int i;
+
+	if (r->tail < 0) {
+		return (0);
+	}
+	i = p - r->head;
+	if (i < 0) {
+		i += r->capacity;
+	}
+	return (i < (int)rrd_len(r));
+}
+
+static void
+ctxg_decode(rrd_t *r, int p, uint64_t *l, uint64_t *h)
+{
+	ctxg_tier_t *x = r->arg;
+	ctxg_slot_t *s = rrd_entry(r, p);
+	uint64_t b = x->base[p / CRRD_TXG_BLOCK];
+
+	*l = b + s->l;
+	*h = (s->h == CTXG_HIGH) ? UINT64_MAX : b + s->h;
+}
+
+/* Write l, h into slot p, against base b */
+static void
+ctxg_put(rrd_t *r, int p, uint64_t b, uint64_t l, uint64_t h)
+{
+	ctxg_slot_t *s = rrd_entry(r, p);
+
+	s->l = (l - b < CTXG_HIGH) ? (uint32_t)(l - b) : CTXG_HIGH - 1;
+	s->h = ((h == UINT64_MAX) || (h - b >= CTXG_HIGH)) ?
+	    CTXG_HIGH : (uint32_t)(h - b);
+}
+
+/*
+ * Rebase the block of slot p on the lowest txg it holds, counting l
+ * (about to go into p) and not what p holds now.
+ */
+static void
+ctxg_rebase(rrd_t *r, int p, uint64_t l)
+{
+	ctxg_tier_t *x = r->arg;
+	int blk = p / CRRD_TXG_BLOCK;
+	int q0 = blk * CRRD_TXG_BLOCK;
+	int q1 = q0 + CRRD_TXG_BLOCK;
+	uint64_t b = l;
+	uint64_t ql, qh;
+
+	if (q1 > r->capacity) {
+		q1 = r->capacity;
+	}
+	if (x->base[blk] != CTXG_NOBASE) {
+		for (int q = q0; q < q1; ++q) {
+			if ((q != p) && ctxg_live(r, q)) {
+				ctxg_decode(r, q, &ql, &qh);
+				if (ql < b) {
+					b = ql;
+				}
+			}
+		}
+		for (int q = q0; q < q1; ++q) {
+			if ((q != p) && ctxg_live(r, q)) {
+				ctxg_decode(r, q, &ql, &qh);
+				ctxg_put(r, q, b, ql, qh);
+			}
+		}
+	}
+	x->base[blk] = b;
+}
+
+/* Encode l, h into slot p, rebasing its block if they do not fit */
+static void
+ctxg_encode(rrd_t *r, int p, uint64_t l, uint64_t h)
+{
+	ctxg_tier_t *x = r->arg;
+	uint64_t b = x->base[p / CRRD_TXG_BLOCK];
+
+	if ((b == CTXG_NOBASE) || (l < b) || (l - b >= CTXG_HIGH) ||
+	    ((h != UINT64_MAX) && (h - b >= CTXG_HIGH))) {
+		ctxg_rebase(r, p, l);
+		b = x->base[p / CRRD_TXG_BLOCK];
+	}
+	ctxg_put(r, p, b, l, h);
+}
+
+/* A sample, a txg, starts a period */
+static void
+ctxg_store(rrd_t *r, void *pv)
+{
+	uint64_t txg = *(uint64_t *)pv;
+
+	ctxg_encode(r, rrd_tail(r), txg, txg);
+}
+
+/* Broaden the period's range to cover the txg */
+static void
+ctxg_update(rrd_t *r, void *pv)
+{
+	uint64_t txg = *(uint64_t *)pv;
+	uint64_t l, h;
+
+	ctxg_decode(r, rrd_tail(r), &l, &h);
+	if (txg < l) {
+		l = txg;
+	}
+	if (txg > h) {
+		h = txg;
+	}
+	ctxg_encode(r, rrd_tail(r), l, h);
+}
+
+/* A period with no txg gets the previous period's range */
+static void
+ctxg_zero(rrd_t *r, void *pv)
+{
+	uint64_t l, h;
+	int n;
+
+	pv = pv;
+	n = rrd_tail(r) - 1;
+	if (n < 0) {
+		n = rrd_capacity(r) - 1;
+	}
+	ctxg_decode(r, n, &l, &h);
+	ctxg_encode(r, rrd_tail(r), l, h);
+}
+
+/*
+ * Create compact txg tiers, from a spec as for dbrrd_create. Add with
+ * crrd_txg_add_at, query with crrd_txg_query.
+ */
+rrd_t *
+crrd_txg_create(char *name, dbrrd_spec_t *spec)
+{
+	ctxg_tier_t *x;
+	size_t asize;
+	rrd_t *h, *r;
+	int nb;
+
+	h = dbrrd_create(name, spec, sizeof (ctxg_slot_t), ctxg_update,
+	    ctxg_zero);
+	if (h == NULL) {
+		return (NULL);
+	}
+	for (r = h; r != NULL; r = r->next) {
+		nb = (r->capacity + CRRD_TXG_BLOCK - 1) / CRRD_TXG_BLOCK;
+		asize = sizeof (ctxg_tier_t) + nb * sizeof (uint64_t);
+#ifdef TESTING
+		x = malloc(asize);
+		if (x == NULL) {
+			crrd_txg_destroy(h);
+			return (NULL);
+		}
+#else
+		x = kmem_alloc(asize, KM_SLEEP);
+#endif
+		x->asize = asize;
+		x->nblocks = nb;
+		for (int i = 0; i < nb; ++i) {
+			x->base[i] = CTXG_NOBASE;
+		}
+		rrd_setstore(r, ctxg_store, x);
+	}
+	return (h);
+}
+
+void
+crrd_txg_add_at(rrd_t *h, uint64_t txg, hrtime_t t)
+{
+	dbrrd_add_at(h, &txg, t);
+}
+
+/*
+ * The txg range [*lo, *hi] of the period holding tv, from the tightest
+ * tier that reaches back that far, as dbrrd_query. Returns 1 if found.
+ */
+int
+crrd_txg_query(rrd_t *h, hrtime_t tv, uint64_t *lo, uint64_t *hi,
+    hrtime_t *res)
+{
+	void *p;
+	rrd_t *r;
+
+	if (dbrrd_query(h, tv, &p, res) == 0) {
+		return (0);
+	}
+	/* Resolutions are distinct (dbrrd_spec_check): find the tier */
+	for (r = h; r->resolution != *res; r = r->next)
+		;
+	ctxg_decode(r, ((char *)p - (char *)r->entries) / r->size, lo, hi);
+	return (1);
+}
+
+/* Bytes taken by the tiers and their bases */
+size_t
+crrd_txg_size(rrd_t *h)
+{
+	size_t n = 0;
+
+	for (; h != NULL; h = h->next) {
+		n += h->asize + ((ctxg_tier_t *)h->arg)->asize;
+	}
+	return (n);
+}
+
+void
+crrd_txg_destroy(rrd_t *h)
+{
+	ctxg_tier_t *x;
+
+	for (rrd_t *r = h; r != NULL; r = r->next) {
+		x = r->arg;
+		if (x == NULL) {
+			continue;
+		}
+#ifdef TESTING
+		free(x);
+#else
+		kmem_free(x, x->asize);
+#endif
+		r->arg = NULL;
+	}
+	dbrrd_destroy(h);
+}
@@ -0,0 +1,447 @@
+/*
+ * crrd_wheel.c
+ *
+ * Hierarchical timer wheel that rolls idle rrds over at their period
+ * boundaries.
+ *
+ * Normally an rrd only moves when the next sample arrives. An rrd that
+ * has been idle for a while then does its catch-up all at once, and
+ * until then a query sees it as ending at the last sample. With a
+ * wheel, each rrd of a registered database has a timer at its next
+ * period boundary (r->start + r->resolution). When the timer fires
+ * and no sample has moved the rrd in the meantime, rrd_roll() moves
+ * it to the current period. Either way the timer is set again for the
+ * next boundary. Samples never touch the wheel, so ingest stays as it
+ * was; the wheel just notices late that a sample got there first.
+ *
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots. Level l holds
+ * timers due within WHEEL_SIZE^(l+1) ticks, and a level's slot is
+ * cascaded down one level when the level below wraps (the classic
+ * Varghese & Lauck scheme). Inserting, cancelling and firing are all
+ * O(1), and a timer cascades at most WHEEL_LEVELS-1 times. Runs of
+ * ticks with nothing due are skipped, so advancing over a long idle
+ * stretch is cheap too.
+ *
+ * The wheel can be advanced by hand (crrd_wheel_advance), or by a
+ * background thread (crrd_wheel_start). With the thread running,
+ * anyone adding to a registered database h must hold
+ * crrd_wheel_lock(w, h). That is not one lock for the wheel but one of
+ * WHEEL_STRIPES, picked by h, which the wheel also takes to roll h's
+ * rrds: adders to different databases seldom meet, and never wait for
+ * the wheel's own bookkeeping, which has a lock of its own.
+ *
+ * A roll moves r->last up to the start of the new period (rrd_roll),
+ * so a sample for the period just closed, arriving after the roll, is
+ * late, and is dropped -- as it would be had any later sample got
+ * there first. Give the database a reorder window (dbrrd_setreorder)
+ * of a tick or two to keep such samples.
+ *
+ * User space only (TESTING).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "crrd.h"
+
+#define	WHEEL_BITS	6
+#define	WHEEL_SIZE	(1 << WHEEL_BITS)
+#define	WHEEL_MASK	(WHEEL_SIZE - 1)
+#define	WHEEL_LEVELS	6
+#define	WHEEL_STRIPES	64	/* locks for adders, a power of 2 */
+
+typedef struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer *prev;
+	rrd_t *r;		/* the rrd (tier) to roll */
+	rrd_t *h;		/* its database, for the stripe */
+	int64_t expires;	/* tick this is due */
+	int level;		/* level we are on, -1 if not queued */
+} wheel_timer_t;
+
+/* One registered database, with a timer per rrd */
+typedef struct wheel_series {
+	struct wheel_series *next;
+	rrd_t *h;
+	int ntimers;
+	wheel_timer_t timers[];
+} wheel_series_t;
+
+typedef struct wheel_stripe {
+	pthread_mutex_t lock;
+} __attribute__((aligned(64))) wheel_stripe_t;
+
+struct crrd_wheel {
+	hrtime_t tick;		/* duration of one tick */
+	int64_t now;		/* last tick processed */
+	int count[WHEEL_LEVELS];
+	wheel_timer_t *slot[WHEEL_LEVELS][WHEEL_SIZE];
+	wheel_series_t *series;
+	pthread_mutex_t lock;	/* all of the above */
+	wheel_stripe_t stripe[WHEEL_STRIPES];	/* the rrds, by database */
+	pthread_t thread;
+	int running;
+};
+
+/* The lock that covers the rrds of database h */
+static pthread_mutex_t *
+wheel_stripe(crrd_wheel_t *w, rrd_t *h)
+{
+	uint32_t k = (uint32_t)((uintptr_t)h >> 4) * 2654435761U;
+
+	return (&w->stripe[k >> 26 & (WHEEL_STRIPES - 1)].lock);
+}
+
+/* First tick at or after time t */
+static int64_t
+wheel_ticks(crrd_wheel_t *w, hrtime_t t)
+{
+	return ((t + w->tick - 1) / w->tick);
+}
+
+static void
+wheel_unlink(crrd_wheel_t *w, wheel_timer_t *p)
+{
+	if (p->level < 0) {
+		return;
+	}
+	if (p->prev != NULL) {
+		p->prev->next = p->next;
+	} else {
+		w->slot[p->level][(p->expires >> (WHEEL_BITS * p->level)) &
+		    WHEEL_MASK] = p->next;
+	}
+	if (p->next != NULL) {
+		p->next->prev = p->prev;
+	}
+	--w->count[p->level];
+	p->level = -1;
+}
+
+/*
+ * Queue timer p for tick e. Anything already due goes into the next
+ * tick. Anything beyond the top level is parked as far out as the top
+ * level reaches; firing early is harmless, as the timer just sets
+ * itself again.
+ */
+static void
+wheel_insert(crrd_wheel_t *w, wheel_timer_t *p, int64_t e)
+{
+	int64_t delta;
+	int64_t top;
+	int l;
+	int i;
+
+	if (e <= w->now) {
+		e = w->now + 1;
+	}
+	top = ((int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	if (e - w->now > top) {
+		e = w->now + top;
+	}
+	delta = e - w->now;
+	for (l = 0; l < WHEEL_LEVELS - 1; ++l) {
+		if (delta < ((int64_t)1 << (WHEEL_BITS * (l + 1)))) {
+			break;
+		}
+	}
+	i = (e >> (WHEEL_BITS * l)) & WHEEL_MASK;
+	p->expires = e;
+	p->level = l;
+	p->prev = NULL;
+	p->next = w->slot[l][i];
+	if (p->next != NULL) {
+		p->next->prev = p;
+	}
+	w->slot[l][i] = p;
+	++w->count[l];
+}
+
+/* Set timer p for the next period boundary of its rrd (stripe held) */
+static void
+wheel_schedule(crrd_wheel_t *w, wheel_timer_t *p)
+{
+	rrd_t *r = p->r;
+
+	/* An empty rrd has no periods yet, look again in a period */
+	if (r->tail < 0) {
+		wheel_insert(w, p, w->now + wheel_ticks(w, r->resolution));
+		return;
+	}
+	wheel_insert(w, p, wheel_ticks(w, r->start + r->resolution));
+}
+
+/* Timer p is due: roll its rrd if no sample has, and set it again */
+static void
+wheel_fire(crrd_wheel_t *w, wheel_timer_t *p)
+{
+	pthread_mutex_t *m = wheel_stripe(w, p->h);
+	rrd_t *r = p->r;
+	hrtime_t t = w->now * w->tick;
+
+	pthread_mutex_lock(m);
+	if ((r->tail >= 0) && (r->start + r->resolution <= t)) {
+		rrd_roll(r, t);
+	}
+	wheel_schedule(w, p);
+	pthread_mutex_unlock(m);
+}
+
+/*
+ * Move slot i of level l down to the levels below. A timer due this
+ * very tick is fired here, as level 0 may already be past its slot.
+ */
+static void
+wheel_cascade(crrd_wheel_t *w, int l, int i)
+{
+	wheel_timer_t *p, *n;
+
+	p = w->slot[l][i];
+	w->slot[l][i] = NULL;
+	for (; p != NULL; p = n) {
+		n = p->next;
+		--w->count[l];
+		p->level = -1;
+		if (p->expires <= w->now) {
+			wheel_fire(w, p);
+		} else {
+			wheel_insert(w, p, p->expires);
+		}
+	}
+}
+
+/* Process tick k: cascade any level that wrapped, then fire level 0 */
+static void
+wheel_tick(crrd_wheel_t *w, int64_t k)
+{
+	wheel_timer_t *p, *n;
+	int l;
+	int i;
+
+	w->now = k;
+	for (l = 1; l < WHEEL_LEVELS; ++l) {
+		if ((k & (((int64_t)1 << (WHEEL_BITS * l)) - 1)) != 0) {
+			break;
+		}
+		wheel_cascade(w, l, (k >> (WHEEL_BITS * l)) & WHEEL_MASK);
+	}
+	i = k & WHEEL_MASK;
+	p = w->slot[0][i];
+	w->slot[0][i] = NULL;
+	for (; p != NULL; p = n) {
+		n = p->next;
+		--w->count[0];
+		p->level = -1;
+		wheel_fire(w, p);
+	}
+}
+
+/* Process every tick up to time now. The caller holds the lock. */
+static void
+wheel_advance(crrd_wheel_t *w, hrtime_t now)
+{
+	int64_t target = now / w->tick;
+	int64_t k, span;
+	int l;
+
+	while (w->now < target) {
+		k = w->now + 1;
+		/*
+		 * If the low levels are empty nothing can happen until
+		 * the lowest busy level next wraps: skip to there.
+		 */
+		for (l = 0; (l < WHEEL_LEVELS) && (w->count[l] == 0); ++l)
+			;
+		if (l == WHEEL_LEVELS) {
+			w->now = target;
+			break;
+		}
+		if (l > 0) {
+			span = (int64_t)1 << (WHEEL_BITS * l);
+			k = (k + span - 1) & ~(span - 1);
+			if (k > target) {
+				w->now = target;
+				break;
+			}
+		}
+		wheel_tick(w, k);
+	}
+}
+
+/*
+ * Create a wheel with the given tick (the finest resolution it can
+ * roll at), starting at time now.
+ */
+crrd_wheel_t *
+crrd_wheel_create(hrtime_t tick, hrtime_t now)
+{
+	crrd_wheel_t *w;
+
+	if (tick <= 0) {
+		return (NULL);
+	}
+	/* The stripes are a cache line each */
+	w = aligned_alloc(64, sizeof (crrd_wheel_t));
+	if (w == NULL) {
+		return (NULL);
+	}
+	memset(w, 0, sizeof (crrd_wheel_t));
+	w->tick = tick;
+	w->now = now / tick;
+	pthread_mutex_init(&w->lock, NULL);
+	for (int i = 0; i < WHEEL_STRIPES; ++i) {
+		pthread_mutex_init(&w->stripe[i].lock, NULL);
+	}
+	return (w);
+}
+
+/* Register database h: each of its rrds is rolled at its boundaries */
+int
+crrd_wheel_add(crrd_wheel_t *w, rrd_t *h)
+{
+	wheel_series_t *s;
+	rrd_t *r;
+	int n;
+
+	n = 0;
+	for (r = h; r != NULL; r = r->next) {
+		++n;
+	}
+	s = malloc(sizeof (wheel_series_t) + n * sizeof (wheel_timer_t));
+	if (s == NULL) {
+		return (0);
+	}
+	s->h = h;
+	s->ntimers = n;
+	pthread_mutex_lock(&w->lock);
+	pthread_mutex_lock(wheel_stripe(w, h));
+	n = 0;
+	for (r = h; r != NULL; r = r->next) {
+		s->timers[n].r = r;
+		s->timers[n].h = h;
+		s->timers[n].level = -1;
+		wheel_schedule(w, &s->timers[n]);
+		++n;
+	}
+	pthread_mutex_unlock(wheel_stripe(w, h));
+	s->next = w->series;
+	w->series = s;
+	pthread_mutex_unlock(&w->lock);
+	return (1);
+}
+
+/* Forget database h. Do this before dbrrd_destroy(h). */
+void
+crrd_wheel_remove(crrd_wheel_t *w, rrd_t *h)
+{
+	wheel_series_t **pp, *s;
+
+	pthread_mutex_lock(&w->lock);
+	for (pp = &w->series; (s = *pp) != NULL; pp = &s->next) {
+		if (s->h == h) {
+			*pp = s->next;
+			for (int i = 0; i < s->ntimers; ++i) {
+				wheel_unlink(w, &s->timers[i]);
+			}
+			free(s);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Roll every registered rrd whose boundary is at or before now */
+void
+crrd_wheel_advance(crrd_wheel_t *w, hrtime_t now)
+{
+	pthread_mutex_lock(&w->lock);
+	wheel_advance(w, now);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Hold off the wheel from database h, to add to it */
+void
+crrd_wheel_lock(crrd_wheel_t *w, rrd_t *h)
+{
+	pthread_mutex_lock(wheel_stripe(w, h));
+}
+
+void
+crrd_wheel_unlock(crrd_wheel_t *w, rrd_t *h)
+{
+	pthread_mutex_unlock(wheel_stripe(w, h));
+}
+
+/* Background thread: advance to crrd_now() once per tick */
+static void *
+wheel_thread(void *arg)
+{
+	crrd_wheel_t *w = arg;
+	struct timespec nap;
+
+	nap.tv_sec = w->tick / 1000000000LL;
+	nap.tv_nsec = w->tick % 1000000000LL;
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		if (!w->running) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		wheel_advance(w, crrd_now());
+		pthread_mutex_unlock(&w->lock);
+		nanosleep(&nap, NULL);
+	}
+	return (NULL);
+}
+
+/* Start the background thread. Returns 1 on success. */
+int
+crrd_wheel_start(crrd_wheel_t *w)
+{
+	if (w->running) {
+		return (1);
+	}
+	w->running = 1;
+	if (pthread_create(&w->thread, NULL, wheel_thread, w) != 0) {
+		w->running = 0;
+		return (0);
+	}
+	return (1);
+}
+
+/* Stop the background thread, if any, and wait for it */
+void
+crrd_wheel_stop(crrd_wheel_t *w)
+{
+	if (!w->running) {
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	w->running = 0;
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+}
+
+/* Destroy the wheel. The registered databases are left alone. */
+void
+crrd_wheel_destroy(crrd_wheel_t *w)
+{
+	wheel_series_t *s, *n;
+
+	if (w) {
+		crrd_wheel_stop(w);
+		for (s = w->series; s != NULL; s = n) {
+			n = s->next;
+			free(s);
+		}
+		pthread_mutex_destroy(&w->lock);
+		for (int i = 0; i < WHEEL_STRIPES; ++i) {
+			pthread_mutex_destroy(&w->stripe[i].lock);
+		}
+		free(w);
+	}
+}
@@ -0,0 +1,437 @@
+/*
+ * crrdc.c
+ *
+ * The crrd daemon client (protocol in crrdd.h).
+ *
+ * Samples are batched into a message of up to CRRDD_BATCH, built in
+ * place, and sent with the header in one gathered write when it is
+ * full or flushed. Requests that want a reply flush first, then wait
+ * for it; replies come back in order, so the next reply read is ours.
+ *
+ * With a shared ring (crrdc_shm), samples are written into its slots
+ * instead, and head is published every DC_PUBLISH samples, on flush,
+ * and before waiting -- so the daemon sees a cache line of samples at a
+ * time, and the bell costs a system call only if the daemon is asleep.
+ * A full ring waits on room, waking every DC_NAP to see whether the
+ * daemon has hung up.
+ *
+ * Errors are the CRRDD_E_ codes, negative. A broken connection is
+ * CRRDD_E_PROTO, and stays broken: close and open again.
+ *
+ * User space only (TESTING).
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE	/* memfd_create, F_ADD_SEALS */
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include "crrd.h"
+#include "crrdd.h"
+
+#define	DC_PUBLISH	64		/* samples between publishing head */
+#define	DC_NAP		100000000	/* ns to wait for room at a time */
+
+struct crrdc {
+	int fd;
+	uint32_t seq;
+	int n;				/* samples batched */
+	crrdd_ring_t *ring;		/* or NULL */
+	size_t rlen;
+	uint64_t mask;
+	uint64_t head;			/* samples written */
+	uint64_t tail;			/* samples taken, as last seen */
+	crrdd_sample_t batch[CRRDD_BATCH];
+};
+
+/*
+ * Send header h and len bytes of body as one message, with descriptor
+ * fd if it is not -1.
+ */
+static int
+dc_send(crrdc_t *c, crrdd_hdr_t *h, const void *body, size_t len, int fd)
+{
+	union {
+		struct cmsghdr h;
+		char b[CMSG_SPACE(sizeof (int))];
+	} ctl;
+	struct cmsghdr *cm;
+	struct iovec iov[2];
+	struct msghdr m;
+	ssize_t n;
+
+	iov[0].iov_base = h;
+	iov[0].iov_len = sizeof (*h);
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = len;
+	memset(&m, 0, sizeof (m));
+	m.msg_iov = iov;
+	m.msg_iovlen = (len > 0) ? 2 : 1;
+	if (fd >= 0) {
+		memset(&ctl, 0, sizeof (ctl));
+		m.msg_control = &ctl;
+		m.msg_controllen = sizeof (ctl);
+		cm = CMSG_FIRSTHDR(&m);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof (int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof (int));
+	}
+	do {
+		n = sendmsg(c->fd, &m, MSG_NOSIGNAL);
+	} while ((n < 0) && (errno == EINTR));
+	return ((n == (ssize_t)(sizeof (*h) + len)) ? 0 : CRRDD_E_PROTO);
+}
+
+/* Send a request, and wait for its reply. Returns the reply status. */
+static int
+dc_call(crrdc_t *c, int op, int flags, const void *body, size_t len,
+    int fd, crrdd_reply_t *rp)
+{
+	struct {
+		crrdd_hdr_t h;
+		crrdd_reply_t r;
+	} in;
+	crrdd_hdr_t h;
+	ssize_t n;
+	int rc;
+
+	rc = crrdc_flush(c);
+	if (rc != 0) {
+		return (rc);
+	}
+	memset(&h, 0, sizeof (h));
+	h.magic = CRRDD_MAGIC;
+	h.op = op;
+	h.flags = flags;
+	h.seq = ++c->seq;
+	rc = dc_send(c, &h, body, len, fd);
+	if (rc != 0) {
+		return (rc);
+	}
+	do {
+		n = recv(c->fd, &in, sizeof (in), 0);
+	} while ((n < 0) && (errno == EINTR));
+	if ((n != sizeof (in)) || (in.h.magic != CRRDD_MAGIC) ||
+	    (in.h.seq != h.seq)) {
+		return (CRRDD_E_PROTO);
+	}
+	*rp = in.r;
+	return (in.r.status);
+}
+
+/* Connect to the daemon at path (CRRDD_PATH if NULL) */
+crrdc_t *
+crrdc_open(const char *path)
+{
+	struct sockaddr_un sa;
+	crrdc_t *c;
+
+	if (path == NULL) {
+		path = CRRDD_PATH;
+	}
+	if (strlen(path) >= sizeof (sa.sun_path)) {
+		return (NULL);
+	}
+	c = malloc(sizeof (crrdc_t));
+	if (c == NULL) {
+		return (NULL);
+	}
+	c->seq = 0;
+	c->n = 0;
+	c->ring = NULL;
+	memset(&sa, 0, sizeof (sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if ((c->fd < 0) ||
+	    (connect(c->fd, (struct sockaddr *)&sa, sizeof (sa)) != 0)) {
+		if (c->fd >= 0) {
+			(void) close(c->fd);
+		}
+		free(c);
+		return (NULL);
+	}
+	return (c);
+}
+
+static int
+dc_series(crrdc_t *c, int op, const char *name, int agg,
+    dbrrd_spec_t *spec)
+{
+	crrdd_create_t req;
+	crrdd_reply_t r;
+	int rc;
+
+	if (strlen(name) >= CRRDD_NAMELEN) {
+		return (CRRDD_E_INVAL);
+	}
+	memset(&req, 0, sizeof (req));
+	strcpy(req.name, name);
+	req.agg = agg;
+	for (; (spec != NULL) && (spec->capacity != 0); ++spec) {
+		if (req.ntiers == CRRDD_TIERS) {
+			return (CRRDD_E_INVAL);
+		}
+		req.tier[req.ntiers].capacity = spec->capacity;
+		req.tier[req.ntiers].tv = spec->tv;
+		++req.ntiers;
+	}
+	rc = dc_call(c, op, 0, &req, sizeof (req), -1, &r);
+	return ((rc == CRRDD_OK) ? (int)r.id : rc);
+}
+
+/*
+ * Create series name, aggregated by agg (CRRDD_AGG_) into tiers as
+ * for dbrrd_create. If it exists with the same layout, that is fine.
+ * Returns the series id, or a CRRDD_E_ status.
+ */
+int
+crrdc_create(crrdc_t *c, const char *name, int agg, dbrrd_spec_t *spec)
+{
+	return (dc_series(c, CRRDD_OP_CREATE, name, agg, spec));
+}
+
+/* The id of series name, or CRRDD_E_NOENT */
+int
+crrdc_lookup(crrdc_t *c, const char *name)
+{
+	return (dc_series(c, CRRDD_OP_LOOKUP, name, 0, NULL));
+}
+
+/* Make the ring's samples visible, and ring the bell if need be */
+static void
+dc_publish(crrdc_t *c)
+{
+	crrdd_ring_t *r = c->ring;
+
+	__atomic_store_n(&r->head, c->head, __ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&r->bell, __ATOMIC_SEQ_CST) == 1) &&
+	    (__atomic_exchange_n(&r->bell, 0, __ATOMIC_SEQ_CST) == 1)) {
+		(void) syscall(SYS_futex, &r->bell, FUTEX_WAKE, 1, NULL,
+		    NULL, 0);
+	}
+}
+
+/*
+ * Publish, and wait until no more than most samples are left in the
+ * ring. Returns 0, or CRRDD_E_PROTO if the daemon has gone.
+ */
+static int
+dc_wait(crrdc_t *c, uint64_t most)
+{
+	crrdd_ring_t *r = c->ring;
+	struct timespec ts;
+	struct pollfd p;
+
+	dc_publish(c);
+	for (;;) {
+		c->tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (c->head - c->tail <= most) {
+			return (0);
+		}
+		/* Ask to be woken, look again, then sleep */
+		__atomic_store_n(&r->room, 1, __ATOMIC_SEQ_CST);
+		c->tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+		if (c->head - c->tail <= most) {
+			return (0);
+		}
+		ts.tv_sec = 0;
+		ts.tv_nsec = DC_NAP;
+		if ((syscall(SYS_futex, &r->room, FUTEX_WAIT, 1, &ts, NULL,
+		    0) != 0) && (errno == ETIMEDOUT)) {
+			p.fd = c->fd;
+			p.events = 0;
+			if ((poll(&p, 1, 0) != 0) &&
+			    (p.revents & (POLLHUP | POLLERR))) {
+				return (CRRDD_E_PROTO);
+			}
+		}
+	}
+}
+
+/*
+ * Hand the daemon a shared ring of slots samples (a power of two), and
+ * send samples through it from now on. Returns 0, or a CRRDD_E_ status;
+ * CRRDD_E_EXIST if there is a ring already.
+ */
+int
+crrdc_shm(crrdc_t *c, int slots)
+{
+	crrdd_ring_t *r;
+	crrdd_reply_t rp;
+	size_t len;
+	int fd, rc;
+
+	if ((slots <= 0) || ((slots & (slots - 1)) != 0)) {
+		return (CRRDD_E_INVAL);
+	}
+	if (c->ring != NULL) {
+		return (CRRDD_E_EXIST);
+	}
+	len = sizeof (crrdd_ring_t) + (size_t)slots * sizeof (crrdd_sample_t);
+	fd = memfd_create("crrdc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		return (CRRDD_E_NOMEM);
+	}
+	/* Sealed, so the daemon can trust the size it maps */
+	if ((ftruncate(fd, len) != 0) || (fcntl(fd, F_ADD_SEALS,
+	    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)) {
+		(void) close(fd);
+		return (CRRDD_E_NOMEM);
+	}
+	r = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (r == MAP_FAILED) {
+		(void) close(fd);
+		return (CRRDD_E_NOMEM);
+	}
+	r->magic = CRRDD_RING_MAGIC;
+	r->slots = slots;
+	rc = dc_call(c, CRRDD_OP_SHM, 0, NULL, 0, fd, &rp);
+	(void) close(fd);
+	if (rc != CRRDD_OK) {
+		(void) munmap(r, len);
+		return (rc);
+	}
+	c->ring = r;
+	c->rlen = len;
+	c->mask = slots - 1;
+	c->head = c->tail = 0;
+	return (0);
+}
+
+/* Add a sample to the ring, or to the batch, sending it if it is full */
+int
+crrdc_add(crrdc_t *c, uint32_t id, hrtime_t t, double v)
+{
+	crrdd_sample_t *s;
+	int rc;
+
+	if (c->ring != NULL) {
+		if ((c->head - c->tail > c->mask) &&
+		    ((rc = dc_wait(c, c->mask)) != 0)) {
+			return (rc);
+		}
+		s = &c->ring->slot[c->head & c->mask];
+		s->id = id;
+		s->pad = 0;
+		s->t = t;
+		s->v = v;
+		if ((++c->head & (DC_PUBLISH - 1)) == 0) {
+			dc_publish(c);
+		}
+		return (0);
+	}
+	if (c->n == (int)CRRDD_BATCH) {
+		rc = crrdc_flush(c);
+		if (rc != 0) {
+			return (rc);
+		}
+	}
+	s = &c->batch[c->n++];
+	s->id = id;
+	s->pad = 0;
+	s->t = t;
+	s->v = v;
+	return (0);
+}
+
+/* Send the batch, and publish the ring */
+int
+crrdc_flush(crrdc_t *c)
+{
+	crrdd_hdr_t h;
+	int rc;
+
+	if (c->ring != NULL) {
+		dc_publish(c);
+	}
+	if (c->n == 0) {
+		return (0);
+	}
+	memset(&h, 0, sizeof (h));
+	h.magic = CRRDD_MAGIC;
+	h.op = CRRDD_OP_ADD;
+	h.seq = ++c->seq;
+	h.count = c->n;
+	rc = dc_send(c, &h, c->batch, c->n * sizeof (crrdd_sample_t), -1);
+	c->n = 0;
+	return (rc);
+}
+
+/*
+ * Flush, and wait until the daemon has taken everything sent or put in
+ * the ring. *taken (if not NULL) is the number of samples taken from
+ * this connection, which leaves out those for ids that do not exist.
+ */
+int
+crrdc_sync(crrdc_t *c, uint64_t *taken)
+{
+	crrdd_reply_t r;
+	int rc;
+
+	if ((c->ring != NULL) && ((rc = dc_wait(c, 0)) != 0)) {
+		return (rc);
+	}
+	rc = dc_call(c, CRRDD_OP_ADD, CRRDD_F_ACK, NULL, 0, -1, &r);
+	if ((rc == CRRDD_OK) && (taken != NULL)) {
+		*taken = r.count;
+	}
+	return (rc);
+}
+
+/*
+ * Query series id at time t, as dbrrd_query. Returns 1 with *v and
+ * *res, 0 if there is nothing at t, or a CRRDD_E_ status.
+ */
+int
+crrdc_query(crrdc_t *c, uint32_t id, hrtime_t t, double *v, hrtime_t *res)
+{
+	crrdd_query_t q;
+	crrdd_reply_t r;
+	int rc;
+
+	memset(&q, 0, sizeof (q));
+	q.id = id;
+	q.t = t;
+	rc = dc_call(c, CRRDD_OP_QUERY, 0, &q, sizeof (q), -1, &r);
+	if (rc == CRRDD_E_NOENT) {
+		return (0);
+	}
+	if (rc != CRRDD_OK) {
+		return (rc);
+	}
+	*v = r.v;
+	*res = r.res;
+	return (1);
+}
+
+/* Flush, let the daemon drain the ring, and disconnect */
+void
+crrdc_close(crrdc_t *c)
+{
+	if (c) {
+		(void) crrdc_flush(c);
+		if (c->ring != NULL) {
+			(void) dc_wait(c, 0);
+			(void) munmap(c->ring, c->rlen);
+		}
+		(void) close(c->fd);
+		free(c);
+	}
+}
@@ -0,0 +1,927 @@
+/*
+ * crrdd.c
+ *
+ * The crrd daemon: a registry of dbrrds served over a Unix domain
+ * socket (the protocol is in crrdd.h).
+ *
+ * One thread, one epoll set: the listening socket, every client, and
+ * an eventfd that crrdd_stop() writes to. A readable client is drained
+ * with recvmmsg(), up to DD_RECV messages a call into buffers set up
+ * once, and each sample of an ADD goes straight to dbrrd_add_at() --
+ * there is no queue and no copy between the socket and the rrds. A
+ * message is a whole batch (CRRDD_BATCH samples at most), so at full
+ * batches one system call brings in tens of thousands of samples.
+ * Replies are gathered from the header and the body in one sendmsg()
+ * (MSG_NOSIGNAL: a client that has gone away is an error, not a
+ * SIGPIPE). It never waits (MSG_DONTWAIT): it is made under the lock,
+ * so a client that does not read its replies would hold up every
+ * other; a reply that cannot go out at once closes the client.
+ *
+ * A client may also hand over a shared ring (CRRDD_OP_SHM): it gets a
+ * thread of its own, which sleeps on the ring's bell while the ring is
+ * empty and otherwise takes up to DD_DRAIN samples at a time straight
+ * from the shared slots into dbrrd_add_at(). The rrds and the registry
+ * are shared with the epoll thread, under one lock, taken once per
+ * batch of messages or of ring samples. The memfd must be sealed
+ * against shrinking, so that a client cannot pull the mapping out from
+ * under the daemon; the ring's indices are only trusted as far as the
+ * mask allows.
+ *
+ * Series are kept in an array indexed by id, with an open addressed
+ * hash of their names (FNV-1a) for CREATE and LOOKUP. Each series is
+ * a dbrrd of doubles with the fill kind of its aggregation, and lazy
+ * gaps (rrd_setfill, rrd_setlazy): a series that goes quiet costs
+ * nothing until it is written again.
+ *
+ * Built with CRRDD_MAIN, this is the daemon itself:
+ *
+ *   crrdd [-s path]
+ *
+ * serving on path (CRRDD_PATH by default) until SIGINT or SIGTERM.
+ *
+ * User space only (TESTING).
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE	/* recvmmsg, accept4, F_GET_SEALS */
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "crrd.h"
+#include "crrdd.h"
+
+#define	DD_RECV		32	/* messages per recvmmsg() */
+#define	DD_EVENTS	64	/* events per epoll_wait() */
+#define	DD_DRAIN	4096	/* ring samples per hold of the lock */
+
+typedef struct dd_series {
+	char name[CRRDD_NAMELEN];
+	uint32_t agg;
+	uint32_t ntiers;
+	crrdd_tier_t tier[CRRDD_TIERS];
+	rrd_t *h;
+} dd_series_t;
+
+typedef struct dd_ring {
+	crrdd_ring_t *r;		/* shared with the client */
+	size_t len;
+	uint64_t mask;			/* slots - 1, as it was mapped */
+	uint64_t tail;
+	int stop;
+	pthread_t thread;
+	struct crrdd *d;
+	struct dd_client *c;
+} dd_ring_t;
+
+typedef struct dd_client {
+	int fd;
+	uint64_t taken;			/* samples taken from this client */
+	int dead;			/* a reply failed: close it */
+	dd_ring_t *ring;
+	struct dd_client *next;
+	struct dd_client *prev;
+} dd_client_t;
+
+struct crrdd {
+	int lfd;			/* listening */
+	int ep;				/* epoll */
+	int wake;			/* eventfd, for crrdd_stop */
+	char path[sizeof (((struct sockaddr_un *)0)->sun_path)];
+	dd_series_t **series;		/* by id */
+	int nseries;
+	int maxseries;
+	uint32_t *hash;			/* id + 1, 0 for empty */
+	unsigned hsize;			/* a power of two */
+	dd_client_t *clients;
+	pthread_mutex_t lock;		/* series, and rings against epoll */
+	char *buf;			/* DD_RECV messages */
+	struct mmsghdr msg[DD_RECV];
+	struct iovec iov[DD_RECV];
+	union {
+		struct cmsghdr h;
+		char b[CMSG_SPACE(sizeof (int))];
+	} ctl[DD_RECV];			/* a descriptor per message */
+};
+
+/*
+ * Aggregations of doubles. The zero()s are what the fill kinds set
+ * for each do (dd_agg), and are only there for completeness.
+ */
+static void
+dd_sum_update(rrd_t *r, void *pv)
+{
+	*(double *)rrd_entry(r, rrd_tail(r)) += *(double *)pv;
+}
+
+static void
+dd_min_update(rrd_t *r, void *pv)
+{
+	double *e = rrd_entry(r, rrd_tail(r));
+
+	if (*(double *)pv < *e) {
+		*e = *(double *)pv;
+	}
+}
+
+static void
+dd_max_update(rrd_t *r, void *pv)
+{
+	double *e = rrd_entry(r, rrd_tail(r));
+
+	if (*(double *)pv > *e) {
+		*e = *(double *)pv;
+	}
+}
+
+static void
+dd_last_update(rrd_t *r, void *pv)
+{
+	*(double *)rrd_entry(r, rrd_tail(r)) = *(double *)pv;
+}
+
+static void
+dd_sum_zero(rrd_t *r, void *pv)
+{
+	pv = pv;
+	*(double *)rrd_entry(r, rrd_tail(r)) = 0;
+}
+
+static void
+dd_value_zero(rrd_t *r, void *pv)
+{
+	*(double *)rrd_entry(r, rrd_tail(r)) = *(double *)pv;
+}
+
+static void
+dd_prev_zero(rrd_t *r, void *pv)
+{
+	int n;
+
+	pv = pv;
+	n = (rrd_tail(r) == 0) ? rrd_capacity(r) - 1 : rrd_tail(r) - 1;
+	*(double *)rrd_entry(r, rrd_tail(r)) = *(double *)rrd_entry(r, n);
+}
+
+static const double dd_zero_value = 0;
+
+static const struct {
+	void *update;
+	void *zero;
+	int fill;
+} dd_agg[] = {
+	{ dd_sum_update,  dd_sum_zero,   RRD_FILL_CONST },
+	{ dd_min_update,  dd_value_zero, RRD_FILL_VALUE },
+	{ dd_max_update,  dd_value_zero, RRD_FILL_VALUE },
+	{ dd_last_update, dd_prev_zero,  RRD_FILL_PREV },
+};
+
+static uint32_t
+dd_fnv(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *s; ++s) {
+		h ^= (unsigned char)*s;
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+/* Id of the series called name, or -1 */
+static int
+dd_find(crrdd_t *d, const char *name)
+{
+	unsigned i = dd_fnv(name) & (d->hsize - 1);
+	uint32_t e;
+
+	while ((e = d->hash[i]) != 0) {
+		if (strcmp(d->series[e - 1]->name, name) == 0) {
+			return (e - 1);
+		}
+		i = (i + 1) & (d->hsize - 1);
+	}
+	return (-1);
+}
+
+static void
+dd_hash_insert(uint32_t *hash, unsigned hsize, const char *name,
+    uint32_t id)
+{
+	unsigned i = dd_fnv(name) & (hsize - 1);
+
+	while (hash[i] != 0) {
+		i = (i + 1) & (hsize - 1);
+	}
+	hash[i] = id + 1;
+}
+
+/* Make room for one more series. Returns 0, or -1 if out of memory. */
+static int
+dd_grow(crrdd_t *d)
+{
+	dd_series_t **s;
+	uint32_t *hash;
+	unsigned hsize;
+
+	if (d->nseries == d->maxseries) {
+		s = realloc(d->series, 2 * d->maxseries * sizeof (*s));
+		if (s == NULL) {
+			return (-1);
+		}
+		d->series = s;
+		d->maxseries *= 2;
+	}
+	/* Keep the hash at most half full */
+	if (2 * (d->nseries + 1) > d->hsize) {
+		hsize = 2 * d->hsize;
+		hash = calloc(hsize, sizeof (uint32_t));
+		if (hash == NULL) {
+			return (-1);
+		}
+		for (int i = 0; i < d->nseries; ++i) {
+			dd_hash_insert(hash, hsize, d->series[i]->name, i);
+		}
+		free(d->hash);
+		d->hash = hash;
+		d->hsize = hsize;
+	}
+	return (0);
+}
+
+/* CREATE (or LOOKUP, if lookup): the id, or a CRRDD_E_ status */
+static int
+dd_create_series(crrdd_t *d, const crrdd_create_t *c, int lookup)
+{
+	dbrrd_spec_t spec[CRRDD_TIERS + 1];
+	dd_series_t *s;
+	int id;
+
+	if (memchr(c->name, '\0', CRRDD_NAMELEN) == NULL) {
+		return (CRRDD_E_INVAL);
+	}
+	id = dd_find(d, c->name);
+	if (lookup) {
+		return ((id < 0) ? CRRDD_E_NOENT : id);
+	}
+	if ((c->name[0] == '\0') || (c->agg > CRRDD_AGG_LAST) ||
+	    (c->ntiers == 0) || (c->ntiers > CRRDD_TIERS)) {
+		return (CRRDD_E_INVAL);
+	}
+	if (id >= 0) {
+		s = d->series[id];
+		if ((s->agg != c->agg) || (s->ntiers != c->ntiers) ||
+		    (memcmp(s->tier, c->tier,
+		    c->ntiers * sizeof (crrdd_tier_t)) != 0)) {
+			return (CRRDD_E_EXIST);
+		}
+		return (id);
+	}
+	for (uint32_t i = 0; i < c->ntiers; ++i) {
+		spec[i].capacity = c->tier[i].capacity;
+		spec[i].tv = c->tier[i].tv;
+		if ((spec[i].capacity <= 0) ||
+		    (spec[i].capacity > CRRDD_MAXCAP)) {
+			return (CRRDD_E_INVAL);
+		}
+	}
+	spec[c->ntiers].capacity = 0;
+	spec[c->ntiers].tv = 0;
+	if (!dbrrd_spec_check(spec)) {
+		return (CRRDD_E_INVAL);
+	}
+	if (d->nseries >= CRRDD_MAXSERIES) {
+		return (CRRDD_E_FULL);
+	}
+	if (dd_grow(d) != 0) {
+		return (CRRDD_E_NOMEM);
+	}
+	s = calloc(1, sizeof (dd_series_t));
+	if (s == NULL) {
+		return (CRRDD_E_NOMEM);
+	}
+	memcpy(s->name, c->name, CRRDD_NAMELEN);
+	s->agg = c->agg;
+	s->ntiers = c->ntiers;
+	memcpy(s->tier, c->tier, c->ntiers * sizeof (crrdd_tier_t));
+	s->h = dbrrd_create(s->name, spec, sizeof (double),
+	    dd_agg[c->agg].update, dd_agg[c->agg].zero);
+	if (s->h == NULL) {
+		free(s);
+		return (CRRDD_E_NOMEM);
+	}
+	(void) dbrrd_setfill(s->h, dd_agg[c->agg].fill, &dd_zero_value);
+	(void) dbrrd_setlazy(s->h, 1);
+	id = d->nseries++;
+	d->series[id] = s;
+	dd_hash_insert(d->hash, d->hsize, s->name, id);
+	return (id);
+}
+
+static void
+dd_reply(dd_client_t *c, const crrdd_hdr_t *h, crrdd_reply_t *rp)
+{
+	crrdd_hdr_t rh = *h;
+	struct iovec iov[2];
+	struct msghdr m;
+
+	rh.magic = CRRDD_MAGIC;
+	rh.count = 0;
+	iov[0].iov_base = &rh;
+	iov[0].iov_len = sizeof (rh);
+	iov[1].iov_base = rp;
+	iov[1].iov_len = sizeof (*rp);
+	memset(&m, 0, sizeof (m));
+	m.msg_iov = iov;
+	m.msg_iovlen = 2;
+	/* Never wait, with the lock held: a full socket ends the client */
+	if (sendmsg(c->fd, &m, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+		c->dead = 1;
+	}
+}
+
+static void
+dd_futex(uint32_t *p, int op, uint32_t v)
+{
+	(void) syscall(SYS_futex, p, op, v, NULL, NULL, 0);
+}
+
+/* A ring's thread: drain it into the rrds until told to stop */
+static void *
+dd_drain(void *arg)
+{
+	dd_ring_t *g = arg;
+	crrdd_ring_t *r = g->r;
+	crrdd_t *d = g->d;
+	crrdd_sample_t s;
+	uint64_t head, n;
+
+	while (!__atomic_load_n(&g->stop, __ATOMIC_SEQ_CST)) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head == g->tail) {
+			/* Empty: ask to be woken, look again, then sleep */
+			__atomic_store_n(&r->bell, 1, __ATOMIC_SEQ_CST);
+			if (!__atomic_load_n(&g->stop, __ATOMIC_SEQ_CST) &&
+			    (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) ==
+			    g->tail)) {
+				dd_futex(&r->bell, FUTEX_WAIT, 1);
+			}
+			__atomic_store_n(&r->bell, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		n = head - g->tail;
+		if (n > g->mask + 1) {
+			/* Not a ring any more; stop taking from it */
+			break;
+		}
+		if (n > DD_DRAIN) {
+			n = DD_DRAIN;
+		}
+		pthread_mutex_lock(&d->lock);
+		for (; n > 0; --n, ++g->tail) {
+			/* A copy: the client can scribble on the slot */
+			s = r->slot[g->tail & g->mask];
+			if (s.id < (uint32_t)d->nseries) {
+				dbrrd_add_at(d->series[s.id]->h, &s.v, s.t);
+				++g->c->taken;
+			}
+		}
+		pthread_mutex_unlock(&d->lock);
+		__atomic_store_n(&r->tail, g->tail, __ATOMIC_SEQ_CST);
+		if ((__atomic_load_n(&r->room, __ATOMIC_SEQ_CST) == 1) &&
+		    (__atomic_exchange_n(&r->room, 0, __ATOMIC_SEQ_CST) == 1)) {
+			dd_futex(&r->room, FUTEX_WAKE, 1);
+		}
+	}
+	return (NULL);
+}
+
+/* SHM: map the ring in memfd fd, and start draining it */
+static int
+dd_attach(crrdd_t *d, dd_client_t *c, int fd)
+{
+	struct stat st;
+	crrdd_ring_t *r;
+	dd_ring_t *g;
+	uint32_t slots;
+	int seals;
+
+	if (fd < 0) {
+		return (CRRDD_E_PROTO);
+	}
+	if (c->ring != NULL) {
+		(void) close(fd);
+		return (CRRDD_E_EXIST);
+	}
+	seals = fcntl(fd, F_GET_SEALS);
+	if ((fstat(fd, &st) != 0) || (seals < 0) ||
+	    !(seals & F_SEAL_SHRINK) ||
+	    (st.st_size < (off_t)sizeof (crrdd_ring_t))) {
+		(void) close(fd);
+		return (CRRDD_E_INVAL);
+	}
+	r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if (r == MAP_FAILED) {
+		return (CRRDD_E_NOMEM);
+	}
+	slots = r->slots;
+	if ((r->magic != CRRDD_RING_MAGIC) || (slots == 0) ||
+	    ((slots & (slots - 1)) != 0) ||
+	    ((st.st_size - sizeof (crrdd_ring_t)) / sizeof (crrdd_sample_t) <
+	    slots)) {
+		(void) munmap(r, st.st_size);
+		return (CRRDD_E_INVAL);
+	}
+	g = calloc(1, sizeof (dd_ring_t));
+	if (g == NULL) {
+		(void) munmap(r, st.st_size);
+		return (CRRDD_E_NOMEM);
+	}
+	g->r = r;
+	g->len = st.st_size;
+	g->mask = slots - 1;
+	g->tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	g->d = d;
+	g->c = c;
+	if (pthread_create(&g->thread, NULL, dd_drain, g) != 0) {
+		(void) munmap(r, st.st_size);
+		free(g);
+		return (CRRDD_E_NOMEM);
+	}
+	c->ring = g;
+	return (CRRDD_OK);
+}
+
+/* Stop a ring's thread, and unmap it. Not with the lock held. */
+static void
+dd_detach(dd_ring_t *g)
+{
+	__atomic_store_n(&g->stop, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&g->r->bell, 0, __ATOMIC_SEQ_CST);
+	dd_futex(&g->r->bell, FUTEX_WAKE, 1);
+	(void) pthread_join(g->thread, NULL);
+	(void) munmap(g->r, g->len);
+	free(g);
+}
+
+/*
+ * Serve one request of len bytes, with descriptor fd (or -1) passed
+ * along with it. Called with the lock held.
+ */
+static void
+dd_request(crrdd_t *d, dd_client_t *c, const char *p, size_t len, int fd)
+{
+	const crrdd_hdr_t *h = (const crrdd_hdr_t *)p;
+	const crrdd_sample_t *s;
+	const crrdd_query_t *q;
+	crrdd_reply_t r;
+	void *vp;
+	int id;
+
+	memset(&r, 0, sizeof (r));
+	/* No header, so no op or seq to answer to */
+	if (len < sizeof (crrdd_hdr_t)) {
+		if (fd >= 0) {
+			(void) close(fd);
+		}
+		return;
+	}
+	if ((h->magic != CRRDD_MAGIC) ||
+	    ((fd >= 0) && (h->op != CRRDD_OP_SHM))) {
+		if (fd >= 0) {
+			(void) close(fd);
+		}
+		r.status = CRRDD_E_PROTO;
+		dd_reply(c, h, &r);
+		return;
+	}
+	p += sizeof (crrdd_hdr_t);
+	len -= sizeof (crrdd_hdr_t);
+	switch (h->op) {
+	case CRRDD_OP_ADD:
+		if (len != h->count * sizeof (crrdd_sample_t)) {
+			r.status = CRRDD_E_PROTO;
+			break;
+		}
+		s = (const crrdd_sample_t *)p;
+		for (uint32_t i = 0; i < h->count; ++i) {
+			if (s[i].id < (uint32_t)d->nseries) {
+				dbrrd_add_at(d->series[s[i].id]->h,
+				    (void *)&s[i].v, s[i].t);
+				++c->taken;
+			}
+		}
+		if (!(h->flags & CRRDD_F_ACK)) {
+			return;
+		}
+		r.count = c->taken;
+		break;
+	case CRRDD_OP_CREATE:
+	case CRRDD_OP_LOOKUP:
+		if (len != sizeof (crrdd_create_t)) {
+			r.status = CRRDD_E_PROTO;
+			break;
+		}
+		id = dd_create_series(d, (const crrdd_create_t *)p,
+		    h->op == CRRDD_OP_LOOKUP);
+		if (id < 0) {
+			r.status = id;
+		} else {
+			r.id = id;
+		}
+		break;
+	case CRRDD_OP_QUERY:
+		if (len != sizeof (crrdd_query_t)) {
+			r.status = CRRDD_E_PROTO;
+			break;
+		}
+		q = (const crrdd_query_t *)p;
+		if ((q->id >= (uint32_t)d->nseries) ||
+		    !dbrrd_query(d->series[q->id]->h, q->t, &vp, &r.res)) {
+			r.status = CRRDD_E_NOENT;
+			break;
+		}
+		r.id = q->id;
+		r.v = *(double *)vp;
+		break;
+	case CRRDD_OP_SHM:
+		if (len != 0) {
+			if (fd >= 0) {
+				(void) close(fd);
+			}
+			r.status = CRRDD_E_PROTO;
+			break;
+		}
+		r.status = dd_attach(d, c, fd);
+		break;
+	default:
+		r.status = CRRDD_E_PROTO;
+		break;
+	}
+	dd_reply(c, h, &r);
+}
+
+static void
+dd_close(crrdd_t *d, dd_client_t *c)
+{
+	if (c->ring != NULL) {
+		dd_detach(c->ring);
+	}
+	(void) epoll_ctl(d->ep, EPOLL_CTL_DEL, c->fd, NULL);
+	(void) close(c->fd);
+	if (c->prev != NULL) {
+		c->prev->next = c->next;
+	} else {
+		d->clients = c->next;
+	}
+	if (c->next != NULL) {
+		c->next->prev = c->prev;
+	}
+	free(c);
+}
+
+/* The descriptor passed with message m, or -1 */
+static int
+dd_fd(struct msghdr *m)
+{
+	struct cmsghdr *cm;
+	int fd = -1;
+
+	for (cm = CMSG_FIRSTHDR(m); cm != NULL; cm = CMSG_NXTHDR(m, cm)) {
+		if ((cm->cmsg_level == SOL_SOCKET) &&
+		    (cm->cmsg_type == SCM_RIGHTS) &&
+		    (cm->cmsg_len == CMSG_LEN(sizeof (int)))) {
+			memcpy(&fd, CMSG_DATA(cm), sizeof (int));
+		}
+	}
+	return (fd);
+}
+
+/*
+ * Read one batch of messages from a client, and serve them. Returns -1
+ * if the client has gone (or broken the protocol, or not read its
+ * replies) and is to be closed.
+ */
+static int
+dd_read(crrdd_t *d, dd_client_t *c)
+{
+	int n, fd, rc = 0;
+
+	for (int i = 0; i < DD_RECV; ++i) {
+		d->msg[i].msg_hdr.msg_control = &d->ctl[i];
+		d->msg[i].msg_hdr.msg_controllen = sizeof (d->ctl[i]);
+	}
+	do {
+		n = recvmmsg(c->fd, d->msg, DD_RECV,
+		    MSG_DONTWAIT | MSG_CMSG_CLOEXEC, NULL);
+	} while ((n < 0) && (errno == EINTR));
+	if (n < 0) {
+		return (((errno == EAGAIN) || (errno == EWOULDBLOCK)) ?
+		    0 : -1);
+	}
+	pthread_mutex_lock(&d->lock);
+	for (int i = 0; i < n; ++i) {
+		fd = dd_fd(&d->msg[i].msg_hdr);
+		/* A zero length message is the end of the connection */
+		if ((rc != 0) || (d->msg[i].msg_len == 0) ||
+		    (d->msg[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+			if (fd >= 0) {
+				(void) close(fd);
+			}
+			rc = -1;
+			continue;
+		}
+		dd_request(d, c, d->iov[i].iov_base, d->msg[i].msg_len, fd);
+		if (c->dead) {
+			rc = -1;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return ((n == 0) ? -1 : rc);
+}
+
+static void
+dd_accept(crrdd_t *d)
+{
+	struct epoll_event ev;
+	dd_client_t *c;
+	int fd;
+
+	fd = accept4(d->lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	c = calloc(1, sizeof (dd_client_t));
+	if (c == NULL) {
+		(void) close(fd);
+		return;
+	}
+	c->fd = fd;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(d->ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		(void) close(fd);
+		free(c);
+		return;
+	}
+	c->next = d->clients;
+	if (c->next != NULL) {
+		c->next->prev = c;
+	}
+	d->clients = c;
+}
+
+/*
+ * Is there a daemon listening at path? Returns 0 if not (nothing there,
+ * or a socket nobody listens on any more, which is removed), or -1 with
+ * errno EADDRINUSE if there is -- or if path is something else.
+ */
+static int
+dd_stale(const char *path, struct sockaddr_un *sa)
+{
+	struct stat st;
+	int fd, rc;
+
+	if (lstat(path, &st) != 0) {
+		return (0);
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		errno = EADDRINUSE;
+		return (-1);
+	}
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return (-1);
+	}
+	rc = connect(fd, (struct sockaddr *)sa, sizeof (*sa));
+	if ((rc != 0) && (errno == ECONNREFUSED)) {
+		(void) close(fd);
+		(void) unlink(path);
+		return (0);
+	}
+	(void) close(fd);
+	errno = EADDRINUSE;
+	return (-1);
+}
+
+/*
+ * Create a daemon listening on path (CRRDD_PATH if NULL). A socket
+ * left at path by a daemon that is gone is replaced; a live daemon, or
+ * anything else there, is an error (EADDRINUSE).
+ */
+crrdd_t *
+crrdd_create(const char *path)
+{
+	struct sockaddr_un sa;
+	struct epoll_event ev;
+	crrdd_t *d;
+	int e;
+
+	if (path == NULL) {
+		path = CRRDD_PATH;
+	}
+	if (strlen(path) >= sizeof (sa.sun_path)) {
+		return (NULL);
+	}
+	d = calloc(1, sizeof (crrdd_t));
+	if (d == NULL) {
+		return (NULL);
+	}
+	d->lfd = d->ep = d->wake = -1;
+	pthread_mutex_init(&d->lock, NULL);
+	strcpy(d->path, path);
+	d->maxseries = 64;
+	d->hsize = 128;
+	d->series = malloc(d->maxseries * sizeof (dd_series_t *));
+	d->hash = calloc(d->hsize, sizeof (uint32_t));
+	d->buf = malloc((size_t)DD_RECV * CRRDD_MSGMAX);
+	if ((d->series == NULL) || (d->hash == NULL) || (d->buf == NULL)) {
+		goto fail;
+	}
+	for (int i = 0; i < DD_RECV; ++i) {
+		d->iov[i].iov_base = d->buf + (size_t)i * CRRDD_MSGMAX;
+		d->iov[i].iov_len = CRRDD_MSGMAX;
+		d->msg[i].msg_hdr.msg_iov = &d->iov[i];
+		d->msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	memset(&sa, 0, sizeof (sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if (dd_stale(path, &sa) != 0) {
+		goto fail;
+	}
+	d->lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (d->lfd < 0) {
+		goto fail;
+	}
+	if (bind(d->lfd, (struct sockaddr *)&sa, sizeof (sa)) != 0) {
+		/* Not ours to remove: crrdd_destroy() must not unlink it */
+		(void) close(d->lfd);
+		d->lfd = -1;
+		goto fail;
+	}
+	if (listen(d->lfd, SOMAXCONN) != 0) {
+		goto fail;
+	}
+	d->ep = epoll_create1(EPOLL_CLOEXEC);
+	d->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ((d->ep < 0) || (d->wake < 0)) {
+		goto fail;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &d->lfd;
+	if (epoll_ctl(d->ep, EPOLL_CTL_ADD, d->lfd, &ev) != 0) {
+		goto fail;
+	}
+	ev.data.ptr = &d->wake;
+	if (epoll_ctl(d->ep, EPOLL_CTL_ADD, d->wake, &ev) != 0) {
+		goto fail;
+	}
+	return (d);
+fail:
+	e = errno;
+	crrdd_destroy(d);
+	errno = e;
+	return (NULL);
+}
+
+/* Serve until crrdd_stop(). Returns 0, or -1 if epoll fails. */
+int
+crrdd_run(crrdd_t *d)
+{
+	struct epoll_event ev[DD_EVENTS];
+	uint64_t v;
+	int n;
+
+	for (;;) {
+		n = epoll_wait(d->ep, ev, DD_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (-1);
+		}
+		for (int i = 0; i < n; ++i) {
+			if (ev[i].data.ptr == &d->wake) {
+				(void) read(d->wake, &v, sizeof (v));
+				return (0);
+			}
+			if (ev[i].data.ptr == &d->lfd) {
+				dd_accept(d);
+				continue;
+			}
+			if (dd_read(d, ev[i].data.ptr) != 0) {
+				dd_close(d, ev[i].data.ptr);
+			}
+		}
+	}
+}
+
+/* Make crrdd_run() return. Safe from a signal handler. */
+void
+crrdd_stop(crrdd_t *d)
+{
+	uint64_t one = 1;
+
+	(void) write(d->wake, &one, sizeof (one));
+}
+
+int
+crrdd_nseries(crrdd_t *d)
+{
+	return (d->nseries);
+}
+
+/* Close every client, destroy every series, and remove the socket */
+void
+crrdd_destroy(crrdd_t *d)
+{
+	if (d) {
+		while (d->clients != NULL) {
+			dd_close(d, d->clients);
+		}
+		for (int i = 0; i < d->nseries; ++i) {
+			dbrrd_destroy(d->series[i]->h);
+			free(d->series[i]);
+		}
+		if (d->lfd >= 0) {
+			(void) close(d->lfd);
+			(void) unlink(d->path);
+		}
+		if (d->ep >= 0) {
+			(void) close(d->ep);
+		}
+		if (d->wake >= 0) {
+			(void) close(d->wake);
+		}
+		free(d->series);
+		free(d->hash);
+		free(d->buf);
+		pthread_mutex_destroy(&d->lock);
+		free(d);
+	}
+}
+
+#ifdef CRRDD_MAIN
+#include <signal.h>
+#include <getopt.h>
+
+static crrdd_t *dd_main;
+
+static void
+dd_signal(int sig)
+{
+	sig = sig;
+	crrdd_stop(dd_main);
+}
+
+int
+main(int ac, char **av)
+{
+	struct sigaction sa;
+	char *path = CRRDD_PATH;
+	int c, rc;
+
+	while ((c = getopt(ac, av, "s:")) != -1) {
+		switch (c) {
+		case 's':
+			path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: crrdd [-s path]\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	dd_main = crrdd_create(path);
+	if (dd_main == NULL) {
+		fprintf(stderr, "crrdd: cannot serve on %s: %s\n", path,
+		    strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	memset(&sa, 0, sizeof (sa));
+	sa.sa_handler = dd_signal;
+	(void) sigaction(SIGINT, &sa, NULL);
+	(void) sigaction(SIGTERM, &sa, NULL);
+	rc = crrdd_run(dd_main);
+	crrdd_destroy(dd_main);
+	return ((rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+#endif
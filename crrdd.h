@@ -0,0 +1,193 @@
+/*
+ * crrdd.h
+ *
+ * crrdd, the crrd daemon: one process owning a registry of dbrrds,
+ * fed by any number of clients over a Unix domain socket, so that
+ * processes that want the same series share one copy of it.
+ *
+ * The protocol is binary, one request per message: the socket is
+ * SOCK_SEQPACKET, so message boundaries are kept and a request never
+ * needs reassembling. Every message starts with a crrdd_hdr_t, and
+ * every reply is a crrdd_hdr_t (op and seq of the request) followed by
+ * a crrdd_reply_t.
+ *
+ *   CRRDD_OP_CREATE   crrdd_create_t: name, aggregation and tiers.
+ *                     Replies with the series id; a series that
+ *                     already exists under the name is just looked up.
+ *                     A tier may have up to CRRDD_MAXCAP slots, and
+ *                     the daemon holds up to CRRDD_MAXSERIES series
+ *                     (CRRDD_E_FULL past that).
+ *   CRRDD_OP_LOOKUP   crrdd_create_t, only the name is read. Replies
+ *                     with the id, or CRRDD_E_NOENT.
+ *   CRRDD_OP_ADD      count crrdd_sample_t. No reply, unless the
+ *                     CRRDD_F_ACK flag is set: then the reply's count
+ *                     is every sample the connection has had taken.
+ *   CRRDD_OP_QUERY    crrdd_query_t. Replies with the value, and the
+ *                     resolution of the tier that answered, as
+ *                     dbrrd_query; CRRDD_E_NOENT if there is none.
+ *   CRRDD_OP_SHM      No body, and a memfd holding a crrdd_ring_t
+ *                     passed with SCM_RIGHTS. The daemon maps it and
+ *                     drains it for as long as the connection lasts.
+ *
+ * A shared ring is a single producer, single consumer queue of samples
+ * in memory both sides map: the client writes slots and moves head,
+ * the daemon (a thread per ring) adds them and moves tail, and neither
+ * makes a system call while the other keeps up. Each side sleeps on a
+ * futex in the ring when it has to wait -- the daemon on bell when the
+ * ring is empty, the client on room when it is full -- and sets it to
+ * 1 first; the other side, having moved its index, wakes it if it
+ * finds it 1. Ring samples and socket samples are not ordered with
+ * respect to each other.
+ *
+ * A message too short for a header has no op or seq to answer to, and
+ * is dropped without a reply.
+ *
+ * Values are doubles, aggregated per period as CRRDD_AGG_ says. Series
+ * ids are small integers, handed out in order and never reused.
+ *
+ * Everything is host byte order: this is a local socket.
+ *
+ * User space only (TESTING).
+ */
+
+#ifndef _CRRDD_H
+#define	_CRRDD_H
+
+#include <stdint.h>
+#include "crrd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	CRRDD_PATH	"/tmp/crrdd.sock"	/* default socket */
+#define	CRRDD_MAGIC	0x64647263		/* "crdd" */
+#define	CRRDD_MSGMAX	65536			/* largest message */
+#define	CRRDD_NAMELEN	64
+#define	CRRDD_TIERS	8
+#define	CRRDD_MAXCAP	(1 << 20)		/* slots in a tier */
+#define	CRRDD_MAXSERIES	(1 << 20)		/* series in a daemon */
+
+/* Ops */
+#define	CRRDD_OP_CREATE	1
+#define	CRRDD_OP_LOOKUP	2
+#define	CRRDD_OP_ADD	3
+#define	CRRDD_OP_QUERY	4
+#define	CRRDD_OP_SHM	5
+
+/* Flags */
+#define	CRRDD_F_ACK	0x1	/* reply to an ADD */
+
+/* Aggregations: what a period holds */
+#define	CRRDD_AGG_SUM	0	/* sum of the samples; gaps are 0 */
+#define	CRRDD_AGG_MIN	1	/* smallest; gaps take the next sample */
+#define	CRRDD_AGG_MAX	2	/* largest; gaps take the next sample */
+#define	CRRDD_AGG_LAST	3	/* last sample; gaps repeat the previous */
+
+/* Reply status */
+#define	CRRDD_OK	0
+#define	CRRDD_E_PROTO	(-1)	/* malformed request */
+#define	CRRDD_E_NOENT	(-2)	/* no such series, or no such period */
+#define	CRRDD_E_INVAL	(-3)	/* bad spec, aggregation or name */
+#define	CRRDD_E_NOMEM	(-4)
+#define	CRRDD_E_EXIST	(-5)	/* name exists with another layout */
+#define	CRRDD_E_FULL	(-6)	/* CRRDD_MAXSERIES series already */
+
+typedef struct crrdd_hdr {
+	uint32_t magic;
+	uint16_t op;
+	uint16_t flags;
+	uint32_t seq;		/* echoed in the reply */
+	uint32_t count;		/* samples, for CRRDD_OP_ADD */
+} crrdd_hdr_t;
+
+typedef struct crrdd_sample {
+	uint32_t id;
+	uint32_t pad;
+	hrtime_t t;
+	double v;
+} crrdd_sample_t;
+
+/* Samples that fit in one message */
+#define	CRRDD_BATCH	\
+	((CRRDD_MSGMAX - sizeof (crrdd_hdr_t)) / sizeof (crrdd_sample_t))
+
+typedef struct crrdd_tier {
+	int64_t tv;		/* resolution */
+	int32_t capacity;
+	int32_t pad;
+} crrdd_tier_t;
+
+typedef struct crrdd_create {
+	char name[CRRDD_NAMELEN];	/* NUL terminated */
+	uint32_t agg;
+	uint32_t ntiers;
+	crrdd_tier_t tier[CRRDD_TIERS];	/* coarsest first */
+} crrdd_create_t;
+
+typedef struct crrdd_query {
+	uint32_t id;
+	uint32_t pad;
+	hrtime_t t;
+} crrdd_query_t;
+
+#define	CRRDD_RING_MAGIC	0x676e6972		/* "ring" */
+
+/* A shared ring: this header, then slots samples (a power of two) */
+typedef struct crrdd_ring {
+	uint32_t magic;
+	uint32_t slots;
+	/* The client's line */
+	uint64_t head __attribute__((aligned(64)));	/* samples written */
+	uint32_t room;		/* futex: 1 while the client waits */
+	/* The daemon's line */
+	uint64_t tail __attribute__((aligned(64)));	/* samples taken */
+	uint32_t bell;		/* futex: 1 while the daemon waits */
+	crrdd_sample_t slot[] __attribute__((aligned(64)));
+} crrdd_ring_t;
+
+typedef struct crrdd_reply {
+	int32_t status;		/* CRRDD_OK or CRRDD_E_ */
+	uint32_t id;		/* CREATE, LOOKUP */
+	hrtime_t res;		/* QUERY */
+	double v;		/* QUERY */
+	uint64_t count;		/* ADD with CRRDD_F_ACK */
+} crrdd_reply_t;
+
+/*
+ * The daemon (crrdd.c). crrdd_run() serves until crrdd_stop(), which
+ * may be called from another thread or a signal handler.
+ */
+typedef struct crrdd crrdd_t;
+
+crrdd_t *crrdd_create(const char *path);
+int crrdd_run(crrdd_t *d);
+void crrdd_stop(crrdd_t *d);
+int crrdd_nseries(crrdd_t *d);
+void crrdd_destroy(crrdd_t *d);
+
+/*
+ * The client (crrdc.c). Samples are batched, and sent when a message
+ * is full, on crrdc_flush(), or before any request that waits for a
+ * reply, so a client's requests are seen in the order it made them.
+ * After crrdc_shm(), samples go through a shared ring instead.
+ */
+typedef struct crrdc crrdc_t;
+
+crrdc_t *crrdc_open(const char *path);
+int crrdc_create(crrdc_t *c, const char *name, int agg,
+	dbrrd_spec_t *spec);
+int crrdc_lookup(crrdc_t *c, const char *name);
+int crrdc_add(crrdc_t *c, uint32_t id, hrtime_t t, double v);
+int crrdc_flush(crrdc_t *c);
+int crrdc_shm(crrdc_t *c, int slots);
+int crrdc_sync(crrdc_t *c, uint64_t *taken);
+int crrdc_query(crrdc_t *c, uint32_t id, hrtime_t t, double *v,
+	hrtime_t *res);
+void crrdc_close(crrdc_t *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CRRDD_H */
@@ -33,10 +33,26 @@
  * From an idea by Allan Jude
  */
 
-#define _XOPEN_SOURCE
-#define TESTING
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+#ifndef TESTING
+#  define TESTING
+#endif
 
 #include "crrd.c"
+#include "crrd_group.c"
+#include "crrd_wheel.c"
+#include "crrd_pool.c"
+#include "crrd_metrics.c"
+#include "crrd_reorder.c"
+#include "crrd_ticker.c"
+#include "crrd_txg.c"
+#include "crrd_line.c"
+#include "crrd_statsd.c"
+#include "crrdd.c"
+#include "crrdc.c"
+
+#include <math.h>
 
 /*
  * Two macros:
@@ -109,12 +125,15 @@ period_test(void)
 		fprintf(stderr, "  good in    %s %i\n", tests[i].in, tests[i].tperiod);
 		t = HR2SEC(good_start);
 		strftime(buf, 256, "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
-		fprintf(stderr, "  in         %s %lu\n", buf, good_start);
+		fprintf(stderr, "  in         %s %lld\n", buf,
+		    (long long)good_start);
 
-		fprintf(stderr, "  good start %s %lu\n", tests[i].start, good_start);
+		fprintf(stderr, "  good start %s %lld\n", tests[i].start,
+		    (long long)good_start);
 		t = HR2SEC(start);
 		strftime(buf, 256, "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
-		fprintf(stderr, "  start      %s %lu\n", buf, start);
+		fprintf(stderr, "  start      %s %lld\n", buf,
+		    (long long)start);
 	}
 	if (fails != 0) {
 		fprintf(stderr, "failure(s) in period_tests\n");
@@ -334,9 +353,23 @@ dbrrd_test(void)
 		{ 0, 0 }, 
 	};
 
+	/* Misordered, and empty */
+	dbrrd_spec_t bad[] = {
+		{ 100, SEC2HR(1) },
+		{ 100, SEC2HR(10) },
+		{ 0, 0 },
+	};
+
 #define LIMIT 150000
 
 	fprintf(stderr, "dbrrd_test\n");
+	if (dbrrd_spec_check(bad) || dbrrd_spec_check(&bad[2]) ||
+	    !dbrrd_spec_check(dbrrd_periods) ||
+	    (dbrrd_create("bad", bad, sizeof (float), f_update,
+	    f_zero) != NULL)) {
+		fprintf(stderr, "bad spec accepted\n");
+		exit(EXIT_FAILURE);
+	}
 	h = dbrrd_create("dbrrd", dbrrd_periods, sizeof(float),
 		f_update, f_zero);
 
@@ -602,13 +635,11 @@ txg1(rrd_t *h)
 	 */
 #undef LIMIT
 #define LIMIT (60 * 1440 * 365 * 11)
-	fprintf(stderr, "filling in %lu seconds\n", LIMIT);
+	fprintf(stderr, "filling in %d seconds\n", LIMIT);
 	/*
-	 * On my Thinpad 460, 346 896 000 samples are recorded in
-	 * 18.6 seconds. This is 18 650 332 samples per second
-	 *
-	 * As this represents 11 years of txg generation, at one
-	 * txg per second, 18.6 seconds appears reasonable.
+	 * 346 896 000 samples, 11 years of txg generation at one txg
+	 * per second. How long this takes is measured by the txg
+	 * benchmark in bench.c, not here.
 	 */
 	for (i = 60; i < LIMIT; ++i) {
 		tv = SEC2HR(i);
@@ -669,6 +700,240 @@ txg1(rrd_t *h)
 	}
 }
 
+/* Where a txg range lies against txg *key */
+static int
+txg_cmp(const void *entry, const void *key)
+{
+	const txg_store_t *s = entry;
+	uint64_t txg = *(const uint64_t *)key;
+
+	if (s->h < txg)
+		return (-1);
+	if (s->l > txg)
+		return (1);
+	return (0);
+}
+
+/* Every entry holds every key */
+static int
+any_cmp(const void *entry, const void *key)
+{
+	entry = entry;
+	key = key;
+	return (0);
+}
+
+/*
+ * txg2 test
+ *
+ * After txg1, one txg a second for 11 years: txg n was written at
+ * second n - 1. Ask when, and check the answer comes from the finest
+ * tier still holding it.
+ */
+void
+txg2(rrd_t *h)
+{
+	hrtime_t from, to;
+	uint64_t txg;
+	int64_t s;
+	static const struct {
+		int64_t ago;	/* seconds before the newest txg */
+		int64_t res;	/* tier that should answer */
+	} cases[] = {
+		{ 0, 60 },
+		{ 100, 60 },
+		{ 3 * 86400, 86400 },
+		{ 200 * 86400, 86400 },
+		{ 5 * 31536000LL, 31536000 },
+	};
+
+	fprintf(stderr, "txg2\n");
+	for (int i = 0; i < sizeof (cases) / sizeof (cases[0]); ++i) {
+		s = LIMIT - 1 - cases[i].ago;
+		txg = s + 1;
+		if (!dbrrd_find_value(h, &txg, txg_cmp, &from, &to)) {
+			fprintf(stderr, "txg2: txg %lu not found\n", txg);
+			exit(EXIT_FAILURE);
+		}
+		if ((from != find_period(SEC2HR(s), SEC2HR(cases[i].res))) ||
+		    (to != from + SEC2HR(cases[i].res))) {
+			fprintf(stderr, "txg2: txg %lu at %ld..%ld\n", txg,
+			    HR2SEC(from), HR2SEC(to));
+			exit(EXIT_FAILURE);
+		}
+	}
+	/* Not yet written, and aged out */
+	txg = LIMIT + 1;
+	if (dbrrd_find_value(h, &txg, txg_cmp, &from, &to)) {
+		fprintf(stderr, "txg2: found a future txg\n");
+		exit(EXIT_FAILURE);
+	}
+	txg = 1;
+	if (dbrrd_find_value(h, &txg, txg_cmp, &from, &to)) {
+		fprintf(stderr, "txg2: found an aged out txg\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Fold txg range v into *acc */
+static void
+txg_merge(void *acc, const void *v)
+{
+	txg_store_t *a = acc;
+	const txg_store_t *s = v;
+
+	if (s->l < a->l)
+		a->l = s->l;
+	if (s->h > a->h)
+		a->h = s->h;
+}
+
+/*
+ * txg3 test
+ *
+ * The txg range for a span of time, within the minute tier and across
+ * the day and minute tiers, walking every slot and touching only the
+ * two boundary slots. Both must agree.
+ */
+void
+txg3(rrd_t *h)
+{
+	txg_store_t all, ends;
+	hrtime_t from, to;
+	int64_t first, last;
+	static const struct {
+		int64_t from;	/* seconds before the newest txg */
+		int64_t to;
+		int64_t fres;	/* resolution at each end */
+		int64_t tres;
+	} cases[] = {
+		{ 5000, 100, 60, 60 },
+		{ 3 * 86400, 100, 86400, 60 },
+		{ 300 * 86400, 3 * 86400, 86400, 86400 },
+	};
+
+	fprintf(stderr, "txg3\n");
+	for (int i = 0; i < sizeof (cases) / sizeof (cases[0]); ++i) {
+		from = SEC2HR(LIMIT - 1 - cases[i].from);
+		to = SEC2HR(LIMIT - 1 - cases[i].to);
+		if (!dbrrd_query_range(h, from, to, &all, txg_merge, 0) ||
+		    !dbrrd_query_range(h, from, to, &ends, txg_merge, 1)) {
+			fprintf(stderr, "txg3: range %d not found\n", i);
+			exit(EXIT_FAILURE);
+		}
+		/* txg n is second n - 1; the ends are whole slots */
+		first = HR2SEC(find_period(from, SEC2HR(cases[i].fres))) + 1;
+		last = HR2SEC(find_period(to, SEC2HR(cases[i].tres))) +
+		    cases[i].tres;
+		if ((all.l != ends.l) || (all.h != ends.h) ||
+		    (all.l != first) || (all.h != last)) {
+			fprintf(stderr, "txg3: range %d: %lu..%lu and "
+			    "%lu..%lu, wanted %ld..%ld\n", i, all.l, all.h,
+			    ends.l, ends.h, first, last);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * ctxg test
+ *
+ * Compact txg tiers must answer every query as the plain ones do. One
+ * txg a minute for 11 years, with the odd day or week of silence, into
+ * both, and queries every few hours, and every minute of the last day.
+ */
+void
+ctxg_test(dbrrd_spec_t *spec)
+{
+	uint64_t lo, hi;
+	txg_store_t *ptxg, range;
+	hrtime_t tv, res, cres, end;
+	uint64_t txg = 0;
+	rrd_t *h, *c;
+	size_t plain;
+	void *p;
+	int r, cr;
+	dbrrd_spec_t second[] = {
+		{ 10, SEC2HR(1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "ctxg\n");
+	h = dbrrd_create("txg", spec, sizeof (txg_store_t), txg_update,
+		txg_zero);
+	c = crrd_txg_create("ctxg", spec);
+	if ((h == NULL) || (c == NULL)) {
+		fprintf(stderr, "ctxg: create failed\n");
+		exit(EXIT_FAILURE);
+	}
+	srandom(1);
+	end = SEC2HR(11LL * 31536000);
+	for (tv = 0; tv < end; tv += SEC2HR(60)) {
+		switch (random() % 20000) {
+		case 0:
+			tv += SEC2HR(86400);
+			break;
+		case 1:
+			tv += SEC2HR(7 * 86400);
+			break;
+		}
+		txg_add_at(h, ++txg, tv);
+		crrd_txg_add_at(c, txg, tv);
+	}
+	tv -= SEC2HR(60);
+	for (hrtime_t t = 0; t <= tv + SEC2HR(60); t += (t < tv -
+	    SEC2HR(86400)) ? SEC2HR(4 * 3600 + 7) : SEC2HR(60)) {
+		r = dbrrd_query(h, t, &p, &res);
+		cr = crrd_txg_query(c, t, &lo, &hi, &cres);
+		ptxg = p;
+		if ((r != cr) || (r && ((res != cres) || (ptxg->l != lo) ||
+		    (ptxg->h != hi)))) {
+			fprintf(stderr, "ctxg: differs at %ld\n", HR2SEC(t));
+			exit(EXIT_FAILURE);
+		}
+	}
+	plain = 0;
+	for (rrd_t *q = h; q != NULL; q = q->next) {
+		plain += q->asize;
+	}
+	fprintf(stderr, "  %lu bytes, plain %lu\n", crrd_txg_size(c), plain);
+	if (crrd_txg_size(c) * 5 > plain * 3) {
+		fprintf(stderr, "ctxg: not compact\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Encoded entries are not handed out raw */
+	if (dbrrd_query_range(c, 0, tv, &range, txg_merge, 0) ||
+	    dbrrd_find_value(c, &txg, any_cmp, &res, &cres)) {
+		fprintf(stderr, "ctxg: encoded entries read raw\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_txg_destroy(c);
+	dbrrd_destroy(h);
+
+	/*
+	 * A late txg below its block's base rebases the block while the
+	 * tail points back at the late period: the slots after it are
+	 * live, and must be rebased too.
+	 */
+	c = crrd_txg_create("ctxg", second);
+	if ((c == NULL) || (dbrrd_setreorder(c, SEC2HR(5)) != 0)) {
+		fprintf(stderr, "ctxg: create failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 3; ++i) {
+		crrd_txg_add_at(c, 100 * (i + 1), SEC2HR(i));
+	}
+	crrd_txg_add_at(c, 50, SEC2HR(1));
+	if (!crrd_txg_query(c, SEC2HR(1), &lo, &hi, &res) ||
+	    (lo != 50) || (hi != 200) ||
+	    !crrd_txg_query(c, SEC2HR(2), &lo, &hi, &res) ||
+	    (lo != 300) || (hi != 300)) {
+		fprintf(stderr, "ctxg: late merge lost a live slot\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_txg_destroy(c);
+}
+
 void
 txg_test(void)
 {
@@ -706,10 +971,2059 @@ txg_test(void)
 	h = dbrrd_create("txg", dbrrd_periods, sizeof(txg_store_t),
 		txg_update, txg_zero);
 	txg1(h);
+	txg2(h);
+	txg3(h);
 	dbrrd_destroy(h);
+	ctxg_test(dbrrd_periods);
 	fprintf(stderr,"txg_test complete\n");
 }
 
+/*
+ * group_test
+ *
+ * A group of 19 series (not a multiple of any vector width, so the
+ * scalar tail of each kernel runs too). Row i holds the value
+ * (series + second), and 10 seconds go into each 10 second period.
+ */
+void
+group_test(void)
+{
+	static int aggs[] = { GROUP_SUM, GROUP_MIN, GROUP_MAX, GROUP_MEAN };
+	dbrrd_group_t *g;
+	hrtime_t res;
+	float row[19];
+	float *p;
+	float want, d;
+	int fails = 0;
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(10) },
+		{ 10, SEC2HR( 1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "group_test (%s)\n", dbrrd_group_isa());
+	for (int a = 0; a < 4; ++a) {
+		g = dbrrd_group_create("group", spec, 19, aggs[a]);
+		if (g == NULL) {
+			fprintf(stderr, "dbrrd_group_create failed\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int s = 0; s < 20; ++s) {
+			for (int j = 0; j < 19; ++j)
+				row[j] = j + s;
+			dbrrd_group_add_row(g, SEC2HR(s), row, 19);
+		}
+		/* Second 15 is 5 seconds back, in the 1 second tier */
+		if (!dbrrd_group_query(g, SEC2HR(15), &p, &res) ||
+		    (res != SEC2HR(1)) || (p[18] != 18 + 15)) {
+			fprintf(stderr, "  agg %d: 1 second tier wrong\n", a);
+			++fails;
+		}
+		/* Second 5 is only in the 10 second tier: seconds 0..9 */
+		if (!dbrrd_group_query(g, SEC2HR(5), &p, &res) ||
+		    (res != SEC2HR(10))) {
+			fprintf(stderr, "  agg %d: 10 second query failed\n", a);
+			++fails;
+			dbrrd_group_destroy(g);
+			continue;
+		}
+		for (int j = 0; j < 19; ++j) {
+			switch (aggs[a]) {
+			case GROUP_SUM:  want = 10 * j + 45;  break;
+			case GROUP_MIN:  want = j;            break;
+			case GROUP_MAX:  want = j + 9;        break;
+			default:         want = j + 4.5;      break;
+			}
+			/* The running mean rounds a little */
+			d = p[j] - want;
+			if ((d > 0.0001) || (d < -0.0001)) {
+				fprintf(stderr, "  agg %d series %d: %g wanted %g\n",
+					a, j, p[j], want);
+				++fails;
+			}
+		}
+		dbrrd_group_destroy(g);
+	}
+
+	/* Every kernel the CPU has must agree with the scalar one */
+#ifdef GROUP_X86
+	{
+		const group_kernels_t *k[] = { &sse_kernels, &avx2_kernels };
+		float d0[37], d1[37], s0[37];
+
+		for (int i = 0; i < 2; ++i) {
+			if ((i == 0) && !__builtin_cpu_supports("sse"))
+				continue;
+			if ((i == 1) && !__builtin_cpu_supports("avx2"))
+				continue;
+			for (int j = 0; j < 37; ++j) {
+				d0[j] = d1[j] = j * 0.5f;
+				s0[j] = 37 - j;
+			}
+			scalar_kernels.blend(d0, s0, 37, 0.25f, 0.75f);
+			k[i]->blend(d1, s0, 37, 0.25f, 0.75f);
+			scalar_kernels.max(d0, s0, 37);
+			k[i]->max(d1, s0, 37);
+			scalar_kernels.sum(d0, s0, 37);
+			k[i]->sum(d1, s0, 37);
+			scalar_kernels.min(d0, s0, 37);
+			k[i]->min(d1, s0, 37);
+			if (memcmp(d0, d1, sizeof (d0)) != 0) {
+				fprintf(stderr, "  %s disagrees with scalar\n",
+					k[i]->name);
+				++fails;
+			}
+		}
+	}
+#endif
+
+	if (fails != 0) {
+		fprintf(stderr, "group_test failed\n");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "group_test complete\n");
+}
+
+/*
+ * wheel_test
+ *
+ * An idle database is rolled by the wheel: a query just behind "now"
+ * succeeds without any new sample, and the first sample of the rolled
+ * period replaces the fill rather than being averaged into it. A
+ * reorder window keeps a sample for the period a roll closed, and
+ * adders each holding their own database's lock run alongside the
+ * wheel's thread.
+ */
+typedef struct wheel_adder {
+	crrd_wheel_t *w;
+	rrd_t *h;
+} wheel_adder_t;
+
+static void *
+wheel_adder(void *arg)
+{
+	wheel_adder_t *a = arg;
+	float v = 1.0;
+
+	for (int i = 0; i < 20000; ++i) {
+		crrd_wheel_lock(a->w, a->h);
+		dbrrd_add(a->h, &v);
+		crrd_wheel_unlock(a->w, a->h);
+	}
+	return (NULL);
+}
+
+void
+wheel_test(void)
+{
+	wheel_adder_t wa[2];
+	pthread_t thread[2];
+	crrd_wheel_t *w;
+	rrd_t *h;
+	hrtime_t res;
+	float v;
+	void *p;
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(10) },
+		{ 10, SEC2HR( 1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "wheel_test\n");
+	h = dbrrd_create("wheel", spec, sizeof (float), f_update, f_zero);
+	w = crrd_wheel_create(SEC2HR(1) / 1000, 0);
+	if ((h == NULL) || (w == NULL) || !crrd_wheel_add(w, h)) {
+		fprintf(stderr, "wheel_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	v = 5.0;
+	dbrrd_add_at(h, &v, SEC2HR(2));
+
+	/* Without the wheel, 30 seconds is in the future */
+	if (dbrrd_query(h, SEC2HR(30), &p, &res)) {
+		fprintf(stderr, "query ahead of the data worked?\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* 33.5 seconds on, both rrds are rolled to their current period */
+	crrd_wheel_advance(w, SEC2HR(33) + SEC2HR(1) / 2);
+	if ((h->start != SEC2HR(33)) || (h->next->start != SEC2HR(30)) ||
+	    (rrd_len(h) != 10) || !(h->flags & RRD_TAILFILL)) {
+		fprintf(stderr, "wheel did not roll\n");
+		rrd_debug(h);
+		exit(EXIT_FAILURE);
+	}
+	if (!dbrrd_query(h, SEC2HR(30), &p, &res) || (res != SEC2HR(1)) ||
+	    (*(float *)p != 5.0)) {
+		fprintf(stderr, "query of rolled rrd failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The first sample in the rolled period is stored, not merged */
+	v = 100.0;
+	dbrrd_add_at(h, &v, SEC2HR(33) + SEC2HR(1) / 2);
+	if ((*(float *)rrd_entry(h, rrd_tail(h)) != 100.0) ||
+	    (h->flags & RRD_TAILFILL)) {
+		fprintf(stderr, "sample merged into fill\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* A day of idle 1 millisecond ticks, one roll per period */
+	if (dbrrd_setreorder(h, SEC2HR(1)) != 0) {
+		fprintf(stderr, "wheel_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_wheel_advance(w, SEC2HR(86400));
+	if (h->start != SEC2HR(86400) || rrd_len(h->next) != 10) {
+		fprintf(stderr, "wheel did not roll over a day\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Late for the period the wheel just closed: the window keeps it */
+	v = 7.0;
+	dbrrd_add_at(h, &v, SEC2HR(86400) - SEC2HR(1) / 2);
+	if (!dbrrd_query(h, SEC2HR(86399), &p, &res) ||
+	    (res != SEC2HR(1)) || (*(float *)p != 7.0)) {
+		fprintf(stderr, "sample after a roll lost\n");
+		exit(EXIT_FAILURE);
+	}
+
+	crrd_wheel_remove(w, h);
+	crrd_wheel_destroy(w);
+	dbrrd_destroy(h);
+
+	/* Adders to different databases, with the thread rolling them */
+	w = crrd_wheel_create(SEC2HR(1) / 1000, crrd_now());
+	for (int i = 0; i < 2; ++i) {
+		wa[i].w = w;
+		wa[i].h = dbrrd_create("wheel", spec, sizeof (float),
+		    f_update, f_zero);
+		if ((w == NULL) || (wa[i].h == NULL) ||
+		    !crrd_wheel_add(w, wa[i].h)) {
+			fprintf(stderr, "wheel_test setup failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!crrd_wheel_start(w) ||
+	    (pthread_create(&thread[0], NULL, wheel_adder, &wa[0]) != 0) ||
+	    (pthread_create(&thread[1], NULL, wheel_adder, &wa[1]) != 0)) {
+		fprintf(stderr, "wheel_test: no threads\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_join(thread[0], NULL);
+	pthread_join(thread[1], NULL);
+	crrd_wheel_stop(w);
+	for (int i = 0; i < 2; ++i) {
+		if ((wa[i].h->tail < 0) ||
+		    (wa[i].h->start > crrd_now()) ||
+		    (wa[i].h->start + SEC2HR(2) < crrd_now())) {
+			fprintf(stderr, "wheel_test: adders went wrong\n");
+			exit(EXIT_FAILURE);
+		}
+		crrd_wheel_remove(w, wa[i].h);
+		dbrrd_destroy(wa[i].h);
+	}
+	crrd_wheel_destroy(w);
+	fprintf(stderr, "wheel_test complete\n");
+}
+
+static void
+pool_count(void *arg)
+{
+	__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+typedef struct pool_fork {
+	crrd_pool_t *pool;
+	int count;
+} pool_fork_t;
+
+/* A task that forks tasks of its own, and joins them */
+static void
+pool_fork(void *arg)
+{
+	pool_fork_t *f = arg;
+	crrd_pool_batch_t b = { 0 };
+
+	for (int i = 0; i < 10; ++i) {
+		crrd_pool_submit(f->pool, &b, pool_count, &f->count);
+	}
+	crrd_pool_wait(f->pool, &b);
+	if (b.pending != 0) {
+		fprintf(stderr, "pool joined with %d tasks left\n", b.pending);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * pool_test
+ *
+ * Every task submitted to the pool runs, tasks can fork and join
+ * batches of their own (on their pool or a smaller one), and a batch
+ * added in parallel (a task per rrd) leaves the database exactly as
+ * the serial batch and dbrrd_add_at() do.
+ */
+void
+pool_test(void)
+{
+	crrd_pool_t *pool;
+	rrd_t *h[3];
+	rrd_t *r[3];
+	float v[5000];
+	hrtime_t t[5000];
+	crrd_pool_batch_t batch = { 0 };
+	pool_fork_t fork = { NULL, 0 };
+	int count = 0;
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 100, SEC2HR(1000) },
+		{ 100, SEC2HR( 100) },
+		{ 100, SEC2HR(  10) },
+		{ 100, SEC2HR(   1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "pool_test\n");
+	pool = crrd_pool_create(3);
+	if (pool == NULL) {
+		fprintf(stderr, "crrd_pool_create failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 1000; ++i) {
+		crrd_pool_submit(pool, &batch, pool_count, &count);
+	}
+	crrd_pool_wait(pool, &batch);
+	if (count != 1000) {
+		fprintf(stderr, "pool ran %d of 1000 tasks\n", count);
+		exit(EXIT_FAILURE);
+	}
+	fork.pool = pool;
+	for (int i = 0; i < 100; ++i) {
+		crrd_pool_submit(pool, &batch, pool_fork, &fork);
+	}
+	crrd_pool_wait(pool, &batch);
+	if (fork.count != 1000) {
+		fprintf(stderr, "pool ran %d of 1000 forked tasks\n",
+		    fork.count);
+		exit(EXIT_FAILURE);
+	}
+	/* Workers joining on a pool with no workers of its own */
+	fork.pool = crrd_pool_create(0);
+	fork.count = 0;
+	for (int i = 0; i < 100; ++i) {
+		crrd_pool_submit(pool, &batch, pool_fork, &fork);
+	}
+	crrd_pool_wait(pool, &batch);
+	crrd_pool_destroy(fork.pool);
+	if (fork.count != 1000) {
+		fprintf(stderr, "pool ran %d of 1000 tasks forked across "
+		    "pools\n", fork.count);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < 5000; ++i) {
+		v[i] = i % 17;
+		/* Mostly 1 second apart, with a gap now and then */
+		t[i] = SEC2HR(i) + ((i / 1000) * SEC2HR(250));
+	}
+	for (int i = 0; i < 3; ++i) {
+		h[i] = dbrrd_create("pool", spec, sizeof (float),
+			f_update, f_zero);
+	}
+	for (int i = 0; i < 5000; ++i) {
+		dbrrd_add_at(h[0], &v[i], t[i]);
+	}
+	dbrrd_add_batch(h[1], v, t, 5000);
+	dbrrd_add_batch_parallel(pool, h[2], v, t, 5000);
+
+	for (r[0] = h[0], r[1] = h[1], r[2] = h[2]; r[0] != NULL;
+	    r[0] = r[0]->next, r[1] = r[1]->next, r[2] = r[2]->next) {
+		for (int i = 1; i < 3; ++i) {
+			if ((rrd_len(r[i]) != rrd_len(r[0])) ||
+			    (r[i]->start != r[0]->start)) {
+				fprintf(stderr, "batch %d differs\n", i);
+				exit(EXIT_FAILURE);
+			}
+			for (int j = 0; j < rrd_len(r[0]); ++j) {
+				if (*(float *)rrd_get(r[i], j) !=
+				    *(float *)rrd_get(r[0], j)) {
+					fprintf(stderr, "batch %d differs at "
+						"%d\n", i, j);
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		dbrrd_destroy(h[i]);
+	}
+	crrd_pool_destroy(pool);
+	fprintf(stderr, "pool_test complete\n");
+}
+
+static void
+f_merge(void *acc, const void *v)
+{
+	*(float *)acc += *(const float *)v;
+}
+
+/*
+ * bulk_test
+ *
+ * A bulk query over many databases (some empty, some too young for
+ * the query time) returns what dbrrd_query does for each, and a bulk
+ * range query what dbrrd_query_range does.
+ */
+void
+bulk_test(void)
+{
+	crrd_pool_t *pool;
+	rrd_t **h;
+	void **vp;
+	hrtime_t *res;
+	float *sum;
+	int *got;
+	void *p;
+	hrtime_t r1;
+	float v;
+	int n = 5000;
+	int found, found_i, want;
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(10) },
+		{ 10, SEC2HR( 1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "bulk_test\n");
+	pool = crrd_pool_create(2);
+	h = malloc(n * sizeof (rrd_t *));
+	vp = malloc(n * sizeof (void *));
+	res = malloc(n * sizeof (hrtime_t));
+	sum = calloc(n, sizeof (float));
+	got = malloc(n * sizeof (int));
+	if ((pool == NULL) || (h == NULL) || (vp == NULL) || (res == NULL) ||
+	    (sum == NULL) || (got == NULL)) {
+		fprintf(stderr, "bulk_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Database i has samples from second i % 150 up to 99 */
+	for (int i = 0; i < n; ++i) {
+		h[i] = dbrrd_create("bulk", spec, sizeof (float),
+			f_update, f_zero);
+		for (int s = i % 150; s < 100; ++s) {
+			v = i;
+			dbrrd_add_at(h[i], &v, SEC2HR(s));
+		}
+	}
+
+	found = dbrrd_query_bulk(pool, h, n, SEC2HR(50), vp, res);
+	want = 0;
+	for (int i = 0; i < n; ++i) {
+		if (dbrrd_query(h[i], SEC2HR(50), &p, &r1)) {
+			++want;
+			if ((vp[i] != p) || (res[i] != r1)) {
+				fprintf(stderr, "bulk query %d differs\n", i);
+				exit(EXIT_FAILURE);
+			}
+		} else if (vp[i] != NULL) {
+			fprintf(stderr, "bulk query %d found nothing?\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((found != want) || (found == 0) || (found == n)) {
+		fprintf(stderr, "bulk query found %d, wanted %d\n",
+			found, want);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		vp[i] = &sum[i];
+	}
+	found = dbrrd_query_range_bulk(pool, h, n, SEC2HR(40), SEC2HR(60),
+	    vp, got, f_merge, 0);
+	want = 0;
+	for (int i = 0; i < n; ++i) {
+		v = 0;
+		found_i = dbrrd_query_range(h[i], SEC2HR(40), SEC2HR(60), &v,
+		    f_merge, 0);
+		want += found_i;
+		/* out[] is the caller's: only got[] says what was found */
+		if ((vp[i] != &sum[i]) || (got[i] != found_i) ||
+		    (found_i && (sum[i] != v))) {
+			fprintf(stderr, "bulk range query %d differs\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((found != want) || (found == 0) || (found == n)) {
+		fprintf(stderr, "bulk range query found %d, wanted %d\n",
+			found, want);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		dbrrd_destroy(h[i]);
+	}
+	free(h);
+	free(vp);
+	free(res);
+	free(sum);
+	free(got);
+	crrd_pool_destroy(pool);
+	fprintf(stderr, "bulk_test complete\n");
+}
+
+/*
+ * multi_test
+ *
+ * dbrrd_add_multi() over many databases (of mixed entry sizes) gives
+ * the same databases as dbrrd_add_at() on each.
+ */
+void
+multi_test(void)
+{
+	rrd_t *a[300], *b[300];
+	char v[300 * sizeof (txg_store_t)];
+	char *p;
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(10) },
+		{ 10, SEC2HR( 1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "multi_test\n");
+	for (int i = 0; i < 300; ++i) {
+		if (i % 3 == 0) {
+			a[i] = dbrrd_create("multi", spec,
+				sizeof (txg_store_t), txg_update, txg_zero);
+			b[i] = dbrrd_create("multi", spec,
+				sizeof (txg_store_t), txg_update, txg_zero);
+		} else {
+			a[i] = dbrrd_create("multi", spec, sizeof (float),
+				f_update, f_zero);
+			b[i] = dbrrd_create("multi", spec, sizeof (float),
+				f_update, f_zero);
+		}
+	}
+	/* Half second scrapes, with a gap of a minute half way */
+	for (int s = 0; s < 200; ++s) {
+		hrtime_t t = SEC2HR(s) / 2 + ((s >= 100) ? SEC2HR(60) : 0);
+
+		p = v;
+		for (int i = 0; i < 300; ++i) {
+			if (i % 3 == 0) {
+				txg_store_t x = { s, s };
+
+				memcpy(p, &x, sizeof (x));
+			} else {
+				float f = i + s;
+
+				memcpy(p, &f, sizeof (f));
+			}
+			dbrrd_add_at(a[i], p, t);
+			p += a[i]->size;
+		}
+		dbrrd_add_multi(b, 300, v, t);
+	}
+	for (int i = 0; i < 300; ++i) {
+		for (rrd_t *r = a[i], *q = b[i]; r != NULL;
+		    r = r->next, q = q->next) {
+			if ((rrd_len(r) != rrd_len(q)) ||
+			    (r->start != q->start)) {
+				fprintf(stderr, "multi %d differs\n", i);
+				exit(EXIT_FAILURE);
+			}
+			for (int j = 0; j < rrd_len(r); ++j) {
+				if (memcmp(rrd_get(r, j), rrd_get(q, j),
+				    r->size) != 0) {
+					fprintf(stderr, "multi %d differs "
+						"at %d\n", i, j);
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+		dbrrd_destroy(a[i]);
+		dbrrd_destroy(b[i]);
+	}
+	fprintf(stderr, "multi_test complete\n");
+}
+
+/*
+ * stats_test
+ *
+ * Counters see accepted and late samples, periods advanced (and the
+ * longest gap), update and zero calls, and which tier answered each
+ * query.
+ */
+void
+stats_test(void)
+{
+	rrd_stats_t st[3];
+	hrtime_t res;
+	rrd_t *h;
+	float v = 1.0;
+	void *p;
+	int n;
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(10) },
+		{ 10, SEC2HR( 1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "stats_test\n");
+	h = dbrrd_create("stats", spec, sizeof (float), f_update, f_zero);
+	if ((h == NULL) || !dbrrd_stats_enable(h)) {
+		fprintf(stderr, "stats_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	dbrrd_add_at(h, &v, SEC2HR(0));
+	dbrrd_add_at(h, &v, SEC2HR(0) + 5);	/* same period */
+	dbrrd_add_at(h, &v, SEC2HR(1));		/* next period */
+	dbrrd_add_at(h, &v, SEC2HR(0));		/* late */
+	dbrrd_add_at(h, &v, SEC2HR(25));	/* 24 and 2 period gaps */
+
+	(void) dbrrd_query(h, SEC2HR(24), &p, &res);	/* 1 second tier */
+	(void) dbrrd_query(h, SEC2HR(5), &p, &res);	/* 10 second tier */
+	(void) dbrrd_query(h, SEC2HR(26), &p, &res);	/* future */
+
+	n = dbrrd_stats(h, st, 3);
+	if ((n != 2) ||
+	    (st[0].accepted != 4) || (st[0].late != 1) ||
+	    (st[0].advanced != 25) || (st[0].maxgap != 24) ||
+	    (st[0].updates != 1) || (st[0].zeros != 25) ||
+	    (st[0].qhit != 1) || (st[0].qmiss != 1) ||
+	    (st[1].accepted != 4) || (st[1].late != 1) ||
+	    (st[1].advanced != 2) || (st[1].maxgap != 2) ||
+	    (st[1].updates != 2) || (st[1].qhit != 1)) {
+		fprintf(stderr, "counters wrong\n");
+		for (int i = 0; i < 2; ++i) {
+			fprintf(stderr, "  %d: %lu %lu %lu %lu %lu %lu %lu "
+				"%lu\n", i, st[i].accepted, st[i].late,
+				st[i].advanced, st[i].maxgap, st[i].updates,
+				st[i].zeros, st[i].qhit, st[i].qmiss);
+		}
+		exit(EXIT_FAILURE);
+	}
+	dbrrd_destroy(h);
+	fprintf(stderr, "stats_test complete\n");
+}
+
+/*
+ * metrics_test
+ *
+ * crrd's own history: each minute holds what the watched databases
+ * did in that minute.
+ */
+void
+metrics_test(void)
+{
+	crrd_metrics_entry_t *e;
+	crrd_metrics_t *m;
+	hrtime_t res;
+	rrd_t *a, *b;
+	float v = 1.0;
+	void *p;
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(10) },
+		{ 10, SEC2HR( 1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "metrics_test\n");
+	a = dbrrd_create("a", spec, sizeof (float), f_update, f_zero);
+	b = dbrrd_create("b", spec, sizeof (float), f_update, f_zero);
+	m = crrd_metrics_create(NULL);
+	if ((a == NULL) || (b == NULL) || (m == NULL)) {
+		fprintf(stderr, "metrics_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Counted before the watch: not ours */
+	dbrrd_add_at(a, &v, SEC2HR(0));
+	/* a twice, and it still counts once */
+	if (!crrd_metrics_watch(m, a) || !crrd_metrics_watch(m, b) ||
+	    !crrd_metrics_watch(m, a)) {
+		fprintf(stderr, "crrd_metrics_watch failed\n");
+		exit(EXIT_FAILURE);
+	}
+	/* First minute */
+	dbrrd_add_at(a, &v, SEC2HR(1));
+	dbrrd_add_at(a, &v, SEC2HR(0));		/* late */
+	dbrrd_add_at(b, &v, SEC2HR(5));
+	(void) dbrrd_query(a, SEC2HR(1), &p, &res);	/* 1 second tier */
+	(void) dbrrd_query(b, SEC2HR(100), &p, &res);	/* miss */
+	crrd_metrics_sample_at(m, SEC2HR(30));
+	/* Second minute, without b */
+	crrd_metrics_unwatch(m, b);
+	dbrrd_add_at(b, &v, SEC2HR(6));
+	dbrrd_add_at(a, &v, SEC2HR(2));
+	crrd_metrics_sample_at(m, SEC2HR(70));
+	dbrrd_add_at(a, &v, SEC2HR(3));
+	crrd_metrics_sample_at(m, SEC2HR(80));
+
+	if (!crrd_metrics_query(m, SEC2HR(10), &e, &res) ||
+	    (res != SEC2HR(60)) || (e->samples != 1) ||
+	    (e->accepted != 2) || (e->late != 1) || (e->advanced != 1) ||
+	    (e->queries[0] != 1) || (e->queries[1] != 0) ||
+	    (e->qmiss != 1)) {
+		fprintf(stderr, "first minute wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!crrd_metrics_query(m, SEC2HR(60), &e, &res) ||
+	    (e->samples != 2) || (e->accepted != 2) ||
+	    (e->advanced != 2) || (e->qmiss != 0)) {
+		fprintf(stderr, "second minute wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	/* The clock steps back: what happened goes in the latest period */
+	dbrrd_add_at(a, &v, SEC2HR(4));
+	crrd_metrics_sample_at(m, SEC2HR(50));
+	if (!crrd_metrics_query(m, SEC2HR(60), &e, &res) ||
+	    (e->samples != 3) || (e->accepted != 3) || (e->advanced != 3)) {
+		fprintf(stderr, "sample before the last lost\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_metrics_destroy(m);
+	dbrrd_destroy(a);
+	dbrrd_destroy(b);
+	fprintf(stderr, "metrics_test complete\n");
+}
+
+/*
+ * reorder_test
+ *
+ * Counting samples: with a reorder window, late samples land in the
+ * period they belong to, as long as it is still in the ring.
+ */
+static void
+count_update(rrd_t *r, void *pv)
+{
+	uint32_t *c = rrd_entry(r, rrd_tail(r));
+
+	*c += *(uint32_t *)pv;
+}
+
+static void
+count_zero(rrd_t *r, void *pv)
+{
+	uint32_t *c = rrd_entry(r, rrd_tail(r));
+
+	pv = pv;
+	*c = 0;
+}
+
+/* A constant fill that is not one byte repeated, as a zero() */
+static void
+beef_zero(rrd_t *r, void *pv)
+{
+	uint32_t *c = rrd_entry(r, rrd_tail(r));
+
+	pv = pv;
+	*c = 0xdeadbeef;
+}
+
+/*
+ * fill test
+ *
+ * An rrd with a fill kind must end up exactly as one calling the zero()
+ * it stands for: the same stream, with gaps short and long (past the
+ * capacity, and wrapping), and rolls, into both, compared slot by slot
+ * after every step.
+ */
+static void
+fill_compare(char *name, size_t sz, void *update, void *zero, int kind,
+    const void *pattern, int lazy)
+{
+	uint32_t v[4];
+	rrd_t *a, *b;
+	hrtime_t t, tv;
+	int runs = 0;
+
+	a = rrd_create(name, SEC2HR(1), 50, sz);
+	b = rrd_create(name, SEC2HR(1), 50, sz);
+	if ((a == NULL) || (b == NULL)) {
+		fprintf(stderr, "fill_test: create failed\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_setfunctions(a, update, zero);
+	rrd_setfunctions(b, update, zero);
+	if ((rrd_setfill(b, kind, pattern) != 0) ||
+	    (rrd_setlazy(b, lazy) != 0)) {
+		fprintf(stderr, "fill_test: %s: rrd_setfill failed\n", name);
+		exit(EXIT_FAILURE);
+	}
+	rrd_setreorder(a, SEC2HR(30));
+	rrd_setreorder(b, SEC2HR(30));
+	srandom(1);
+	t = SEC2HR(1000);
+	for (int i = 0; i < 20000; ++i) {
+		tv = -1;
+		switch (random() % 12) {
+		case 10:
+		case 11:
+			/* Late, and perhaps into a gap */
+			tv = t - SEC2HR(random() % 40);
+			break;
+		case 0:
+			t += SEC2HR(random() % 120);
+			break;
+		case 1:
+			t += SEC2HR(random() % 8);
+			rrd_roll(a, t);
+			rrd_roll(b, t);
+			continue;
+		default:
+			t += random() % SEC2HR(1);
+			break;
+		}
+		for (int j = 0; j < 4; ++j) {
+			v[j] = random() % 1000;
+		}
+		if (tv < 0) {
+			tv = t;
+		}
+		rrd_add_at(a, v, tv);
+		rrd_add_at(b, v, tv);
+		if (b->nruns > runs) {
+			runs = b->nruns;
+		}
+		if ((rrd_len(a) != rrd_len(b)) || (a->head != b->head) ||
+		    (a->start != b->start) || (a->last != b->last)) {
+			fprintf(stderr, "fill_test: %s: ring differs\n", name);
+			exit(EXIT_FAILURE);
+		}
+		for (int j = 0; j < rrd_len(a); ++j) {
+			if (memcmp(rrd_get(a, j), rrd_get(b, j), sz) != 0) {
+				fprintf(stderr, "fill_test: %s: slot %d "
+				    "differs\n", name, j);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	if (lazy) {
+		if (runs == 0) {
+			fprintf(stderr, "fill_test: %s: no runs\n", name);
+			exit(EXIT_FAILURE);
+		}
+		/* Written out, it is the same */
+		rrd_setlazy(b, 0);
+		for (int j = 0; j < rrd_len(a); ++j) {
+			if (memcmp(rrd_get(a, j), rrd_entry(b, (b->head + j) %
+			    b->capacity), sz) != 0) {
+				fprintf(stderr, "fill_test: %s: slot %d "
+				    "written out wrong\n", name, j);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	rrd_destroy(a);
+	rrd_destroy(b);
+}
+
+void
+fill_test(void)
+{
+	static const uint32_t zero = 0;
+	static const uint32_t beef = 0xdeadbeef;
+	rrd_t *r;
+
+	fprintf(stderr, "fill_test\n");
+	for (int lazy = 0; lazy < 2; ++lazy) {
+		fill_compare("const", sizeof (uint32_t), count_update,
+		    count_zero, RRD_FILL_CONST, &zero, lazy);
+		fill_compare("pattern", sizeof (uint32_t), count_update,
+		    beef_zero, RRD_FILL_CONST, &beef, lazy);
+		fill_compare("prev", sizeof (txg_store_t), txg_update,
+		    txg_zero, RRD_FILL_PREV, NULL, lazy);
+		fill_compare("value", sizeof (float), f_update, f_zero,
+		    RRD_FILL_VALUE, NULL, lazy);
+	}
+
+	/* No pattern, an unknown kind, or an encoded rrd */
+	r = rrd_create("fill", SEC2HR(1), 10, sizeof (uint32_t));
+	if ((rrd_setfill(r, RRD_FILL_CONST, NULL) == 0) ||
+	    (rrd_setfill(r, 99, NULL) == 0)) {
+		fprintf(stderr, "fill_test: bad fill taken\n");
+		exit(EXIT_FAILURE);
+	}
+	if (rrd_setlazy(r, 1) == 0) {
+		fprintf(stderr, "fill_test: lazy without a fill kind\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_setstore(r, count_zero, NULL);
+	if (rrd_setfill(r, RRD_FILL_PREV, NULL) == 0) {
+		fprintf(stderr, "fill_test: fill taken with store()\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_destroy(r);
+	fprintf(stderr, "fill_test complete\n");
+}
+
+void
+reorder_test(void)
+{
+	rrd_stats_t st;
+	uint32_t one = 1;
+	uint32_t *c;
+	rrd_t *r;
+	int i;
+	/* Per period: 0 1 2 3 4 5 6 7 (capacity 4 keeps 4..7) */
+	static const int late[] = { 7, 6, 6, 4, 3, 7 };
+	static const uint32_t want[] = { 2, 0, 2, 3 };
+
+	fprintf(stderr, "reorder_test\n");
+	r = rrd_create("reorder", SEC2HR(1), 4, sizeof (uint32_t));
+	if ((r == NULL) || !rrd_stats_enable(r)) {
+		fprintf(stderr, "reorder_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_setfunctions(r, count_update, count_zero);
+
+	/* Without a window, late is dropped */
+	rrd_add_at(r, &one, SEC2HR(7) + 500);
+	rrd_add_at(r, &one, SEC2HR(7));
+	c = rrd_get(r, 0);
+	if ((rrd_len(r) != 1) || (*c != 1)) {
+		fprintf(stderr, "late sample taken without a window\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_destroy(r);
+
+	r = rrd_create("reorder", SEC2HR(1), 4, sizeof (uint32_t));
+	if ((r == NULL) || !rrd_stats_enable(r)) {
+		fprintf(stderr, "reorder_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_setfunctions(r, count_update, count_zero);
+	rrd_setreorder(r, SEC2HR(5));
+	rrd_add_at(r, &one, SEC2HR(4));
+	rrd_add_at(r, &one, SEC2HR(7) + 500);
+	for (i = 0; i < sizeof (late) / sizeof (late[0]); ++i) {
+		rrd_add_at(r, &one, SEC2HR(late[i]));
+	}
+	/* Period 3 is in the window, but has left the ring */
+	rrd_stats(r, &st);
+	if ((rrd_len(r) != 4) || (r->last != SEC2HR(7) + 500) ||
+	    (st.accepted != 7) || (st.reordered != 5) || (st.late != 1)) {
+		fprintf(stderr, "reorder counters wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < 4; ++i) {
+		c = rrd_get(r, i);
+		if (*c != want[i]) {
+			fprintf(stderr, "period %d: %u samples, wanted %u\n",
+			    i + 4, *c, want[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	/* Out of the window */
+	rrd_add_at(r, &one, SEC2HR(2));
+	rrd_stats(r, &st);
+	if (st.late != 2) {
+		fprintf(stderr, "sample outside the window taken\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_destroy(r);
+
+	/*
+	 * A gap holds the count before it: the first late sample into a
+	 * gap period replaces that, later ones count on. Periods 1..19
+	 * are a gap (a run, when lazy), 21 and 22 a roll.
+	 */
+	for (int lazy = 0; lazy < 2; ++lazy) {
+		r = rrd_create("reorder", SEC2HR(1), 32, sizeof (uint32_t));
+		if (r == NULL) {
+			fprintf(stderr, "reorder_test setup failed\n");
+			exit(EXIT_FAILURE);
+		}
+		rrd_setfunctions(r, count_update, count_zero);
+		if ((rrd_setfill(r, RRD_FILL_PREV, NULL) != 0) ||
+		    (rrd_setlazy(r, lazy) != 0) ||
+		    (rrd_setreorder(r, SEC2HR(30)) != 0)) {
+			fprintf(stderr, "reorder_test setup failed\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < 5; ++i) {
+			rrd_add_at(r, &one, SEC2HR(0));
+		}
+		rrd_add_at(r, &one, SEC2HR(20));
+		rrd_add_at(r, &one, SEC2HR(10));
+		rrd_add_at(r, &one, SEC2HR(10) + 1);
+		rrd_add_at(r, &one, SEC2HR(0));
+		rrd_roll(r, SEC2HR(22));
+		rrd_add_at(r, &one, SEC2HR(21));
+		if ((rrd_len(r) != 23) ||
+		    (*(uint32_t *)rrd_get(r, 0) != 6) ||
+		    (*(uint32_t *)rrd_get(r, 9) != 5) ||
+		    (*(uint32_t *)rrd_get(r, 10) != 2) ||
+		    (*(uint32_t *)rrd_get(r, 20) != 1) ||
+		    (*(uint32_t *)rrd_get(r, 21) != 1) ||
+		    (*(uint32_t *)rrd_get(r, 22) != 1)) {
+			fprintf(stderr, "late sample merged into a gap\n");
+			exit(EXIT_FAILURE);
+		}
+		rrd_destroy(r);
+	}
+	fprintf(stderr, "reorder_test complete\n");
+}
+
+/*
+ * stage_test
+ *
+ * A reorder buffer in front of an rrd whose update() keeps the last
+ * sample of a period: with jitter of several periods, every period
+ * still ends up holding its newest sample.
+ */
+static void
+last_update(rrd_t *r, void *pv)
+{
+	rrd_store(r, pv);
+}
+
+void
+stage_test(void)
+{
+	crrd_reorder_t *q;
+	rrd_stats_t st;
+	uint32_t *c;
+	uint32_t v;
+	rrd_t *r;
+	int i;
+	/* Seconds 0..19, each up to 3 seconds out of place */
+	static const int order[] = {
+		2, 0, 1, 4, 3, 6, 7, 5, 9, 8,
+		12, 10, 11, 14, 15, 13, 17, 19, 16, 18
+	};
+	static const int full[] = { 5, 6, 7, 1, 2 };
+
+	fprintf(stderr, "stage_test\n");
+	r = rrd_create("stage", SEC2HR(2), 20, sizeof (uint32_t));
+	q = crrd_reorder_create(r, 8, SEC2HR(4));
+	if ((r == NULL) || (q == NULL)) {
+		fprintf(stderr, "stage_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_setfunctions(r, last_update, count_zero);
+	for (i = 0; i < 20; ++i) {
+		v = order[i];
+		crrd_reorder_add(q, &v, SEC2HR(order[i]));
+		if (crrd_reorder_len(q) > 5) {
+			fprintf(stderr, "held %d samples\n",
+			    crrd_reorder_len(q));
+			exit(EXIT_FAILURE);
+		}
+	}
+	crrd_reorder_flush(q);
+	if ((crrd_reorder_len(q) != 0) || (rrd_len(r) != 10)) {
+		fprintf(stderr, "flush failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < 10; ++i) {
+		c = rrd_get(r, i);
+		if (*c != 2 * i + 1) {
+			fprintf(stderr, "period %d holds %u\n", i, *c);
+			exit(EXIT_FAILURE);
+		}
+	}
+	crrd_reorder_destroy(q);
+	rrd_destroy(r);
+
+	/* Full: the oldest goes early, and what is then late passes by */
+	r = rrd_create("stage", SEC2HR(1), 20, sizeof (uint32_t));
+	q = crrd_reorder_create(r, 2, SEC2HR(100));
+	if ((r == NULL) || (q == NULL) || !rrd_stats_enable(r)) {
+		fprintf(stderr, "stage_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_setfunctions(r, last_update, count_zero);
+	for (i = 0; i < 5; ++i) {
+		v = full[i];
+		crrd_reorder_add(q, &v, SEC2HR(full[i]));
+	}
+	crrd_reorder_destroy(q);
+	/* 5 goes early to make room for 7, then 1 and 2 are late */
+	rrd_stats(r, &st);
+	if ((rrd_len(r) != 3) || (st.accepted != 3) || (st.late != 2)) {
+		fprintf(stderr, "full buffer wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	rrd_destroy(r);
+
+	/* An odd sample size still leaves the free stack aligned */
+	r = rrd_create("stage", SEC2HR(1), 20, 3);
+	q = crrd_reorder_create(r, 3, SEC2HR(1));
+	if ((r == NULL) || (q == NULL) ||
+	    ((uintptr_t)q->free % sizeof (int) != 0)) {
+		fprintf(stderr, "reorder free stack misaligned\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_reorder_destroy(q);
+	rrd_destroy(r);
+	fprintf(stderr, "stage_test complete\n");
+}
+
+/*
+ * range_test
+ *
+ * A count of one sample a second, summed over a range that starts in
+ * the coarse tier and ends in the fine one: every sample is counted
+ * once. The multi form folds each database as the single one does.
+ */
+static void
+count_merge(void *acc, const void *v)
+{
+	*(uint32_t *)acc += *(const uint32_t *)v;
+}
+
+void
+range_test(void)
+{
+	uint32_t one = 1;
+	uint32_t n, m[3];
+	void *out[3];
+	int got[3];
+	rrd_t *h, *hv[3];
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(10) },
+		{ 10, SEC2HR( 1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "range_test\n");
+	h = dbrrd_create("range", spec, sizeof (uint32_t), count_update,
+	    count_zero);
+	if (h == NULL) {
+		fprintf(stderr, "range_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 100; ++i) {
+		dbrrd_add_at(h, &one, SEC2HR(i));
+	}
+	/* Coarse 0..99 by tens, fine 90..99 */
+	if (!dbrrd_query_range(h, SEC2HR(0), SEC2HR(99), &n, count_merge, 0) ||
+	    (n != 100)) {
+		fprintf(stderr, "range 0..99 counted %u\n", n);
+		exit(EXIT_FAILURE);
+	}
+	/* 25 is in the 20..29 slot; the future is cut off */
+	if (!dbrrd_query_range(h, SEC2HR(25), SEC2HR(200), &n, count_merge,
+	    0) || (n != 80)) {
+		fprintf(stderr, "range 25..200 counted %u\n", n);
+		exit(EXIT_FAILURE);
+	}
+	if (!dbrrd_query_range(h, SEC2HR(92), SEC2HR(94), &n, count_merge,
+	    0) || (n != 3)) {
+		fprintf(stderr, "range 92..94 counted %u\n", n);
+		exit(EXIT_FAILURE);
+	}
+	if (dbrrd_query_range(h, SEC2HR(100), SEC2HR(200), &n, count_merge,
+	    0)) {
+		fprintf(stderr, "found a future range\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* h, an empty database, and h again */
+	hv[0] = h;
+	hv[1] = dbrrd_create("range", spec, sizeof (uint32_t), count_update,
+	    count_zero);
+	hv[2] = h;
+	for (int i = 0; i < 3; ++i) {
+		out[i] = &m[i];
+	}
+	if ((dbrrd_query_range_multi(hv, 3, SEC2HR(25), SEC2HR(94), out, got,
+	    count_merge, 0) != 2) || (out[0] != &m[0]) || (out[1] != &m[1]) ||
+	    (out[2] != &m[2]) || !got[0] || got[1] || !got[2] ||
+	    (m[0] != 75) || (m[2] != 75)) {
+		fprintf(stderr, "range multi 25..94 wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	dbrrd_destroy(hv[1]);
+	dbrrd_destroy(h);
+	fprintf(stderr, "range_test complete\n");
+}
+
+/*
+ * clock_test
+ *
+ * Every clock that is available here tells the time (the realtime
+ * ones within a second of each other), and CACHED is what was set --
+ * on that thread, not another. A thread that set nothing, like the
+ * ticker's, reads realtime.
+ */
+static void *
+clock_thread(void *arg)
+{
+	crrd_setnow(SEC2HR(2000));
+	*(hrtime_t *)arg = crrd_now();
+	return (NULL);
+}
+
+void
+clock_test(void)
+{
+	static const int kinds[] = {
+		CRRD_CLOCK_MONOTONIC, CRRD_CLOCK_REALTIME_COARSE,
+		CRRD_CLOCK_TSC, CRRD_CLOCK_REALTIME
+	};
+	static const char *names[] = {
+		"monotonic", "realtime_coarse", "tsc", "realtime"
+	};
+	static const hrtime_t tres[] = { SEC2HR(1) };
+	struct timespec nap = { 0, 20000000 };
+	crrd_ticker_t *k;
+	pthread_t thread;
+	hrtime_t t0, t1, t;
+	hrtime_t res;
+	rrd_t *h;
+	float v = 1.0;
+	void *p;
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "clock_test\n");
+	for (int i = 0; i < 4; ++i) {
+		if (!crrd_setclock(kinds[i])) {
+			fprintf(stderr, "  %s not available\n", names[i]);
+			continue;
+		}
+		t0 = crrd_now();
+		t1 = crrd_now();
+		if ((t0 <= 0) || (t1 < t0)) {
+			fprintf(stderr, "%s clock wrong\n", names[i]);
+			exit(EXIT_FAILURE);
+		}
+		if (kinds[i] != CRRD_CLOCK_MONOTONIC) {
+			t = time(NULL);
+			if ((HR2SEC(t0) < t - 1) || (HR2SEC(t0) > t + 1)) {
+				fprintf(stderr, "%s clock is not realtime\n",
+				    names[i]);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	if (crrd_setclock(-1)) {
+		fprintf(stderr, "crrd_setclock took a bad clock\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* One clock read for a batch */
+	h = dbrrd_create("clock", spec, sizeof (float), f_update, f_zero);
+	if ((h == NULL) || !crrd_setclock(CRRD_CLOCK_CACHED)) {
+		fprintf(stderr, "clock_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_setnow(SEC2HR(1000));
+	for (int i = 0; i < 5; ++i) {
+		dbrrd_add(h, &v);
+	}
+	if ((crrd_now() != SEC2HR(1000)) || (h->last != SEC2HR(1000)) ||
+	    !dbrrd_query(h, SEC2HR(1000), &p, &res) || (rrd_len(h) != 1)) {
+		fprintf(stderr, "cached clock wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Another thread's batch keeps its own time */
+	if ((pthread_create(&thread, NULL, clock_thread, &t1) != 0) ||
+	    (pthread_join(thread, NULL) != 0) || (t1 != SEC2HR(2000)) ||
+	    (crrd_now() != SEC2HR(1000))) {
+		fprintf(stderr, "cached clock shared between threads\n");
+		exit(EXIT_FAILURE);
+	}
+	/* The ticker's thread never set a time: it ticks on realtime */
+	k = crrd_ticker_create(SEC2HR(1) / 1000, tres, 1);
+	if (k == NULL) {
+		fprintf(stderr, "clock_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	nanosleep(&nap, NULL);
+	t1 = crrd_ticker_now(k);
+	t = time(NULL);
+	crrd_ticker_destroy(k);
+	if ((HR2SEC(t1) < t - 1) || (HR2SEC(t1) > t + 1)) {
+		fprintf(stderr, "ticker stopped on the cached clock\n");
+		exit(EXIT_FAILURE);
+	}
+	(void) crrd_setclock(CRRD_CLOCK_REALTIME);
+	dbrrd_destroy(h);
+	fprintf(stderr, "clock_test complete\n");
+}
+
+/*
+ * ticker_test
+ *
+ * The page keeps up with the clock, and dbrrd_add_tick lands samples
+ * where dbrrd_add_at would at the published time.
+ */
+void
+ticker_test(void)
+{
+	static const hrtime_t res[] = { SEC2HR(1), SEC2HR(60) };
+	const crrd_tick_page_t *pg;
+	struct timespec nap = { 0, 20000000 };
+	crrd_ticker_t *k;
+	hrtime_t t0, t;
+	hrtime_t r;
+	rrd_t *h;
+	float v = 1.0;
+	void *p;
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(3600) },
+		{ 60, SEC2HR(60) },
+		{ 60, SEC2HR(1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "ticker_test\n");
+	k = crrd_ticker_create(SEC2HR(1) / 1000, res, 2);
+	h = dbrrd_create("ticker", spec, sizeof (float), f_update, f_zero);
+	if ((k == NULL) || (h == NULL)) {
+		fprintf(stderr, "ticker_test setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	pg = crrd_ticker_page(k);
+	t0 = crrd_ticker_now(k);
+	if ((pg->nres != 2) || (pg->seq & 1) ||
+	    (pg->start[0] != find_period(t0, SEC2HR(1))) ||
+	    (pg->start[1] != find_period(t0, SEC2HR(60)))) {
+		fprintf(stderr, "ticker page wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	nanosleep(&nap, NULL);
+	t = crrd_ticker_now(k);
+	if ((t <= t0) || (t > crrd_now())) {
+		fprintf(stderr, "ticker not ticking\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 1000; ++i) {
+		dbrrd_add_tick(k, h, &v);
+	}
+	t = crrd_ticker_now(k);
+	for (rrd_t *q = h; q != NULL; q = q->next) {
+		if ((q->last > t) || (q->last < t0) ||
+		    (q->start != find_period(q->last, q->resolution))) {
+			fprintf(stderr, "tier %s placed wrong\n", q->name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!dbrrd_query(h, h->last, &p, &r) || (r != SEC2HR(1))) {
+		fprintf(stderr, "ticker sample not found\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_ticker_destroy(k);
+	dbrrd_destroy(h);
+	fprintf(stderr, "ticker_test complete\n");
+}
+
+#ifdef CRRD_LATENCY
+/*
+ * latency_test
+ *
+ * With -DCRRD_LATENCY, every add and query lands in a histogram, and
+ * the max holds the longest of calls recorded on several threads.
+ */
+static void *
+latency_thread(void *arg)
+{
+	uint64_t d = (uintptr_t)arg;
+
+	for (uint64_t i = 0; i < 100000; ++i) {
+		lat_record(CRRD_LAT_QUERY, lat_now() - d - i);
+	}
+	return (NULL);
+}
+
+void
+latency_test(void)
+{
+	pthread_t thread[4];
+	crrd_latency_t before[CRRD_LAT_N], after[CRRD_LAT_N];
+	hrtime_t res;
+	rrd_t *h;
+	float v = 1.0;
+	void *p;
+	/* Must be sorted descending by timeval */
+	dbrrd_spec_t spec[] = {
+		{ 10, SEC2HR(10) },
+		{ 10, SEC2HR( 1) },
+		{ 0, 0 },
+	};
+
+	fprintf(stderr, "latency_test\n");
+	for (int i = 0; i < CRRD_LAT_N; ++i) {
+		crrd_latency(i, &before[i]);
+	}
+	h = dbrrd_create("latency", spec, sizeof (float), f_update, f_zero);
+	for (int i = 0; i < 1000; ++i) {
+		dbrrd_add_at(h, &v, SEC2HR(i));
+		rrd_add_at(h, &v, SEC2HR(i));
+		(void) dbrrd_query(h, SEC2HR(i), &p, &res);
+	}
+	dbrrd_destroy(h);
+	for (int i = 0; i < CRRD_LAT_N; ++i) {
+		crrd_latency(i, &after[i]);
+		if (after[i].count - before[i].count != 1000) {
+			fprintf(stderr, "latency %d counted %lu of 1000\n",
+				i, after[i].count - before[i].count);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i = 0; i < 4; ++i) {
+		(void) pthread_create(&thread[i], NULL, latency_thread,
+		    (void *)(uintptr_t)(1000000000ULL * (i + 1)));
+	}
+	for (int i = 0; i < 4; ++i) {
+		pthread_join(thread[i], NULL);
+	}
+	if (lat_hist[CRRD_LAT_QUERY].max < 4000000000ULL + 99999) {
+		fprintf(stderr, "latency max lost\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_latency_dump(stderr);
+	fprintf(stderr, "latency_test complete\n");
+}
+#endif
+
+/*
+ * crrdd test
+ *
+ * A daemon on a thread, two clients. The series one client creates,
+ * the other finds; samples sent through the daemon must give the same
+ * answers as the same samples added here. One client sends through a
+ * shared ring, small enough to fill; the other over the socket. A
+ * third never reads its replies, and is dropped rather than stalling
+ * the others.
+ */
+static void *
+crrdd_thread(void *arg)
+{
+	return ((void *)(intptr_t)crrdd_run(arg));
+}
+
+void
+crrdd_test(void)
+{
+	dbrrd_spec_t spec[] = {
+		{ 24, SEC2HR(3600) },
+		{ 60, SEC2HR(60) },
+		{ 60, SEC2HR(1) },
+		{ 0, 0 },
+	};
+	dbrrd_spec_t bad[] = {
+		{ 60, SEC2HR(1) },
+		{ 60, SEC2HR(60) },
+		{ 0, 0 },
+	};
+	dbrrd_spec_t huge[] = {
+		{ CRRDD_MAXCAP + 1, SEC2HR(1) },
+		{ 0, 0 },
+	};
+	struct timespec nap = { 0, 1000000 };
+	struct {
+		crrdd_hdr_t h;
+		crrdd_query_t q;
+	} qm;
+	struct sockaddr_un sa;
+	char buf[256];
+	char path[64];
+	pthread_t thread;
+	crrdd_t *d;
+	crrdc_t *a, *b;
+	rrd_t *sum, *max;
+	int ids, idm;
+	uint64_t taken;
+	hrtime_t t, tv, res, cres;
+	double v, cv;
+	void *p;
+	int r, cr;
+
+	fprintf(stderr, "crrdd_test\n");
+	snprintf(path, sizeof (path), "/tmp/crrdd_test.%d.sock",
+	    (int)getpid());
+	/* A socket left behind by a daemon that is gone is replaced */
+	memset(&sa, 0, sizeof (sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	r = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if ((r < 0) || (bind(r, (struct sockaddr *)&sa, sizeof (sa)) != 0)) {
+		fprintf(stderr, "crrdd_test: no stale socket\n");
+		exit(EXIT_FAILURE);
+	}
+	(void) close(r);
+	d = crrdd_create(path);
+	if ((d == NULL) ||
+	    (pthread_create(&thread, NULL, crrdd_thread, d) != 0)) {
+		fprintf(stderr, "crrdd_test: no daemon\n");
+		exit(EXIT_FAILURE);
+	}
+	/* A live one is not */
+	if ((crrdd_create(path) != NULL) || (errno != EADDRINUSE)) {
+		fprintf(stderr, "crrdd_test: live daemon replaced\n");
+		exit(EXIT_FAILURE);
+	}
+	a = crrdc_open(path);
+	b = crrdc_open(path);
+	if ((a == NULL) || (b == NULL)) {
+		fprintf(stderr, "crrdd_test: cannot connect\n");
+		exit(EXIT_FAILURE);
+	}
+	ids = crrdc_create(a, "bytes", CRRDD_AGG_SUM, spec);
+	idm = crrdc_create(a, "latency", CRRDD_AGG_MAX, spec);
+	if ((ids < 0) || (idm < 0) || (ids == idm) ||
+	    (crrdc_create(b, "bytes", CRRDD_AGG_SUM, spec) != ids) ||
+	    (crrdc_lookup(b, "latency") != idm) ||
+	    (crrdc_create(b, "bytes", CRRDD_AGG_MAX, spec) != CRRDD_E_EXIST) ||
+	    (crrdc_create(b, "x", CRRDD_AGG_SUM, bad) != CRRDD_E_INVAL) ||
+	    (crrdc_create(b, "x", CRRDD_AGG_SUM, huge) != CRRDD_E_INVAL) ||
+	    (crrdc_lookup(b, "nope") != CRRDD_E_NOENT) ||
+	    (crrdd_nseries(d) != 2)) {
+		fprintf(stderr, "crrdd_test: registry wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Too short for a header: no reply, so the next call gets its own */
+	if ((send(b->fd, "crd", 3, 0) != 3) ||
+	    (crrdc_lookup(b, "bytes") != ids)) {
+		fprintf(stderr, "crrdd_test: short message answered\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Queries whose replies are never read fill the socket */
+	r = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if ((r < 0) || (connect(r, (struct sockaddr *)&sa, sizeof (sa)) != 0)) {
+		fprintf(stderr, "crrdd_test: cannot connect\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(&qm, 0, sizeof (qm));
+	qm.h.magic = CRRDD_MAGIC;
+	qm.h.op = CRRDD_OP_QUERY;
+	qm.q.id = ids;
+	for (int i = 0, tries = 0; (i < 10000) && (tries < 1000); ) {
+		if (send(r, &qm, sizeof (qm), MSG_DONTWAIT | MSG_NOSIGNAL) ==
+		    sizeof (qm)) {
+			++i;
+		} else if (errno == EAGAIN) {
+			++tries;
+			nanosleep(&nap, NULL);
+		} else {
+			break;
+		}
+	}
+	if (crrdc_lookup(b, "bytes") != ids) {
+		fprintf(stderr, "crrdd_test: stalled by a client\n");
+		exit(EXIT_FAILURE);
+	}
+	/* That client is closed: its replies end */
+	while ((cr = recv(r, buf, sizeof (buf), 0)) > 0)
+		;
+	(void) close(r);
+	if (cr != 0) {
+		fprintf(stderr, "crrdd_test: stalled client not closed\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((crrdc_shm(a, 100) != CRRDD_E_INVAL) ||
+	    (crrdc_shm(a, 256) != 0) ||
+	    (crrdc_shm(a, 256) != CRRDD_E_EXIST)) {
+		fprintf(stderr, "crrdd_test: no ring\n");
+		exit(EXIT_FAILURE);
+	}
+
+	sum = dbrrd_create("bytes", spec, sizeof (double), dd_sum_update,
+	    dd_sum_zero);
+	max = dbrrd_create("latency", spec, sizeof (double), dd_max_update,
+	    dd_value_zero);
+	srandom(1);
+	t = SEC2HR(1000000);
+	for (int i = 0; i < 100000; ++i) {
+		t += (random() % 100 == 0) ? SEC2HR(random() % 600) :
+		    random() % SEC2HR(1);
+		v = random() % 1000;
+		dbrrd_add_at(sum, &v, t);
+		crrdc_add(a, ids, t, v);
+		v = random() % 1000;
+		dbrrd_add_at(max, &v, t);
+		crrdc_add(b, idm, t, v);
+	}
+	/* Unknown ids are not taken */
+	crrdc_add(a, 999, t, 1);
+	if ((crrdc_sync(a, &taken) != 0) || (taken != 100000) ||
+	    (crrdc_sync(b, &taken) != 0) || (taken != 100000)) {
+		fprintf(stderr, "crrdd_test: samples lost\n");
+		exit(EXIT_FAILURE);
+	}
+	for (tv = t - SEC2HR(86400); tv <= t + SEC2HR(1);
+	    tv += SEC2HR(7)) {
+		r = dbrrd_query(sum, tv, &p, &res);
+		cr = crrdc_query(b, ids, tv, &cv, &cres);
+		if ((r != cr) || (r && ((res != cres) ||
+		    (*(double *)p != cv)))) {
+			fprintf(stderr, "crrdd_test: sum differs at %ld\n",
+			    HR2SEC(tv));
+			exit(EXIT_FAILURE);
+		}
+		r = dbrrd_query(max, tv, &p, &res);
+		cr = crrdc_query(a, idm, tv, &cv, &cres);
+		if ((r != cr) || (r && ((res != cres) ||
+		    (*(double *)p != cv)))) {
+			fprintf(stderr, "crrdd_test: max differs at %ld\n",
+			    HR2SEC(tv));
+			exit(EXIT_FAILURE);
+		}
+	}
+	crrdc_close(a);
+	crrdc_close(b);
+	crrdd_stop(d);
+	pthread_join(thread, &p);
+	crrdd_destroy(d);
+	if ((p != NULL) || (access(path, F_OK) == 0)) {
+		fprintf(stderr, "crrdd_test: unclean stop\n");
+		exit(EXIT_FAILURE);
+	}
+	dbrrd_destroy(sum);
+	dbrrd_destroy(max);
+	fprintf(stderr, "crrdd_test complete\n");
+}
+
+/*
+ * Line protocol test
+ *
+ * Numbers in the formats printf makes must parse to exactly what
+ * strtod() makes of them; the odd lines must parse (or not) as the
+ * protocol says; a stream cut at random points must parse as it does
+ * whole; and lines added to dbrrds must match the samples added here.
+ */
+#define	LINE_N	20000
+
+typedef struct line_got {
+	int n;
+	char name[LINE_N][16];
+	double v[LINE_N];
+	hrtime_t t[LINE_N];
+} line_got_t;
+
+static line_got_t line_want, line_got;
+
+static void
+line_collect(void *arg, const char *name, size_t len, double v, hrtime_t t)
+{
+	line_got_t *g = arg;
+
+	if ((g->n == LINE_N) || (len >= sizeof (g->name[0]))) {
+		fprintf(stderr, "line_test: too many, or too long\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(g->name[g->n], name, len);
+	g->name[g->n][len] = '\0';
+	g->v[g->n] = v;
+	g->t[g->n] = t;
+	++g->n;
+}
+
+static void
+line_check(const char *what)
+{
+	if (line_got.n != line_want.n) {
+		fprintf(stderr, "line_test: %s: %d samples, not %d\n", what,
+		    line_got.n, line_want.n);
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < line_want.n; ++i) {
+		if ((strcmp(line_got.name[i], line_want.name[i]) != 0) ||
+		    (memcmp(&line_got.v[i], &line_want.v[i],
+		    sizeof (double)) != 0) ||
+		    (line_got.t[i] != line_want.t[i])) {
+			fprintf(stderr, "line_test: %s: sample %d is %s %.17g "
+			    "%lld, not %s %.17g %lld\n", what, i,
+			    line_got.name[i], line_got.v[i],
+			    (long long)line_got.t[i], line_want.name[i],
+			    line_want.v[i], (long long)line_want.t[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static rrd_t *line_rrd[2];
+
+static rrd_t *
+line_lookup(void *arg, const char *name, size_t len)
+{
+	arg = arg;
+	if ((len == 1) && (*name == 'x')) {
+		return (line_rrd[0]);
+	}
+	if ((len == 1) && (*name == 'y')) {
+		return (line_rrd[1]);
+	}
+	return (NULL);
+}
+
+void
+line_test(void)
+{
+	static const char *fmt[] = {
+		"%.17g", "%.6f", "%g", "%.3e", "%.0f", "%.10g", "%+.2f",
+	};
+	static const char odd[] =
+	    "\n"
+	    "  a 1 100\n"
+	    "b\t-2.5e3\t100.5\r\n"
+	    "c 3\n"
+	    "d  4  \n"
+	    "e\n"
+	    "f abc 1\n"
+	    "g 1 x\n"
+	    "h 1 2 3\n"
+	    "i 1e 5\n"
+	    "j 0.000001 5\n"
+	    "k 12345678901234567890123 5\n"
+	    "l 5";
+	dbrrd_spec_t spec[] = {
+		{ 60, SEC2HR(60) },
+		{ 60, SEC2HR(1) },
+		{ 0, 0 },
+	};
+	hrtime_t now = SEC2HR(1000), t, res, cres;
+	crrd_line_stats_t st;
+	rrd_t *mine[2];
+	char num[64], *buf;
+	size_t len, at, used, avail;
+	uint64_t bits;
+	double v;
+	void *p, *cp;
+	int r, cr;
+
+	fprintf(stderr, "line_test\n");
+	buf = malloc(LINE_N * 128);
+	len = 0;
+	srandom(1);
+	line_want.n = 0;
+	for (int i = 0; i < LINE_N; ++i) {
+		if (i % 2) {
+			do {
+				bits = ((uint64_t)random() << 33) ^
+				    ((uint64_t)random() << 11) ^ random();
+				memcpy(&v, &bits, sizeof (v));
+			} while (isnan(v) || isinf(v));
+		} else {
+			v = (random() % 2000001 - 1000000) /
+			    (double)(1 << (random() % 12));
+		}
+		snprintf(num, sizeof (num), fmt[random() % 7], v);
+		snprintf(line_want.name[i], sizeof (line_want.name[i]),
+		    "s.%d", (int)(random() % 1000));
+		line_want.v[i] = strtod(num, NULL);
+		t = SEC2HR(1700000000LL + i);
+		len += sprintf(buf + len, "%s%c%s", line_want.name[i],
+		    (i % 3) ? ' ' : '\t', num);
+		if (i % 7 == 0) {
+			t = now;
+		} else if (i % 3 == 0) {
+			t += random() % SEC2HR(1);
+			len += sprintf(buf + len, " %lld.%09lld",
+			    (long long)(t / SEC2HR(1)),
+			    (long long)(t % SEC2HR(1)));
+		} else {
+			len += sprintf(buf + len, " %lld",
+			    (long long)(t / SEC2HR(1)));
+		}
+		len += sprintf(buf + len, (i % 5) ? "\n" : "\r\n");
+		line_want.t[i] = t;
+		++line_want.n;
+	}
+
+	/* Whole */
+	memset(&st, 0, sizeof (st));
+	line_got.n = 0;
+	used = crrd_line_parse(buf, len, now, line_collect, &line_got, &st);
+	if ((used != len) || (st.lines != LINE_N) || (st.bad != 0)) {
+		fprintf(stderr, "line_test: whole buffer not parsed\n");
+		exit(EXIT_FAILURE);
+	}
+	line_check("whole");
+
+	/* Cut at random, the unused tail carried over */
+	line_got.n = 0;
+	for (at = 0, avail = 0; avail < len; ) {
+		avail += 1 + random() % 200;
+		if (avail > len) {
+			avail = len;
+		}
+		at += crrd_line_parse(buf + at, avail - at, now,
+		    line_collect, &line_got, NULL);
+	}
+	if (at != len) {
+		fprintf(stderr, "line_test: cut buffer not parsed\n");
+		exit(EXIT_FAILURE);
+	}
+	line_check("cut");
+
+	/* The odd lines */
+	memset(&st, 0, sizeof (st));
+	line_got.n = 0;
+	used = crrd_line_parse(odd, strlen(odd), now, line_collect,
+	    &line_got, &st);
+	if ((used != strlen(odd) - 3) || (st.lines != 6) || (st.bad != 5) ||
+	    (line_got.v[0] != 1) || (line_got.t[0] != SEC2HR(100)) ||
+	    (line_got.v[1] != -2500) ||
+	    (line_got.t[1] != SEC2HR(100) + SEC2HR(1) / 2) ||
+	    (line_got.t[2] != now) || (line_got.v[3] != 4) ||
+	    (line_got.t[3] != now) || (line_got.v[4] != 0.000001) ||
+	    (line_got.v[5] != strtod("12345678901234567890123", NULL)) ||
+	    (strcmp(line_got.name[5], "k") != 0)) {
+		fprintf(stderr, "line_test: odd lines wrong\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Numbers longer than the copy on the stack */
+	len = sprintf(buf, "m 1%0100d 5\nn 0.%0100d1e-3 5\n", 0, 0);
+	line_got.n = 0;
+	if ((crrd_line_parse(buf, len, now, line_collect, &line_got,
+	    NULL) != len) || (line_got.n != 2) ||
+	    (line_got.v[0] != strtod(buf + 2, NULL)) ||
+	    (line_got.v[1] != strtod(strchr(buf, 'n') + 2, NULL))) {
+		fprintf(stderr, "line_test: long numbers wrong\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Into dbrrds */
+	for (int i = 0; i < 2; ++i) {
+		line_rrd[i] = dbrrd_create("line", spec, sizeof (double),
+		    dd_sum_update, dd_sum_zero);
+		mine[i] = dbrrd_create("mine", spec, sizeof (double),
+		    dd_sum_update, dd_sum_zero);
+	}
+	len = 0;
+	t = SEC2HR(1000000);
+	for (int i = 0; i < LINE_N; ++i) {
+		t += random() % SEC2HR(2);
+		v = random() % 1000;
+		r = random() % 3;
+		if (r < 2) {
+			dbrrd_add_at(mine[r], &v, t);
+		}
+		len += sprintf(buf + len, "%c %g %lld.%09lld\n", "xyz"[r], v,
+		    (long long)(t / SEC2HR(1)), (long long)(t % SEC2HR(1)));
+	}
+	memset(&st, 0, sizeof (st));
+	if ((crrd_line_add(buf, len, now, line_lookup, NULL, &st) != len) ||
+	    (st.lines != LINE_N) || (st.unknown == 0) ||
+	    (st.unknown == LINE_N)) {
+		fprintf(stderr, "line_test: not added\n");
+		exit(EXIT_FAILURE);
+	}
+	for (hrtime_t tv = t - SEC2HR(3600); tv <= t; tv += SEC2HR(1)) {
+		for (int i = 0; i < 2; ++i) {
+			r = dbrrd_query(mine[i], tv, &p, &res);
+			cr = dbrrd_query(line_rrd[i], tv, &cp, &cres);
+			if ((r != cr) || (r && ((res != cres) ||
+			    (*(double *)p != *(double *)cp)))) {
+				fprintf(stderr, "line_test: rrd differs at "
+				    "%ld\n", HR2SEC(tv));
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	for (int i = 0; i < 2; ++i) {
+		dbrrd_destroy(line_rrd[i]);
+		dbrrd_destroy(mine[i]);
+	}
+	free(buf);
+	fprintf(stderr, "line_test complete\n");
+}
+
+/*
+ * StatsD test
+ *
+ * Datagrams parsed and flushed by hand must give the aggregates the
+ * protocol says, period by period, with gaps filled as each type says.
+ * Then a listener on a thread must take datagrams sent to it over
+ * loopback, and hold their sum across the periods they landed in.
+ */
+static void *
+statsd_thread(void *arg)
+{
+	return ((void *)(intptr_t)crrd_statsd_run(arg));
+}
+
+/* Sum of a counter over [from, to], a finest period at a time */
+static double
+statsd_sum(rrd_t *h, hrtime_t from, hrtime_t to)
+{
+	hrtime_t tv, res;
+	double sum = 0;
+	void *p;
+
+	for (tv = from; tv <= to; tv += SEC2HR(1)) {
+		if (dbrrd_query(h, tv, &p, &res) && (res == SEC2HR(1))) {
+			sum += *(double *)p;
+		}
+	}
+	return (sum);
+}
+
+void
+statsd_test(void)
+{
+	static const char d1[] =
+	    "a:1|c\n"
+	    "a:2|c|@0.5\n"
+	    "t:10|ms\n"
+	    "t:30|ms|#host:x\n"
+	    "t:20|h|@0.5\r\n"
+	    "g:5|g\n"
+	    "g:+2|g\n"
+	    "g:-1|g\n"
+	    "\n"
+	    "bad\n"
+	    "x:1|s\n"
+	    "x:abc|c\n"
+	    "a:1|ms\n"
+	    "z:1|c|@0.5x\n"
+	    "w:1|c|@0.5|#host:x\n"
+	    "y:1|c|@2";
+	static const char d2[] = "a:3|c\ng:+1|g";
+	dbrrd_spec_t spec[] = {
+		{ 60, SEC2HR(60) },
+		{ 60, SEC2HR(1) },
+		{ 0, 0 },
+	};
+	hrtime_t t0 = SEC2HR(1000020), res, from, to;
+	crrd_statsd_stats_t st;
+	crrd_statsd_timer_t *tm;
+	struct sockaddr_in sa;
+	crrd_statsd_t *s;
+	pthread_t thread;
+	rrd_t *a, *g, *t, *u;
+	char dgram[64];
+	void *p;
+	int type, fd, n;
+
+	fprintf(stderr, "statsd_test\n");
+	(void) crrd_setclock(CRRD_CLOCK_REALTIME);
+	if (crrd_statsd_create("no address", 0, spec) != NULL) {
+		fprintf(stderr, "statsd_test: bad address taken\n");
+		exit(EXIT_FAILURE);
+	}
+	s = crrd_statsd_create(NULL, 0, spec);
+	if ((s == NULL) || (crrd_statsd_port(s) <= 0)) {
+		fprintf(stderr, "statsd_test: no listener\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* By hand: two periods, a gap between them */
+	crrd_statsd_parse(s, d1, strlen(d1));
+	crrd_statsd_flush(s, t0);
+	crrd_statsd_parse(s, d2, strlen(d2));
+	crrd_statsd_flush(s, t0 + SEC2HR(2));
+	crrd_statsd_stats(s, &st);
+	a = crrd_statsd_series(s, "a", &type);
+	t = crrd_statsd_series(s, "t", NULL);
+	g = crrd_statsd_series(s, "g", NULL);
+	if ((st.packets != 2) || (st.metrics != 11) || (st.bad != 6) ||
+	    (a == NULL) || (type != CRRD_STATSD_COUNTER) || (t == NULL) ||
+	    (g == NULL) || (crrd_statsd_series(s, "x", NULL) != NULL) ||
+	    (crrd_statsd_series(s, "y", NULL) != NULL) ||
+	    (crrd_statsd_series(s, "z", NULL) != NULL) ||
+	    (crrd_statsd_series(s, "w", NULL) == NULL)) {
+		fprintf(stderr, "statsd_test: wrong lines taken\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!dbrrd_query(a, t0, &p, &res) || (res != SEC2HR(1)) ||
+	    (*(double *)p != 5) ||
+	    !dbrrd_query(a, t0 + SEC2HR(1), &p, &res) ||
+	    (*(double *)p != 0) ||
+	    !dbrrd_query(a, t0 + SEC2HR(2), &p, &res) ||
+	    (*(double *)p != 3)) {
+		fprintf(stderr, "statsd_test: counter wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!dbrrd_query(g, t0, &p, &res) || (*(double *)p != 6) ||
+	    !dbrrd_query(g, t0 + SEC2HR(1), &p, &res) ||
+	    (*(double *)p != 6) ||
+	    !dbrrd_query(g, t0 + SEC2HR(2), &p, &res) ||
+	    (*(double *)p != 7)) {
+		fprintf(stderr, "statsd_test: gauge wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!dbrrd_query(t, t0, &p, &res)) {
+		fprintf(stderr, "statsd_test: no timer\n");
+		exit(EXIT_FAILURE);
+	}
+	tm = p;
+	if ((tm->count != 4) || (tm->sum != 80) || (tm->min != 10) ||
+	    (tm->max != 30)) {
+		fprintf(stderr, "statsd_test: timer wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	/* The minute holds both periods */
+	a = a->next;
+	if ((rrd_tail(a) < 0) ||
+	    (*(double *)rrd_entry(a, rrd_tail(a)) != 8)) {
+		fprintf(stderr, "statsd_test: counter minute wrong\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Over loopback */
+	if (pthread_create(&thread, NULL, statsd_thread, s) != 0) {
+		fprintf(stderr, "statsd_test: no thread\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(&sa, 0, sizeof (sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(crrd_statsd_port(s));
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	/* Period starts: a query past the last sample finds nothing */
+	from = crrd_now();
+	from -= from % SEC2HR(1) + SEC2HR(1);
+	for (int i = 0; i < 100; ++i) {
+		n = snprintf(dgram, sizeof (dgram), "u:1|c\nu:%d|c", i);
+		if (sendto(fd, dgram, n, 0, (struct sockaddr *)&sa,
+		    sizeof (sa)) != n) {
+			fprintf(stderr, "statsd_test: cannot send\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	(void) close(fd);
+	for (int i = 0; i < 500; ++i) {
+		crrd_statsd_stats(s, &st);
+		if (st.packets == 102) {
+			break;
+		}
+		usleep(10000);
+	}
+	crrd_statsd_stop(s);
+	pthread_join(thread, &p);
+	to = crrd_now() + SEC2HR(1);
+	u = crrd_statsd_series(s, "u", NULL);
+	if ((p != NULL) || (st.packets != 102) || (u == NULL) ||
+	    (statsd_sum(u, from, to) != 100 + 99 * 100 / 2)) {
+		fprintf(stderr, "statsd_test: loopback samples lost\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Past the limit, new names are bad; known ones still count */
+	s->limit = s->nmetric + 1;
+	crrd_statsd_stats(s, &st);
+	n = st.bad;
+	crrd_statsd_parse(s, "n1:1|c\nn2:1|c\na:1|c", 19);
+	crrd_statsd_stats(s, &st);
+	if ((st.bad != n + 1) ||
+	    (crrd_statsd_series(s, "n1", NULL) == NULL) ||
+	    (crrd_statsd_series(s, "n2", NULL) != NULL)) {
+		fprintf(stderr, "statsd_test: metric limit not kept\n");
+		exit(EXIT_FAILURE);
+	}
+	crrd_statsd_destroy(s);
+	fprintf(stderr, "statsd_test complete\n");
+}
+
 int
 main(int ac, char **av)
 {
@@ -719,6 +3033,25 @@ main(int ac, char **av)
 	complex_test();
 	dbrrd_test();
 	txg_test();
+	group_test();
+	wheel_test();
+	pool_test();
+	bulk_test();
+	multi_test();
+	stats_test();
+	metrics_test();
+	reorder_test();
+	fill_test();
+	stage_test();
+	range_test();
+	clock_test();
+	ticker_test();
+	crrdd_test();
+	line_test();
+	statsd_test();
+#ifdef CRRD_LATENCY
+	latency_test();
+#endif
 	return (EXIT_SUCCESS);
 }
 
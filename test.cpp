@@ -0,0 +1,148 @@
+/*
+ * test.cpp
+ *
+ * Test for crrd.hpp, the C++ front-end: the template database must
+ * agree with the C library sample for sample.
+ *
+ * gcc -DTESTING -O2 -c crrd.c -o crrd.o
+ * g++ -std=c++17 -DTESTING -O2 test.cpp crrd.o -o testcpp
+ */
+
+#ifndef TESTING
+#  define TESTING
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include "crrd.h"
+#include "crrd.hpp"
+
+#define SEC2HR(s) ((hrtime_t)((s) * 1000LL * 1000LL * 1000LL))
+
+/* The C library's view of crrd::Sum<uint32_t> */
+static void
+sum_update(rrd_t *r, void *pv)
+{
+	uint32_t *c = (uint32_t *)rrd_entry(r, rrd_tail(r));
+
+	*c += *(uint32_t *)pv;
+}
+
+static void
+sum_zero(rrd_t *r, void *pv)
+{
+	uint32_t *c = (uint32_t *)rrd_entry(r, rrd_tail(r));
+
+	(void) pv;
+	*c = 0;
+}
+
+/* And of crrd::First<uint32_t>, as for txgs */
+static void
+first_update(rrd_t *r, void *pv)
+{
+	(void) r; (void) pv;
+}
+
+static void
+first_zero(rrd_t *r, void *pv)
+{
+	memcpy(rrd_entry(r, rrd_tail(r)), pv, sizeof (uint32_t));
+}
+
+/* The spec checks, at compile time */
+typedef crrd::Tier<24, crrd::seconds(3600)> hours;
+typedef crrd::Tier<60, crrd::seconds(60)> minutes;
+typedef crrd::Tier<60, crrd::seconds(1)> secs;
+typedef crrd::Tier<10, crrd::seconds(7)> sevens;
+
+static_assert(crrd::Spec<hours, minutes, secs>::ordered, "ordered");
+static_assert(crrd::Spec<hours, minutes, secs>::divisible, "divisible");
+static_assert(!crrd::Spec<minutes, hours>::ordered, "misordered");
+static_assert(!crrd::Spec<minutes, sevens>::divisible, "not divisible");
+static_assert(crrd::Spec<hours, minutes, secs>::entries == 144, "entries");
+static_assert(crrd::Database<uint32_t, crrd::Sum<uint32_t>, hours, minutes,
+    secs>::bytes == 144 * sizeof (uint32_t), "bytes");
+
+static constexpr auto c_spec =
+    crrd::Spec<hours, minutes, secs>::c_spec<dbrrd_spec_t>();
+static_assert(c_spec[1].capacity == 60 && c_spec[1].tv == SEC2HR(60) &&
+    c_spec[3].capacity == 0, "c_spec");
+/*
+ * Neither of these builds (crrd::Database<..., minutes, sevens> does
+ * not either):
+ *
+ *   crrd::Spec<minutes, hours>::c_spec<dbrrd_spec_t>();
+ *   crrd::Spec<minutes, sevens>::c_spec<dbrrd_spec_t>();
+ */
+
+/*
+ * Feed the same stream (mostly forward, with gaps and the odd late
+ * sample) to both, then query both over the whole range.
+ */
+template <typename Db>
+static void
+compare(const char *name, void *update, void *zero)
+{
+	auto spec = Db::spec::template c_spec<dbrrd_spec_t>();
+	static Db db;
+	const uint32_t *cv;
+	hrtime_t cres, res;
+	hrtime_t t, tv;
+	uint32_t v;
+	void *p;
+	rrd_t *h;
+	int found, cfound;
+
+	fprintf(stderr, "compare %s\n", name);
+	h = dbrrd_create((char *)name, spec.data(), sizeof (uint32_t), update,
+	    zero);
+	if (h == NULL) {
+		fprintf(stderr, "dbrrd_create failed\n");
+		exit(EXIT_FAILURE);
+	}
+	srandom(1);
+	t = SEC2HR(1000000);
+	for (int i = 0; i < 200000; ++i) {
+		switch (random() % 100) {
+		case 0:
+			t += SEC2HR(random() % 7200);	/* gap */
+			break;
+		case 1:
+			t -= SEC2HR(random() % 5);	/* late */
+			break;
+		default:
+			t += random() % SEC2HR(1);
+			break;
+		}
+		v = random() % 1000;
+		dbrrd_add_at(h, &v, t);
+		db.add_at(v, t);
+	}
+	for (tv = t - SEC2HR(86400 + 3600); tv <= t + SEC2HR(2);
+	    tv += SEC2HR(1) / 3) {
+		found = dbrrd_query(h, tv, &p, &res);
+		cfound = db.query(tv, &cv, &cres);
+		if ((found != cfound) || (found && ((res != cres) ||
+		    (*(uint32_t *)p != *cv)))) {
+			fprintf(stderr, "%s differs at %lld\n", name, tv);
+			exit(EXIT_FAILURE);
+		}
+	}
+	dbrrd_destroy(h);
+	fprintf(stderr, "compare %s complete\n", name);
+}
+
+int
+main(int ac, char **av)
+{
+	(void) ac; (void) av;
+	printf("crrd - C++ front-end\n");
+	compare<crrd::Database<uint32_t, crrd::Sum<uint32_t>, hours, minutes,
+	    secs>>("sum", (void *)sum_update, (void *)sum_zero);
+	compare<crrd::Database<uint32_t, crrd::First<uint32_t>, hours, minutes,
+	    secs>>("first", (void *)first_update, (void *)first_zero);
+	return (EXIT_SUCCESS);
+}